@@ -3,9 +3,13 @@
 
 #include "common/file_operations.h"
 #include "common/Game.h"
+#include "common/HashRegistry.h"
+#include "common/packets.h"
 
 #include <boost/asio.hpp>
 
+#include <string>
+
 using namespace boost;
 using boost::asio::ip::tcp;
 
@@ -27,15 +31,39 @@ class Client {
    */
   SHAFileMap botMap;
 
+  //! Interned ids for the maps in mapMap.
+  HashRegistry mapRegistry;
+
+  //! Interned ids for the bots in botMap.
+  HashRegistry botRegistry;
+
   //! The TCP socket this client is connected on.
   tcp::socket _socket;
 
-  //! The buffer this client uses.
-  boost::asio::streambuf buffer;
+  //! The bytes queued for the server.
+  boost::asio::streambuf outbox;
+
+  //! The bytes read from the server that haven't been handled yet.
+  boost::asio::streambuf inbox;
 
   //! The game this client is currently playing.
   Game game;
 
+  //! How many games we want queued up at once.
+  uint8_t queueDepth;
+
+  //! The games the server has sent us.
+  size_t gamesReceived = 0;
+
+  //! Digest of our handshake, presented along with the session to resume it.
+  SHA256Hash catalog;
+
+  //! Has the server given us a session?
+  bool hasSession = false;
+
+  //! The session the server gave us, a new connection can resume it instead of handshaking.
+  SessionToken session;
+
 public:
   //! Get the TCP socket this client is connected on.
   tcp::socket& socket()
@@ -52,20 +80,28 @@ public:
    * @param port The port to connect to.
    * @param botDir The directory that contains bots for this client.
    * @param mapDir The directory that contains maps for this client.
+   * @param hashConfig How to hash the bot and map directories.
+   * @param queueDepth How many games to ask the server to keep queued up for us.
    */
   Client(asio::io_service &service, std::string host, std::string port, std::string botDir,
-         std::string mapDir);
+         std::string mapDir, const HashConfig &hashConfig, uint8_t queueDepth = 1);
 
 private:
   // State functions
   //! Send the client handshake to the server.
   void sendHandshake();
-  //! Receive a pregame command.
-  void readPregameCommand();
+  //! Handle every whole frame that's arrived, then read more.
+  void readFrames();
+  //! Handle one frame, returns false if there's nothing more to read after it.
+  bool handleFrame(const FrameHeader &header);
+  //! Give up on a server that's gone or sent something we can't handle.
+  void dropServer(const std::string &reason);
+  //! Read the session the server's given us, returns true if it kept our game for us.
+  bool readSession(size_t length);
   //! Read a reason code for pregame disconnect.
-  void readPregameDisconnectReason();
+  void readPregameDisconnectReason(size_t length);
   //! Read a game sent to be scheduled.
-  void readStartGame();
+  void readStartGame(size_t length);
 };
 
 } // End sc2tm namespace
@@ -0,0 +1,23 @@
+#ifndef SC2TM_CLIENTOPTS_H
+#define SC2TM_CLIENTOPTS_H
+
+#include "common/CLOpts.h"
+#include "common/config.h"
+
+namespace sc2tm {
+
+class ClientOpts : public CLOpts {
+public:
+  ClientOpts() : CLOpts() {
+    usageHeader = "Starcraft 2 Tournament Manager Client v" + sc2tm::clientVersionStr;
+    registerOption("queue-depth",
+                   "Games to have queued up at once, so the next can start as soon as one ends",
+                   false);
+  }
+
+private:
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_CLIENTOPTS_H
@@ -1,6 +1,8 @@
 #ifndef SC2TM_CLOPTS_H
 #define SC2TM_CLOPTS_H
 
+#include "common/file_operations.h"
+
 #include <map>
 #include <string>
 
@@ -37,6 +39,17 @@ public:
     return optionResults[name];
   }
 
+  //! Was a flag given?
+  bool getFlag(std::string name) {
+    return flagResults[name];
+  }
+
+  //! Get an option as an unsigned number, or a default if it wasn't given or isn't a number.
+  unsigned getUnsignedOpt(std::string name, unsigned def);
+
+  //! Get the directory hashing settings from the options.
+  HashConfig getHashConfig();
+
 protected:
   //! Register a new option to be parsed
   /**
@@ -1,20 +1,29 @@
 #ifndef SC2TM_GAME_H
 #define SC2TM_GAME_H
 
-#include "common/sha256.h"
+#include "common/HashRegistry.h"
 
 namespace sc2tm {
 
+//! Id the server gives each game it hands out.
+typedef uint32_t GameId;
+
+//! Id a connection gives each game it hands its client, the client reports on it with the same one.
+typedef uint32_t GameTicket;
+
 //! Lightweight container for a game.
 struct Game {
   // We don't want to duplicate data here like we do in packets because we can have so many of these
-  // alive at any time. Using the shared_ptr saves us a bit of memory.
+  // alive at any time. Ids are interned in a HashRegistry and only become hashes again when they
+  // go out in a packet.
   //! The first participant in the game.
-  SHA256Hash::ptr bot0;
+  BotId bot0;
   //! The second participant in the game.
-  SHA256Hash::ptr bot1;
+  BotId bot1;
   //! The map the game will be played on.
-  SHA256Hash::ptr map;
+  MapId map;
+  //! The id the server handed the game out with, copies of a game share it.
+  GameId id;
 };
 
 }
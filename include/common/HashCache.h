@@ -0,0 +1,117 @@
+#ifndef SC2TM_HASHCACHE_H
+#define SC2TM_HASHCACHE_H
+
+#include "common/sha256.h"
+
+#include <experimental/filesystem>
+#include <map>
+#include <memory>
+#include <string>
+
+namespace fs = std::experimental::filesystem;
+
+namespace sc2tm {
+
+//! Identifies a particular version of a file on disk.
+/**
+ * Identifies a particular version of a file on disk. If any of these change the file has to be
+ * rehashed.
+ */
+struct FileKey {
+  //! The device the file lives on.
+  uint64_t dev;
+  //! The file's inode.
+  uint64_t ino;
+  //! The file's size in bytes.
+  uint64_t size;
+  //! The file's modification time in nanoseconds.
+  int64_t mtimeNs;
+
+  //! Fill in a key for a file. Returns false if the file couldn't be stat'd.
+  static bool fromFile(const fs::path &path, FileKey &key);
+
+  //! Do two keys describe the same file version?
+  bool operator==(const FileKey &other) const {
+    return dev == other.dev && ino == other.ino && size == other.size && mtimeNs == other.mtimeNs;
+  }
+};
+
+//! Persistent cache of file hashes.
+/**
+ * Persistent cache of file hashes so that unchanged bots and maps don't need to be rehashed every
+ * time the server or client starts. The cache file is memory mapped on load and searched in place,
+ * so loading costs the same no matter how many files it holds.
+ *
+ * The file is a header, followed by fixed size records sorted by path, followed by the path
+ * strings. Everything is in host byte order; the cache describes local files so it's never moved
+ * between machines. Entries recorded during this run replace the loaded ones when saved, so files
+ * that weren't hashed this run are dropped.
+ */
+class HashCache {
+public:
+  //! Convenience typedef for a cache shared ptr.
+  typedef std::shared_ptr<HashCache> ptr;
+
+  //! Load the cache at a path. A missing or invalid file just makes an empty cache.
+  HashCache(const std::string &path);
+
+  //! Unmaps the loaded cache.
+  ~HashCache();
+
+  //! No copying, we own the mapping.
+  HashCache(const HashCache &) = delete;
+  HashCache &operator=(const HashCache &) = delete;
+
+  //! Look up a file's hash, returns nullptr if it's missing or the key has changed.
+  /**
+   * Look up a file's hash, returns nullptr if it's missing or the key has changed.
+   *
+   * @param path The file's canonical path.
+   * @param key The file's current key.
+   */
+  SHA256Hash::ptr lookup(const fs::path &path, const FileKey &key) const;
+
+  //! Record a file's hash to be written on the next save.
+  void record(const fs::path &path, const FileKey &key, const SHA256Hash::ptr &hash);
+
+  //! Write the recorded entries to the cache file.
+  /**
+   * Write the recorded entries to the cache file. The file is written beside the old one and
+   * renamed over it so a crash never leaves a torn cache behind.
+   *
+   * @return True if the cache was written, false otherwise.
+   */
+  bool save() const;
+
+  //! How many lookups hit and missed.
+  size_t hits() const { return hitCount; }
+  size_t misses() const { return missCount; }
+
+private:
+  //! An entry recorded this run.
+  struct Entry {
+    FileKey key;
+    SHA256Hash::ptr hash;
+  };
+
+  //! Where the cache lives.
+  std::string path;
+
+  //! The mapped cache file, nullptr if nothing was loaded.
+  const uint8_t *mapped = nullptr;
+  //! The size of the mapping.
+  size_t mappedSize = 0;
+  //! The number of records in the mapping.
+  uint32_t recordCount = 0;
+
+  //! Entries recorded this run, ordered by path for writing.
+  std::map<std::string, Entry> recorded;
+
+  //! Lookup statistics, mutable since lookups are logically const.
+  mutable size_t hitCount = 0;
+  mutable size_t missCount = 0;
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_HASHCACHE_H
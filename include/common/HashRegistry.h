@@ -0,0 +1,64 @@
+#ifndef SC2TM_HASHREGISTRY_H
+#define SC2TM_HASHREGISTRY_H
+
+#include "common/file_operations.h"
+#include "common/sha256.h"
+
+#include <cstdint>
+#include <vector>
+
+namespace sc2tm {
+
+//! Dense id handed out for an interned hash.
+typedef uint32_t HashId;
+//! Id of an interned bot hash.
+typedef HashId BotId;
+//! Id of an interned map hash.
+typedef HashId MapId;
+
+//! The id returned for hashes that aren't in a registry.
+const HashId invalidHashId = UINT32_MAX;
+
+//! Interns hashes into dense integer ids.
+/**
+ * Interns hashes into dense integer ids. Built once from a catalog of files and never modified
+ * again, so it's safe to read from anywhere. Ids are the index of the hash in sorted order, so
+ * ordering ids orders the hashes as well.
+ *
+ * Everything past the network boundary works on ids; the registry is only used to translate to
+ * and from digests when packets are read or written.
+ */
+class HashRegistry {
+  //! The interned hashes, sorted and unique. A hash's id is its index.
+  std::vector<SHA256Hash> hashes;
+
+public:
+  //! Construct an empty registry.
+  HashRegistry() = default;
+
+  //! Intern every hash in a file map.
+  HashRegistry(const SHAFileMap &files);
+
+  //! Get the id of a digest, invalidHashId if it isn't interned.
+  HashId lookup(const uint8_t * const digest) const;
+
+  //! Get the id of a hash, invalidHashId if it isn't interned.
+  HashId lookup(const SHA256Hash &hash) const { return lookup(hash.get()); }
+
+  //! Get the hash for an id.
+  const SHA256Hash &hash(HashId id) const { return hashes[id]; }
+
+  //! The number of interned hashes, ids are [0, size()).
+  size_t size() const { return hashes.size(); }
+
+  //! A digest of every interned hash in id order.
+  /**
+   * A digest of every interned hash in id order. Two registries with the same digest give every
+   * hash the same id, so anything recorded by id under one can be read back under the other.
+   */
+  SHA256Hash digest() const;
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_HASHREGISTRY_H
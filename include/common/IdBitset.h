@@ -0,0 +1,183 @@
+#ifndef SC2TM_IDBITSET_H
+#define SC2TM_IDBITSET_H
+
+#include "common/HashRegistry.h"
+
+#include <cassert>
+#include <cstdint>
+#include <vector>
+
+namespace sc2tm {
+
+//! Dense set of interned hash ids.
+/**
+ * Dense set of interned hash ids, one bit per id in a registry. Set algebra works a word at a time
+ * over contiguous memory, which the compiler vectorizes, so intersecting two clients' worth of
+ * bots costs a few cache lines rather than a tree walk and an allocation per element.
+ *
+ * Sets taking part in the same operation must be sized from the same registry.
+ */
+class IdBitset {
+  //! Storage word.
+  typedef uint64_t Word;
+  //! Bits per storage word.
+  static const uint32_t wordBits = 64;
+
+  //! The bits, any bits past size in the last word are always zero.
+  std::vector<Word> words;
+  //! The number of ids this set can hold.
+  uint32_t bits = 0;
+
+public:
+  //! Construct an empty set that can't hold anything.
+  IdBitset() = default;
+
+  //! Construct a set that can hold ids [0, size), with every id either in or out.
+  explicit IdBitset(size_t size, bool value = false) :
+      words((size + wordBits - 1) / wordBits, value ? ~Word(0) : Word(0)),
+      bits((uint32_t) size) {
+    trim();
+  }
+
+  //! The number of ids this set can hold.
+  size_t size() const { return bits; }
+
+  //! Add an id.
+  void set(HashId id) {
+    assert(id < bits);
+    words[id / wordBits] |= Word(1) << (id % wordBits);
+  }
+
+  //! Remove an id.
+  void reset(HashId id) {
+    assert(id < bits);
+    words[id / wordBits] &= ~(Word(1) << (id % wordBits));
+  }
+
+  //! Is the id in the set?
+  bool test(HashId id) const {
+    assert(id < bits);
+    return (words[id / wordBits] >> (id % wordBits)) & 1;
+  }
+
+  //! The number of ids in the set.
+  size_t count() const {
+    size_t total = 0;
+    for (Word word : words)
+      total += popcount(word);
+    return total;
+  }
+
+  //! Is the set empty?
+  bool none() const {
+    for (Word word : words)
+      if (word)
+        return false;
+    return true;
+  }
+
+  //! Is anything in the set?
+  bool any() const { return !none(); }
+
+  //! The smallest id in the set, invalidHashId if it's empty.
+  HashId first() const { return next(0); }
+
+  //! The smallest id in the set that's >= from, invalidHashId if there isn't one.
+  HashId next(HashId from) const {
+    if (from >= bits)
+      return invalidHashId;
+
+    size_t w = from / wordBits;
+    Word word = words[w] & (~Word(0) << (from % wordBits));
+    while (true) {
+      if (word)
+        return (HashId) (w * wordBits + countTrailingZeros(word));
+      if (++w == words.size())
+        return invalidHashId;
+      word = words[w];
+    }
+  }
+
+  //! The smallest id >= from that's in both sets, invalidHashId if there isn't one.
+  HashId nextCommon(const IdBitset &other, HashId from) const {
+    assert(bits == other.bits);
+    if (from >= bits)
+      return invalidHashId;
+
+    size_t w = from / wordBits;
+    Word word = words[w] & other.words[w] & (~Word(0) << (from % wordBits));
+    while (true) {
+      if (word)
+        return (HashId) (w * wordBits + countTrailingZeros(word));
+      if (++w == words.size())
+        return invalidHashId;
+      word = words[w] & other.words[w];
+    }
+  }
+
+  //! Keep only ids that are also in other.
+  IdBitset &operator&=(const IdBitset &other) {
+    assert(bits == other.bits);
+    for (size_t i = 0, e = words.size(); i < e; ++i)
+      words[i] &= other.words[i];
+    return *this;
+  }
+
+  //! Drop any ids that are in other.
+  IdBitset &andNot(const IdBitset &other) {
+    assert(bits == other.bits);
+    for (size_t i = 0, e = words.size(); i < e; ++i)
+      words[i] &= ~other.words[i];
+    return *this;
+  }
+
+  //! The ids in both sets.
+  friend IdBitset operator&(IdBitset lhs, const IdBitset &rhs) {
+    lhs &= rhs;
+    return lhs;
+  }
+
+  //! Do the sets hold the same ids?
+  bool operator==(const IdBitset &other) const {
+    return bits == other.bits && words == other.words;
+  }
+
+  //! Do the sets hold different ids?
+  bool operator!=(const IdBitset &other) const { return !(*this == other); }
+
+private:
+  //! Clear the bits past size in the last word.
+  void trim() {
+    if (bits % wordBits)
+      words.back() &= (Word(1) << (bits % wordBits)) - 1;
+  }
+
+  //! The number of set bits in a word.
+  static uint32_t popcount(Word word) {
+#if defined(__GNUC__)
+    return (uint32_t) __builtin_popcountll(word);
+#else
+    uint32_t total = 0;
+    for (; word; word &= word - 1)
+      ++total;
+    return total;
+#endif
+  }
+
+  //! The index of the lowest set bit in a non-zero word.
+  static uint32_t countTrailingZeros(Word word) {
+    assert(word);
+#if defined(__GNUC__)
+    return (uint32_t) __builtin_ctzll(word);
+#else
+    uint32_t total = 0;
+    for (; !(word & 1); word >>= 1)
+      ++total;
+    return total;
+#endif
+  }
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_IDBITSET_H
@@ -0,0 +1,346 @@
+#ifndef SC2TM_PACKETLAYOUT_H
+#define SC2TM_PACKETLAYOUT_H
+
+#include "common/buffer_operations.h"
+#include "common/sha256.h"
+
+#include <boost/asio/streambuf.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+namespace sc2tm {
+
+//! A list of hashes stored back to back in one block.
+/**
+ * A list of hashes stored back to back in one block, so a list of any length is one allocation
+ * and can be read or written with one copy. Hashes are handed out as pointers into the block.
+ */
+class HashList {
+  //! The hashes, SHA256::DIGEST_SIZE bytes each.
+  std::vector<uint8_t> bytes;
+
+public:
+  //! The number of hashes.
+  size_t size() const { return bytes.size() / SHA256::DIGEST_SIZE; }
+
+  //! Make room for count hashes, their contents are unspecified until written.
+  void resize(size_t count) { bytes.resize(count * SHA256::DIGEST_SIZE); }
+
+  //! Make room for count hashes without adding any.
+  void reserve(size_t count) { bytes.reserve(count * SHA256::DIGEST_SIZE); }
+
+  //! Add a hash to the end of the list.
+  void push_back(const uint8_t *hash) {
+    bytes.insert(bytes.end(), hash, hash + SHA256::DIGEST_SIZE);
+  }
+
+  //! The hash at an index.
+  const uint8_t *operator[](size_t i) const { return bytes.data() + i * SHA256::DIGEST_SIZE; }
+
+  //! Every hash, back to back.
+  const uint8_t *data() const { return bytes.data(); }
+
+  //! Every hash, back to back.
+  uint8_t *data() { return bytes.data(); }
+
+  //! The number of bytes the hashes take up.
+  size_t byteSize() const { return bytes.size(); }
+};
+
+//! How a type of field goes on the wire.
+/**
+ * How a type of field goes on the wire. Every codec says whether it's a fixed size, the fewest
+ * bytes it can take, and how to size, encode and decode a value. Decoding is told how many bytes
+ * the fields after it need at least, so a variable field can't read into them.
+ */
+template <class T, class Enable = void>
+struct FieldCodec;
+
+//! Integers and enums, anything wider than a byte goes out in network byte order.
+template <class T>
+struct FieldCodec<T, typename std::enable_if<std::is_integral<T>::value ||
+                                             std::is_enum<T>::value>::type> {
+  static_assert(sizeof(T) == 1 || sizeof(T) == 4, "Only 8 and 32 bit integers go on the wire");
+
+  static constexpr bool fixed = true;
+  static constexpr size_t minSize = sizeof(T);
+
+  static size_t size(const T &) { return sizeof(T); }
+
+  static void encode(const T &value, BufferWriter &writer) {
+    if (sizeof(T) == 1)
+      writer.putUint8((uint8_t) value);
+    else
+      writer.putUint32((uint32_t) value);
+  }
+
+  static void decode(T &value, BufferReader &reader, size_t) {
+    if (sizeof(T) == 1)
+      value = (T) reader.getUint8();
+    else
+      value = (T) reader.getUint32();
+  }
+};
+
+//! Byte arrays, of any number of dimensions, copied as they are.
+template <class T>
+struct FieldCodec<T, typename std::enable_if<std::is_array<T>::value>::type> {
+  static_assert(sizeof(typename std::remove_all_extents<T>::type) == 1,
+                "Only arrays of bytes go on the wire as they are");
+
+  static constexpr bool fixed = true;
+  static constexpr size_t minSize = sizeof(T);
+
+  static size_t size(const T &) { return sizeof(T); }
+  static void encode(const T &value, BufferWriter &writer) { writer.putBytes(value, sizeof(T)); }
+  static void decode(T &value, BufferReader &reader, size_t) { reader.getBytes(value, sizeof(T)); }
+};
+
+//! Fixed size std::arrays of bytes, copied as they are.
+template <size_t N>
+struct FieldCodec<std::array<uint8_t, N>> {
+  static constexpr bool fixed = true;
+  static constexpr size_t minSize = N;
+
+  static size_t size(const std::array<uint8_t, N> &) { return N; }
+
+  static void encode(const std::array<uint8_t, N> &value, BufferWriter &writer) {
+    writer.putBytes(value.data(), N);
+  }
+
+  static void decode(std::array<uint8_t, N> &value, BufferReader &reader, size_t) {
+    reader.getBytes(value.data(), N);
+  }
+};
+
+//! Hash lists, a count and then every hash in one block.
+template <>
+struct FieldCodec<HashList> {
+  static constexpr bool fixed = false;
+  static constexpr size_t minSize = sizeof(uint32_t);
+
+  static size_t size(const HashList &value) { return sizeof(uint32_t) + value.byteSize(); }
+
+  static void encode(const HashList &value, BufferWriter &writer) {
+    // We don't need more than 4b hashes
+    writer.putUint32((uint32_t) value.size());
+    writer.putBytes(value.data(), value.byteSize());
+  }
+
+  static void decode(HashList &value, BufferReader &reader, size_t reserve) {
+    // A count claiming more than was sent, less whatever follows, means the sender's broken
+    uint32_t count = reader.getUint32();
+    size_t room = reader.remaining() - std::min(reader.remaining(), reserve);
+    if (count > room / SHA256::DIGEST_SIZE)
+      throw std::runtime_error("Hash list claims more hashes than were sent");
+    value.resize(count);
+    reader.getBytes(value.data(), value.byteSize());
+  }
+};
+
+//! A packet's field, a member and the codec for its type.
+template <class P, class T, T P::*Member>
+struct Field {
+  typedef FieldCodec<T> Codec;
+
+  static constexpr bool fixed = Codec::fixed;
+  static constexpr size_t minSize = Codec::minSize;
+
+  static size_t size(const P &packet) { return Codec::size(packet.*Member); }
+  static void encode(const P &packet, BufferWriter &writer) {
+    Codec::encode(packet.*Member, writer);
+  }
+  static void decode(P &packet, BufferReader &reader, size_t reserve) {
+    Codec::decode(packet.*Member, reader, reserve);
+  }
+};
+
+//! Name a packet's member as one of its fields.
+#define SC2TM_FIELD(Packet, member) \
+    ::sc2tm::Field<Packet, decltype(Packet::member), &Packet::member>
+
+//! A packet's fields in the order they go on the wire.
+/**
+ * A packet's fields in the order they go on the wire. Everything about the wire format is worked
+ * out from here at compile time: whether the packet is a fixed size and what that is, the
+ * encoder and the decoder. A fixed size packet's encoder and decoder are a run of fixed size
+ * copies.
+ */
+template <class... Fields>
+struct PacketLayout;
+
+//! The end of a layout.
+template <>
+struct PacketLayout<> {
+  static constexpr bool fixed = true;
+  static constexpr size_t minSize = 0;
+
+  template <class P>
+  static size_t size(const P &) { return 0; }
+  template <class P>
+  static void encode(const P &, BufferWriter &) { }
+  template <class P>
+  static void decode(P &, BufferReader &) { }
+};
+
+//! A field followed by the rest of a layout.
+template <class First, class... Rest>
+struct PacketLayout<First, Rest...> {
+  typedef PacketLayout<Rest...> Tail;
+
+  static constexpr bool fixed = First::fixed && Tail::fixed;
+  static constexpr size_t minSize = First::minSize + Tail::minSize;
+
+  template <class P>
+  static size_t size(const P &packet) {
+    return fixed ? minSize : First::size(packet) + Tail::size(packet);
+  }
+
+  template <class P>
+  static void encode(const P &packet, BufferWriter &writer) {
+    First::encode(packet, writer);
+    Tail::encode(packet, writer);
+  }
+
+  template <class P>
+  static void decode(P &packet, BufferReader &reader) {
+    First::decode(packet, reader, Tail::minSize);
+    Tail::decode(packet, reader);
+  }
+};
+
+//! The bytes ahead of every message, its type and then its length.
+const size_t frameHeaderSize = sizeof(uint8_t) + sizeof(uint32_t);
+
+//! The longest message accepted, anything longer means the other end is broken.
+const uint32_t maxFrameLength = 1 << 26;
+
+//! The type and length of a message.
+struct FrameHeader {
+  //! What's in the frame, a MessageType.
+  uint8_t type;
+  //! The number of bytes following the header.
+  uint32_t length;
+};
+
+//! Where a buffer is at with its next frame.
+enum class FrameState {
+  //! The frame hasn't all arrived yet.
+  PARTIAL,
+  //! The frame's all here and its header's been consumed, its body is next in the buffer.
+  READY,
+  //! The frame claims to be longer than maxFrameLength.
+  INVALID
+};
+
+//! Check whether a whole frame is waiting at the front of a buffer.
+/**
+ * Check whether a whole frame is waiting at the front of a buffer, consuming its header if it is
+ * so the body can be decoded straight out of the buffer. Nothing is consumed otherwise.
+ *
+ * @param buffer The buffer bytes are read into.
+ * @param header Filled in with the frame's header once it's arrived.
+ */
+inline FrameState nextFrame(boost::asio::streambuf &buffer, FrameHeader &header) {
+  if (buffer.size() < frameHeaderSize)
+    return FrameState::PARTIAL;
+
+  const uint8_t *bytes = boost::asio::buffer_cast<const uint8_t *>(buffer.data());
+  uint32_t length;
+  std::memcpy(&length, bytes + 1, sizeof(length));
+  header.type = bytes[0];
+  header.length = ntohl(length);
+
+  if (header.length > maxFrameLength)
+    return FrameState::INVALID;
+  if (buffer.size() < frameHeaderSize + header.length)
+    return FrameState::PARTIAL;
+
+  buffer.consume(frameHeaderSize);
+  return FrameState::READY;
+}
+
+//! Base for every packet, its wire format comes from Derived::Layout.
+/**
+ * Base for every packet, its wire format comes from Derived::Layout. There's nothing virtual,
+ * every packet's encoder and decoder are stamped out for it at compile time.
+ *
+ * Every packet goes out in a frame, its Derived::type and the length of its body ahead of it, so
+ * the receiver can pull in whatever's arrived and pick out each whole message without knowing
+ * what to expect next.
+ */
+template <class Derived>
+struct Packet {
+  //! Get the size a fixed size packet will place in the buffer, not counting its frame header.
+  static constexpr size_t size() {
+    static_assert(Derived::Layout::fixed, "Variable size packets are sized per packet");
+    return Derived::Layout::minSize;
+  }
+
+  //! Could a frame body of this length hold this packet?
+  static constexpr bool accepts(size_t length) {
+    return Derived::Layout::fixed ? length == Derived::Layout::minSize
+                                  : length >= Derived::Layout::minSize;
+  }
+
+  //! Transforms the packet into a frame appropriate for sending over the network.
+  /**
+   * Transforms the packet into a frame appropriate for sending over the network and places it in
+   * a provided buffer.
+   *
+   * @param buffer The buffer this packets bytes should be written into.
+   */
+  void toBuffer(boost::asio::streambuf &buffer) const {
+    const Derived &self = static_cast<const Derived &>(*this);
+    size_t body = Derived::Layout::size(self);
+    BufferWriter writer(buffer, frameHeaderSize + body);
+    writer.putUint8((uint8_t) Derived::type);
+    writer.putUint32((uint32_t) body);
+    Derived::Layout::encode(self, writer);
+  }
+
+protected:
+  //! Fill this packet from the body of a frame.
+  /**
+   * Fill this packet from the body of a frame, which is assumed to have arrived and to be at the
+   * front of the buffer. The whole body is consumed, so the next frame is left at the front, but
+   * nothing past it is read.
+   *
+   * @param buffer The buffer to construct from.
+   * @param length The length of the body, which the packet must accept.
+   * @throws std::runtime_error If the packet can't be this long or the body hasn't all arrived,
+   * nothing is consumed. If the body doesn't decode to exactly its length, it's consumed.
+   */
+  void fromBuffer(boost::asio::streambuf &buffer, size_t length) {
+    if (!accepts(length) || buffer.size() < length)
+      throw malformed();
+
+    BufferReader reader(buffer, length);
+    bool decoded = false;
+    try {
+      Derived::Layout::decode(static_cast<Derived &>(*this), reader);
+      decoded = reader.remaining() == 0;
+    }
+    catch (const std::runtime_error &) { }
+    if (!decoded) {
+      reader.skip(reader.remaining());
+      throw malformed();
+    }
+  }
+
+private:
+  //! The error for a frame body that isn't a valid packet.
+  static std::runtime_error malformed() {
+    return std::runtime_error("Malformed packet of type " + std::to_string((int) Derived::type));
+  }
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_PACKETLAYOUT_H
@@ -1,26 +1,141 @@
 #ifndef SC2TM_BUFFER_OPERATIONS_H
 #define SC2TM_BUFFER_OPERATIONS_H
 
+#include "common/sha256.h"
+
 #ifdef  _WIN32
 #include <Winsock2.h>
 #else
 #include <arpa/inet.h>
 #endif
-#include <iostream>
+#include <boost/asio/streambuf.hpp>
+
+#include <cassert>
+#include <cstdint>
+#include <cstring>
 
 namespace sc2tm {
 
-//! Write a uint32_t to a stream in network byte order.
-void writeUint32(uint32_t val, std::ostream &os);
+//! Writes a packet straight into a streambuf.
+/**
+ * Writes a packet straight into a streambuf. The packet's size is reserved up front with
+ * prepare() and filled through a plain pointer, then committed when the writer goes out of
+ * scope, so no stream objects or per byte virtual calls are involved. Integers go out in network
+ * byte order.
+ */
+class BufferWriter {
+public:
+  //! Reserve room for a packet.
+  /**
+   * Reserve room for a packet.
+   *
+   * @param buffer The buffer to write into.
+   * @param size The number of bytes that will be written.
+   */
+  BufferWriter(boost::asio::streambuf &buffer, size_t size);
+
+  //! Commit what's been written.
+  ~BufferWriter();
+
+  //! No copying, we commit on destruction.
+  BufferWriter(const BufferWriter &) = delete;
+  BufferWriter &operator=(const BufferWriter &) = delete;
+
+  //! Write a byte.
+  void putUint8(uint8_t val) {
+    assert(cursor + 1 <= end);
+    *cursor++ = val;
+  }
+
+  //! Write a uint32_t in network byte order.
+  void putUint32(uint32_t val) {
+    val = htonl(val);
+    putBytes(&val, sizeof(val));
+  }
+
+  //! Write a hash.
+  void putHash(const uint8_t *hash) { putBytes(hash, SHA256::DIGEST_SIZE); }
+
+  //! Write raw bytes.
+  void putBytes(const void *bytes, size_t size) {
+    assert(cursor + size <= end);
+    std::memcpy(cursor, bytes, size);
+    cursor += size;
+  }
+
+private:
+  //! The buffer being written.
+  boost::asio::streambuf &buffer;
+  //! The start of the reserved room.
+  uint8_t *start;
+  //! Where the next byte goes.
+  uint8_t *cursor;
+  //! The end of the reserved room.
+  uint8_t *end;
+};
+
+//! Reads a packet straight out of a streambuf.
+/**
+ * Reads a packet straight out of a streambuf, through a plain pointer into the bytes waiting in
+ * it. Whatever was read is consumed when the reader goes out of scope. Like the packets
+ * themselves, the reader assumes every byte it's asked for has already arrived.
+ */
+class BufferReader {
+public:
+  //! Start reading the bytes waiting in a buffer, going no further than limit of them.
+  explicit BufferReader(boost::asio::streambuf &buffer, size_t limit = SIZE_MAX);
+
+  //! Consume what's been read.
+  ~BufferReader();
+
+  //! No copying, we consume on destruction.
+  BufferReader(const BufferReader &) = delete;
+  BufferReader &operator=(const BufferReader &) = delete;
+
+  //! The number of bytes left to read.
+  size_t remaining() const { return (size_t) (end - cursor); }
+
+  //! Read a byte.
+  uint8_t getUint8() {
+    assert(cursor + 1 <= end);
+    return *cursor++;
+  }
+
+  //! Read a uint32_t in network byte order.
+  uint32_t getUint32() {
+    uint32_t val;
+    getBytes(&val, sizeof(val));
+    return ntohl(val);
+  }
+
+  //! Read a hash.
+  void getHash(uint8_t *hash) { getBytes(hash, SHA256::DIGEST_SIZE); }
 
-//! Read a uin32_t from a stream in network byte order.
-uint32_t readUint32(std::istream &is);
+  //! Read raw bytes.
+  void getBytes(void *bytes, size_t size) {
+    assert(cursor + size <= end);
+    std::memcpy(bytes, cursor, size);
+    cursor += size;
+  }
 
-//! Write a hash buffer to a stream.
-void writeHashBuffer(const uint8_t * const buffer, std::ostream &os);
+  //! Skip over bytes, returning where they start so they can be used in place.
+  const uint8_t *skip(size_t size) {
+    assert(cursor + size <= end);
+    const uint8_t *at = cursor;
+    cursor += size;
+    return at;
+  }
 
-//! Read a hash buffer from a stream.
-void readHashBuffer(uint8_t *buffer, std::istream &is);
+private:
+  //! The buffer being read.
+  boost::asio::streambuf &buffer;
+  //! The first byte waiting.
+  const uint8_t *start;
+  //! The next byte to read.
+  const uint8_t *cursor;
+  //! The end of the bytes waiting.
+  const uint8_t *end;
+};
 
 } // End namespace sc2tm
 
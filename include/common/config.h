@@ -10,7 +10,7 @@ namespace sc2tm {
 //! Server major version number.
 const uint8_t serverMajorVersion = 0;
 //! Server minor version number.
-const uint8_t serverMinorVersion = 1;
+const uint8_t serverMinorVersion = 2;
 //! Server patch version number.
 const uint8_t serverPatchVersion = 0;
 //! Server version number as a dot separated string.
@@ -22,7 +22,7 @@ const std::string serverVersionStr = std::to_string(serverMajorVersion) + '.' +
 //! Client major version number.
 const uint8_t clientMajorVersion = 0;
 //! Client minor version number.
-const uint8_t clientMinorVersion = 1;
+const uint8_t clientMinorVersion = 2;
 //! Client patch version number.
 const uint8_t clientPatchVersion = 0;
 //! Client version number as a dot separated string.
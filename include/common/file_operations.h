@@ -1,6 +1,7 @@
 #ifndef SC2TM_FILE_OPERATIONS_H
 #define SC2TM_FILE_OPERATIONS_H
 
+#include "common/HashCache.h"
 #include "common/sha256.h"
 
 #include <experimental/filesystem>
@@ -20,10 +21,23 @@ namespace sc2tm {
 //! Convenience typedef for mapping a file to a SHA256 hash.
 typedef std::map<fs::path, SHA256Hash::ptr> SHAFileMap;
 
+//! Settings for hashing a directory.
+struct HashConfig {
+  //! The number of threads to hash with, 0 means one per core.
+  unsigned threads = 1;
+  //! Cache of previously computed hashes, nullptr to always hash.
+  HashCache::ptr cache;
+};
+
 //! Hash all .so files in a directory.
-bool hashBotDirectory(std::string filepath, SHAFileMap &map);
+bool hashBotDirectory(std::string filepath, SHAFileMap &map,
+                      const HashConfig &config = HashConfig());
 //! Hash all .SC2Map files in a directory.
-bool hashMapDirectory(std::string filepath, SHAFileMap &map);
+bool hashMapDirectory(std::string filepath, SHAFileMap &map,
+                      const HashConfig &config = HashConfig());
+
+//! Report how the hash cache did this run and save what was hashed for the next, if there is one.
+void saveHashCache(const HashConfig &config);
 
 } // End sc2tm namespace
 
@@ -3,45 +3,50 @@
 
 #include "common/file_operations.h"
 #include "common/Game.h"
+#include "common/HashRegistry.h"
+#include "common/IdBitset.h"
+#include "common/PacketLayout.h"
 #include "common/sha256.h"
 
 #include <boost/asio/streambuf.hpp>
 
+#include <array>
 #include <vector>
 
 namespace sc2tm {
-// TODO provide a way to know how much data to read
-
-// It might be possible to move the streambuf constructor to this so not every packet has to define
-// it
-//! Base class for all packets.
-struct Packet {
-  //! Transforms the packet into data appropriate for sending over the network.
-  /**
-   * Transforms the packet into a data appropriate for sending over the network and places it in a
-   * provided buffer. Subclasses should override this to provide the packet writing routine with
-   * ability to write its data.
-   *
-   * @param buffer The buffer this packets bytes should be written into.
-   */
-  virtual void toBuffer(boost::asio::streambuf &buffer) = 0;
-
-protected:
-
-  //! Fill this packet from the bytes in a buffer.
-  /**
-   * Fill this packet from the bytes in a buffer. Will pull out as many bytes as necessary.
-   * Assumes the correct number of bytes are waiting in the buffer.
-   *
-   * @param buffer The buffer to construct from.
-   */
-  virtual void fromBuffer(boost::asio::streambuf &buffer) = 0;
+//! Identifies a client's session, so it can reconnect without a full handshake.
+typedef std::array<uint8_t, 16> SessionToken;
+
+//! The type of every message, the first byte of its frame.
+enum MessageType : uint8_t {
+  // Client to server
+  //! A ClientHandshakePacket, the first message from a new client.
+  HANDSHAKE = 1,
+  //! A ClientResumePacket, sent in place of a handshake by a returning client.
+  RESUME,
+  //! A GameStatusPacket.
+  GAME_STATUS,
+
+  // Server to client
+  //! A PregameDisconnectPacket, the server hangs up after sending it.
+  DISCONNECT = 16,
+  //! A StartGamePacket.
+  START_GAME,
+  //! A SessionPacket.
+  SESSION
 };
 
+// Every packet lists its fields once in a Layout and the wire format is built from that, see
+// PacketLayout.h. Every packet goes out framed with its type and length.
+
 // --- ClientHandShakePacket
 
 //! All data required for a client handshake packet.
-struct ClientHandshakePacket : Packet {
+/**
+ * All data required for a client handshake packet. This packet is variable length, its frame
+ * tells the destination how many bytes to wait for.
+ */
+struct ClientHandshakePacket : Packet<ClientHandshakePacket> {
   // These fields aren't necessary when we're constructing a packet to send because they're
   // available from the config, however, they *are* necessary when we receive one and need somewhere
   // to put it
@@ -52,10 +57,24 @@ struct ClientHandshakePacket : Packet {
   //! This client's patch version number.
   uint8_t clientPatchVersion;
 
+  //! How many games the client wants to have queued up at once.
+  uint8_t queueDepth;
+
   //! Array of bot hashes
-  std::vector<std::vector<uint8_t>> botHashes;
+  HashList botHashes;
   //! Array of map hashes
-  std::vector<std::vector<uint8_t>> mapHashes;
+  HashList mapHashes;
+
+  //! The wire format.
+  typedef PacketLayout<SC2TM_FIELD(ClientHandshakePacket, clientMajorVersion),
+                       SC2TM_FIELD(ClientHandshakePacket, clientMinorVersion),
+                       SC2TM_FIELD(ClientHandshakePacket, clientPatchVersion),
+                       SC2TM_FIELD(ClientHandshakePacket, queueDepth),
+                       SC2TM_FIELD(ClientHandshakePacket, botHashes),
+                       SC2TM_FIELD(ClientHandshakePacket, mapHashes)> Layout;
+
+  //! The message type.
+  static constexpr MessageType type = HANDSHAKE;
 
   //! No default constructor.
   ClientHandshakePacket() = delete;
@@ -66,88 +85,96 @@ struct ClientHandshakePacket : Packet {
    *
    * @param botMap The bots that need to be included.
    * @param mapMap The maps that need to be included.
+   * @param queueDepth How many games the client wants queued up at once.
    */
-  ClientHandshakePacket(const SHAFileMap &botMap, const SHAFileMap &mapMap);
+  ClientHandshakePacket(const SHAFileMap &botMap, const SHAFileMap &mapMap,
+                        uint8_t queueDepth = 1);
 
-  //! Construct a handshake from the bytes in a buffer.
-  ClientHandshakePacket(boost::asio::streambuf &buffer);
+  //! Construct a handshake from a frame body of length bytes in a buffer.
+  ClientHandshakePacket(boost::asio::streambuf &buffer, size_t length);
 
-  //! Converts this packet into data appropriate for sending over the network.
+  //! Translate the packet's hashes into ids.
   /**
-   * Transforms the packet into a data appropriate for sending over the network and places it in a
-   * provided buffer. Due to the variable length of this packet, also writes the size of the packet
-   * to the stream first so that the destination can wait for the correct amount of bytes to fill
-   * out the entire packet.
+   * Translate the packet's hashes into ids. Hashes that aren't in the registries can't be
+   * scheduled anyway, so they're dropped.
    *
-   * @param buffer The buffer this packets bytes should be written into.
+   * @param botRegistry The registry to look bot hashes up in.
+   * @param mapRegistry The registry to look map hashes up in.
+   * @param bots The set to place bot ids in, sized from botRegistry.
+   * @param maps The set to place map ids in, sized from mapRegistry.
    */
-  virtual void toBuffer(boost::asio::streambuf &buffer) override;
-
-  //! Get the size this packet will place in the buffer.
-  size_t size() {
-    return
-        sizeof(uint8_t) * 3 + // The three version numbers
-        sizeof(uint32_t) * 2 + // The hash size fields
-        sizeof(uint8_t) * (botHashes.size() + mapHashes.size()) * SHA256::DIGEST_SIZE;
-  }
+  void toIds(const HashRegistry &botRegistry, const HashRegistry &mapRegistry, IdBitset &bots,
+             IdBitset &maps) const;
 
-protected:
-  //! Fill this packet from the bytes in a buffer.
-  /**
-   * Fill this packet from the bytes in a buffer. Assumes that the caller has already accounted
-   * for the variable length of this packet and the correct number of bytes are waiting in the
-   * buffer.
-   *
-   * @param buffer The buffer to construct from.
-   */
-  virtual void fromBuffer(boost::asio::streambuf &buffer) override;
-};
+  //! Digest of the packet's hashes in order, a resuming client presents it instead of the hashes.
+  SHA256Hash digest() const;
 
-// --- PreGamePacket
-//! Represents all possible pregame commands
-enum PregameCommand : uint8_t {
-  DISCONNECT = 0,
-  START_GAME
+  //! Get the size this packet will place in the buffer, not counting its frame header.
+  size_t size() const {
+    return Layout::size(*this);
+  }
 };
 
-//! All data required for a pregame command packet.
-struct PregameCommandPacket : Packet {
-  //! The pregame command.
-  PregameCommand cmd;
+// --- ClientResumePacket
+//! All data required for a client to pick its session back up on a new connection.
+/**
+ * All data required for a client to pick its session back up on a new connection, sent in place
+ * of a handshake.
+ */
+struct ClientResumePacket : Packet<ClientResumePacket> {
+  //! This client's major version number.
+  uint8_t clientMajorVersion;
+  //! This client's minor version number.
+  uint8_t clientMinorVersion;
+  //! This client's patch version number.
+  uint8_t clientPatchVersion;
 
-  //! No default constructor.
-  PregameCommandPacket() = delete;
+  //! The session to resume.
+  SessionToken token;
 
-  //! Construct a PregameCommandPacket from a command.
-  PregameCommandPacket(PregameCommand cmd) : cmd(cmd) { }
+  //! The digest of the handshake that opened the session.
+  uint8_t catalog[SHA256::DIGEST_SIZE];
 
-  //! Construct a PregameCommandPacket from the bytes in a buffer.
-  PregameCommandPacket(boost::asio::streambuf &buffer) : cmd() { fromBuffer(buffer); }
+  //! The wire format.
+  typedef PacketLayout<SC2TM_FIELD(ClientResumePacket, clientMajorVersion),
+                       SC2TM_FIELD(ClientResumePacket, clientMinorVersion),
+                       SC2TM_FIELD(ClientResumePacket, clientPatchVersion),
+                       SC2TM_FIELD(ClientResumePacket, token),
+                       SC2TM_FIELD(ClientResumePacket, catalog)> Layout;
 
-  //! Converts this packet into data appropriate for sending over the network.
-  virtual void toBuffer(boost::asio::streambuf &buffer) override;
+  //! The message type.
+  static constexpr MessageType type = RESUME;
 
-  //! Get the size this packet will place in the buffer.
-  static size_t size() {
-    return sizeof(PregameCommand);
-  }
+  //! No default constructor.
+  ClientResumePacket() = delete;
 
-protected:
-  //! Fill this packet from the bytes in a buffer.
-  virtual void fromBuffer(boost::asio::streambuf &buffer) override;
+  //! Construct a resume packet for a session.
+  ClientResumePacket(const SessionToken &token, const SHA256Hash &catalog);
+
+  //! Construct a resume packet from a frame body of length bytes in a buffer.
+  ClientResumePacket(boost::asio::streambuf &buffer, size_t length);
 };
 
+// --- Server messages
 //! Represents all possible reasons for disconnecting pregame.
 enum PregameDisconnectReason : uint8_t {
   BAD_VERSION = 0,
-  NO_GAMES
+  NO_GAMES,
+  //! The session can't be resumed, reconnect with a full handshake.
+  BAD_SESSION
 };
 
 //! All data required for a pregame disconnect packet
-struct PregameDisconnectPacket : Packet {
+struct PregameDisconnectPacket : Packet<PregameDisconnectPacket> {
   //! The disconnect reason
   PregameDisconnectReason reason;
 
+  //! The wire format.
+  typedef PacketLayout<SC2TM_FIELD(PregameDisconnectPacket, reason)> Layout;
+
+  //! The message type.
+  static constexpr MessageType type = DISCONNECT;
+
   //! No default constructor.
   PregameDisconnectPacket() = delete;
 
@@ -155,83 +182,118 @@ struct PregameDisconnectPacket : Packet {
   PregameDisconnectPacket(PregameDisconnectReason reason) : reason(reason) { }
 
   //! Construct a PregameDisconnectPacket from the bytes in a buffer.
-  PregameDisconnectPacket(boost::asio::streambuf &buffer) : reason() { fromBuffer(buffer); }
+  PregameDisconnectPacket(boost::asio::streambuf &buffer, size_t length) : reason() {
+    fromBuffer(buffer, length);
+  }
+};
 
-  //! Converts this packet into data appropriate for sending over the network.
-  virtual void toBuffer(boost::asio::streambuf &buffer) override;
+//! All data required for telling a client about its session.
+struct SessionPacket : Packet<SessionPacket> {
+  //! The session's token.
+  SessionToken token;
 
-  //! Get the size this packet will place in the buffer.
-  static size_t size() {
-    return sizeof(PregameDisconnectReason);
-  }
+  //! Non-zero if the client's games were kept for it and the server is waiting on their status.
+  uint8_t resumed;
+
+  //! The wire format.
+  typedef PacketLayout<SC2TM_FIELD(SessionPacket, token),
+                       SC2TM_FIELD(SessionPacket, resumed)> Layout;
 
-protected:
-  //! Fill this packet from the bytes in a buffer.
-  virtual void fromBuffer(boost::asio::streambuf &buffer) override;
+  //! The message type.
+  static constexpr MessageType type = SESSION;
+
+  //! No default constructor.
+  SessionPacket() = delete;
+
+  //! Construct a SessionPacket.
+  SessionPacket(const SessionToken &token, bool resumed) : token(token), resumed(resumed) { }
+
+  //! Construct a SessionPacket from the bytes in a buffer.
+  SessionPacket(boost::asio::streambuf &buffer, size_t length) : token(), resumed() {
+    fromBuffer(buffer, length);
+  }
 };
 
 //! All data required for scheduling a new game.
-struct StartGamePacket : Packet {
+/**
+ * All data required for scheduling a new game. A client may have several games queued up, each
+ * comes with a ticket it reports back on the game with.
+ */
+struct StartGamePacket : Packet<StartGamePacket> {
+  //! The game's ticket.
+  GameTicket ticket;
+
   //! The game to send to the client.
   uint8_t data[3][SHA256::DIGEST_SIZE];
 
-  //! No default constructor.
-  StartGamePacket() = delete;
+  //! The wire format.
+  typedef PacketLayout<SC2TM_FIELD(StartGamePacket, ticket),
+                       SC2TM_FIELD(StartGamePacket, data)> Layout;
 
-  //! Construct a StartGamePacket from a game.
-  StartGamePacket(const Game &game);
+  //! The message type.
+  static constexpr MessageType type = START_GAME;
 
-  //! Construct a PregameDisconnectPacket from the bytes in a buffer.
-  StartGamePacket(boost::asio::streambuf &buffer) : data() { fromBuffer(buffer); }
+  //! No default constructor.
+  StartGamePacket() = delete;
 
-  //! Converts this packet into data appropriate for sending over the network.
-  virtual void toBuffer(boost::asio::streambuf &buffer) override;
+  //! Construct a StartGamePacket from a game, translating its ids back into hashes.
+  StartGamePacket(GameTicket ticket, const Game &game, const HashRegistry &botRegistry,
+                  const HashRegistry &mapRegistry);
 
-  //! Get the size this packet will place in the buffer.
-  static size_t size() {
-    return sizeof(data);
+  //! Construct a StartGamePacket from the bytes in a buffer.
+  StartGamePacket(boost::asio::streambuf &buffer, size_t length) : ticket(), data() {
+    fromBuffer(buffer, length);
   }
 
-protected:
-  //! Fill this packet from the bytes in a buffer.
-  virtual void fromBuffer(boost::asio::streambuf &buffer) override;
-
+  //! Translate the packet's hashes into a game, returns false if any hash isn't in the registries.
+  bool toGame(const HashRegistry &botRegistry, const HashRegistry &mapRegistry, Game &game) const;
 };
 
 //! Represents all possible status codes of a game finishing.
 enum GameStatus : uint8_t {
   SUCCESS = 0,
-  FAILURE
+  FAILURE,
+  //! Not finished, but still playing. Keeps the game's lease from expiring.
+  HEARTBEAT
 };
 
 //! All data required for a game status packet.
-struct GameStatusPacket : Packet {
+struct GameStatusPacket : Packet<GameStatusPacket> {
+  //! The ticket of the game being reported on.
+  GameTicket ticket;
+
   //! The status of the game.
   GameStatus status;
 
+  //! The wire format.
+  typedef PacketLayout<SC2TM_FIELD(GameStatusPacket, ticket),
+                       SC2TM_FIELD(GameStatusPacket, status)> Layout;
+
+  //! The message type.
+  static constexpr MessageType type = GAME_STATUS;
+
   //! No default constructor.
   GameStatusPacket() = delete;
 
-  //! Construct a GameStatusPacket from a status code.
-  GameStatusPacket(GameStatus status) : status(status) { }
+  //! Construct a GameStatusPacket for a game from a status code.
+  GameStatusPacket(GameTicket ticket, GameStatus status) : ticket(ticket), status(status) { }
 
   //! Construct a GameStatusPacket from the bytes in a buffer.
-  GameStatusPacket(boost::asio::streambuf &buffer) : status() { fromBuffer(buffer); }
-
-  //! Converts this packet into data appropriate for sending over the network.
-  virtual void toBuffer(boost::asio::streambuf &buffer) override;
-
-  //! Get the size this packet will place in the buffer.
-  static size_t size() {
-    return sizeof(GameStatus);
+  GameStatusPacket(boost::asio::streambuf &buffer, size_t length) : ticket(), status() {
+    fromBuffer(buffer, length);
   }
-
-protected:
-  //! Fill this packet from the bytes in a buffer.
-  virtual void fromBuffer(boost::asio::streambuf &buffer) override;
-
 };
 
+// The wire sizes everything else relies on, caught here if a layout changes
+static_assert(PregameDisconnectPacket::size() == 1, "PregameDisconnectPacket changed size");
+static_assert(SessionPacket::size() == 17, "SessionPacket changed size");
+static_assert(StartGamePacket::size() == sizeof(GameTicket) + 3 * SHA256::DIGEST_SIZE,
+              "StartGamePacket changed size");
+static_assert(GameStatusPacket::size() == sizeof(GameTicket) + 1, "GameStatusPacket changed size");
+static_assert(ClientResumePacket::size() == 3 + 16 + SHA256::DIGEST_SIZE,
+              "ClientResumePacket changed size");
+static_assert(!ClientHandshakePacket::Layout::fixed, "ClientHandshakePacket is variable size");
+
 } // End sc2tm namespace
 
 #endif //SC2TM_PACKETS_H
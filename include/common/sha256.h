@@ -44,9 +44,24 @@
 //   - added SHA256Hash class which is a light wrapper around a digest
 //   - added SHA256Hash::ptr sha256(std::ifstream &file)
 //   - added ostream overloads for printing SHA256Hash
+//   - added runtime selected hardware transform backends (see sha256_x86.cpp, sha256_arm.cpp)
+//   - added multi-buffer hashing of in-memory buffers
+//   - added SHA256Hash::ptr sha256File(const std::string &path) which hashes through mmap
+//   - widened the length counters to 64 bits so messages over 512 MiB hash correctly
 
+#include <cstddef>
+#include <cstdint>
 #include <memory>
 #include <set>
+#include <vector>
+
+// Which hardware backends can be compiled for this target.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SHA256_HAVE_X86_BACKENDS 1
+#endif
+#if defined(__aarch64__) && defined(__GNUC__)
+#define SHA256_HAVE_ARM_BACKENDS 1
+#endif
 
 
 class SHA256
@@ -57,17 +72,81 @@ protected:
     typedef unsigned long long uint64;
 
     const static uint32 sha256_k[];
+    const static uint32 sha256_h0[];
     static const unsigned int SHA224_256_BLOCK_SIZE = (512/8);
 public:
+    //! Implementations of the compression function.
+    enum Backend {
+      SCALAR = 0, //!< Portable C++, always available.
+      X86_SHA_NI, //!< x86 SHA extensions.
+      ARMV8_SHA2  //!< ARMv8 cryptography extensions.
+    };
+
     void init();
     void update(const unsigned char *message, unsigned int len);
     void final(unsigned char *digest);
     static const unsigned int DIGEST_SIZE = ( 256 / 8);
+    //! The number of messages the multi-buffer path hashes at once.
+    static const unsigned int MULTI_LANES = 8;
+
+    //! Is the backend usable on this machine?
+    static bool isSupported(Backend backend);
+    //! Route all contexts through the backend. Returns false and changes nothing if unsupported.
+    static bool selectBackend(Backend backend);
+    //! The backend contexts currently use. Defaults to the fastest supported one.
+    static Backend selectedBackend();
+
+    //! Is the AVX2 multi-buffer path usable on this machine?
+    static bool isMultiBufferSupported();
+    //! Enable or disable the multi-buffer path. Returns false if enabling an unsupported path.
+    static bool selectMultiBuffer(bool enable);
+    //! Hash up to MULTI_LANES complete messages at once.
+    /**
+     * Hash up to MULTI_LANES complete messages at once. Uses the multi-buffer path if it's
+     * enabled, otherwise hashes each message with the selected backend.
+     *
+     * @param messages The messages to hash.
+     * @param lens The length of each message.
+     * @param count The number of messages, at most MULTI_LANES.
+     * @param digests Where to write each message's DIGEST_SIZE byte digest.
+     */
+    static void digestLanes(const unsigned char * const *messages, const size_t *lens,
+                            unsigned int count, unsigned char * const *digests);
 
 protected:
-    void transform(const unsigned char *message, unsigned int block_nb);
-    unsigned int m_tot_len;
-    unsigned int m_len;
+    //! Signature of a compression function working on the state words.
+    typedef void (*TransformFn)(uint32 *state, const unsigned char *message,
+                                unsigned int block_nb);
+
+    //! The compression function used by every context.
+    static TransformFn s_transform;
+    //! Whether digestLanes uses the multi-buffer path.
+    static bool s_multiBuffer;
+
+    void transform(const unsigned char *message, unsigned int block_nb)
+    {
+        s_transform(m_h, message, block_nb);
+    }
+
+    static void transformScalar(uint32 *state, const unsigned char *message,
+                                unsigned int block_nb);
+#ifdef SHA256_HAVE_X86_BACKENDS
+    static bool cpuHasShaNi();
+    static bool cpuHasAvx2();
+    static void transformShaNi(uint32 *state, const unsigned char *message,
+                               unsigned int block_nb);
+    //! Run one block through each of 8 lanes. State is [word][lane], masked off lanes are kept.
+    static void transformAvx2x8(uint32 state[8][MULTI_LANES],
+                                const unsigned char * const *blocks, unsigned int laneMask);
+#endif
+#ifdef SHA256_HAVE_ARM_BACKENDS
+    static bool cpuHasArmv8Sha2();
+    static void transformArmv8(uint32 *state, const unsigned char *message,
+                               unsigned int block_nb);
+#endif
+
+    uint64 m_tot_len;
+    uint64 m_len;
     unsigned char m_block[2*SHA224_256_BLOCK_SIZE];
     uint32 m_h[8];
 };
@@ -96,6 +175,9 @@ public:
   //! Offers access to the underlying digest.
   uint8_t *get() { return (uint8_t *) &buff; }
 
+  //! Offers read only access to the underlying digest.
+  const uint8_t *get() const { return (const uint8_t *) &buff; }
+
   //! Compare function for SHA256hashes.
   static int compare(const SHA256Hash &hash1, const SHA256Hash &hash2);
 
@@ -120,6 +202,20 @@ typedef std::set<SHA256Hash::ptr, CompareHashPtrFtor> HashSet;
 //! Generates a pointer to SHA256Hash from a file.
 SHA256Hash::ptr sha256(std::ifstream &file);
 
+//! Generates a pointer to SHA256Hash from a file by path.
+/**
+ * Generates a pointer to SHA256Hash from a file by path. Regular files are memory mapped and fed
+ * to the context straight from the mapping, anything that can't be mapped (pipes, devices, or a
+ * platform without mmap) is streamed instead.
+ *
+ * @param path The file to hash.
+ * @return The file's hash, or nullptr if it couldn't be opened.
+ */
+SHA256Hash::ptr sha256File(const std::string &path);
+
+//! Generates a pointer to SHA256Hash for each buffer, hashing MULTI_LANES at a time if possible.
+std::vector<SHA256Hash::ptr> sha256(const std::vector<std::vector<uint8_t>> &buffers);
+
 //! Prints a SHA256Hash by pointer (delegates to the reference version).
 std::ostream &operator<<(std::ostream &os, const SHA256Hash::ptr &hashp);
 
@@ -2,10 +2,15 @@
 #define SC2TM_CONNECTION_H
 
 #include "common/Game.h"
-#include "common/sha256.h"
+#include "common/IdBitset.h"
+#include "common/packets.h"
+#include "server/Handoff.h"
+#include "server/LeaseManager.h"
+#include "server/SessionTable.h"
 
 #include <boost/asio.hpp>
 
+#include <chrono>
 #include <memory>
 
 using namespace boost;
@@ -16,11 +21,8 @@ namespace sc2tm {
 //! Forward declare Server.
 class Server;
 
-//! Forward declare PregameDisconnectReason.
-enum PregameDisconnectReason : uint8_t;
-
 //! Represents a client's connection to the server.
-class Connection {
+class Connection : public std::enable_shared_from_this<Connection> {
   //! Typedef internally first so we can use it privately.
   typedef uint32_t ConnId_;
 
@@ -30,20 +32,87 @@ class Connection {
   //! The TCP socket this client is connected on.
   tcp::socket _socket;
 
-  //! The buffer this client uses.
-  boost::asio::streambuf buffer;
+  //! Serializes this connection's handlers.
+  /**
+   * Serializes this connection's handlers. The io service may run on many threads, every handler
+   * is wrapped in this strand so a connection's state is only ever touched by one at a time.
+   */
+  asio::io_service::strand strand;
+
+  //! The bytes read from the client that haven't been handled yet.
+  /**
+   * The bytes read from the client that haven't been handled yet. Reads take whatever's arrived
+   * and every whole frame is handled before reading again, so anything that arrives together is
+   * handled off one read.
+   */
+  boost::asio::streambuf inbox;
+
+  //! The bytes queued for the client.
+  /**
+   * The bytes queued for the client. One fills while the other is written, so messages queued
+   * during a write go out together in the next one.
+   */
+  boost::asio::streambuf outboxes[2];
+
+  //! The outbox being filled.
+  int filling = 0;
+
+  //! Is a write to the client pending?
+  bool writing = false;
+
+  //! Is a read from the client pending?
+  bool reading = false;
+
+  //! Hang up once everything queued has been written.
+  bool hangingUp = false;
+
+  //! Has the client sent its handshake or resume?
+  bool greeted = false;
+
+  //! Has the connection been torn down?
+  bool done = false;
 
   //! This connection's id.
   ConnId_ id;
 
   //! This client's available bots.
-  HashSet bots;
+  IdBitset bots;
 
   //! This client's available maps.
-  HashSet maps;
+  IdBitset maps;
+
+  //! The games handed to the client that it hasn't reported on, by ticket.
+  /**
+   * The games handed to the client that it hasn't reported on, by ticket. A client asks for a
+   * queue depth in its handshake and is kept topped up to it, so it can start its next game the
+   * moment one finishes rather than waiting a round trip for it. Tickets are never reused, so a
+   * stale lease expiry or a late report can't be mistaken for a newer game.
+   *
+   * Every game holds a lease from when it's sent, so a client heartbeats the games waiting in its
+   * queue as well as the one it's playing.
+   */
+  Assignments assigned;
+
+  //! The ticket the next game gets.
+  GameTicket nextTicket = 0;
 
-  //! This connection's currently playing game.
-  Game game;
+  //! How many games the client wants queued up at once.
+  uint8_t queueDepth = 1;
+
+  //! Requests for games that haven't been answered yet.
+  size_t scheduling = 0;
+
+  //! Did the last request come up empty? Don't ask again until a game is reported.
+  bool starved = false;
+
+  //! Has the connection stopped to be handed to a new server process?
+  bool parked = false;
+
+  //! Does the client have a session?
+  bool hasSession = false;
+
+  //! The client's session.
+  SessionToken session;
 
 public:
   //! Convenience typedef for a connection shared ptr.
@@ -63,28 +132,102 @@ public:
     return _socket;
   }
 
+  //! Carry on a connection handed over from an old server process.
+  /**
+   * Carry on a connection handed over from an old server process. The connection picks up
+   * reading from the client, waiting for it to report on its games, as though nothing had
+   * happened.
+   *
+   * @param server The server the connection belongs to.
+   * @param service The io service to run on.
+   * @param handoff The connection's state in the old process.
+   */
+  static ptr resume(Server &server, asio::io_service &service, const HandoffConnection &handoff);
+
   //! Start state function.
   void start();
 
+  //! Hang up on the client, it's reconnected on another connection.
+  void hangUp();
+
+  //! Ask the connection to stop at the next point it can be handed to a new server process.
+  /**
+   * Ask the connection to stop at the next point it can be handed to a new server process, which
+   * is while the client has games out and nothing is being scheduled for or written to it. No
+   * more games are asked for once the server's handing off. A pending read is
+   * cancelled, anywhere else the connection carries on until it gets there. The server is told
+   * once it's stopped.
+   */
+  void park();
+
+  //! Has the connection parked itself for a handoff?
+  bool isParked() const { return parked; }
+
+  //! The connection's state for a handoff, only meaningful once it's parked.
+  HandoffConnection handoffState();
+
   //! Deconstruct a Connection.
   ~Connection();
 
 private:
   //! Construct a Connection associated with an io_service.
   Connection(Server &server, asio::io_service &service, ConnId id) :
-      server(server), _socket(service), id(id){ }
+      server(server), _socket(service), strand(service), id(id){ }
+
+  // Reading and writing
+  //! Handle every whole frame that's arrived, then read more.
+  void readFrames();
+  //! Handle one frame, its body is at the front of the inbox.
+  void handleFrame(const FrameHeader &header);
+  //! Queue a packet for the client.
+  template <class P>
+  void send(const P &packet) { packet.toBuffer(outboxes[filling]); }
+  //! Start writing whatever's been queued, if a write isn't already pending.
+  void flush();
+  //! A write finished, carry on with whatever's been queued since.
+  void handleWritten(const boost::system::error_code &error);
+  //! Tear down the connection, exactly once.
+  void finish();
 
   // State functions
   //! Read the client handshake.
-  void readHandshake();
-  //! Schedule a game and send to the client.
-  void scheduleGame();
+  void readHandshake(size_t length);
+  //! Read a returning client's resume instead of a handshake.
+  void readResume(size_t length);
+  //! Carry on with a resumed session, or disconnect if it couldn't be found.
+  void handleResumed(bool found, const SessionToken &token, const SessionTable::Session &resumed);
+  //! Ask for games until the client's queue is full.
+  void scheduleGames();
+  //! Send a scheduled game, or disconnect if there wasn't one and the client has nothing to play.
+  void handleScheduled(bool found, const Game &game);
   //! Send a PregameDisconnect.
   void sendPregameDisconnect(PregameDisconnectReason reason);
   //! Send the client a game to play.
-  void sendStartGame();
+  void sendStartGame(const Game &game);
   //! Read the game status.
-  void readGameStatus();
+  void readGameStatus(size_t length);
+
+  // Game helpers
+  //! Start the clock on the game the client's playing now, if it isn't running already.
+  void startNextGame();
+  //! Report how a game went to the generator.
+  void reportGame(const Assignment &assignment, bool success);
+  //! Give a game back to the generator to be played by someone else.
+  void giveBack(const Game &game);
+  //! Give back every game that hasn't been reported, the client won't be finishing them.
+  void abandonGames();
+  //! The client's gone, leave its games with its session if it has one, then hang up.
+  void dropClient();
+  //! The lease on a game expired, give the game back and hang up.
+  void expireGame(GameTicket ticket);
+  //! Take out a lease on a game.
+  void grantLease(GameTicket ticket);
+  //! Let go of the lease on every game.
+  void releaseLeases();
+  //! Can the connection be handed off where it is?
+  bool canPark() const;
+  //! Stop here and tell the server we're ready to be handed off.
+  void parkNow();
 
 };
 
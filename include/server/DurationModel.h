@@ -0,0 +1,65 @@
+#ifndef SC2TM_DURATIONMODEL_H
+#define SC2TM_DURATIONMODEL_H
+
+#include "common/Game.h"
+#include "common/HashRegistry.h"
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+namespace sc2tm {
+
+//! Running estimates of how long games take.
+/**
+ * Running estimates of how long games take, learned from the games clients report back. Each map
+ * has a typical length and each bot a factor for how much it stretches (slow, defensive bots) or
+ * shortens (rushes) games relative to that. A game is expected to take its map's length scaled by
+ * the average of its bots' factors. Everything is an exponentially weighted moving average so the
+ * estimates follow changes over a long tournament.
+ *
+ * Estimates are read far more often than they're updated, so reads are lock free and updates are
+ * serialized with a lock.
+ */
+class DurationModel {
+  //! The typical length of a game on each map in seconds, zero until one's been seen.
+  std::unique_ptr<std::atomic<float>[]> mapSeconds;
+  //! How much each bot stretches a game relative to its map.
+  std::unique_ptr<std::atomic<float>[]> botFactors;
+  //! The typical length of any game, for maps that haven't been seen, zero until one's been seen.
+  std::atomic<float> allSeconds;
+
+  //! Lock for updating the estimates.
+  std::mutex mutex;
+
+public:
+  //! Construct a model that knows nothing yet about botCount bots and mapCount maps.
+  DurationModel(size_t botCount, size_t mapCount);
+
+  //! Learn from a finished game.
+  void record(const Game &game, float seconds);
+
+  //! The expected length of a map in seconds.
+  float mapEstimate(MapId map) const {
+    float seconds = mapSeconds[map].load(std::memory_order_relaxed);
+    if (seconds > 0)
+      return seconds;
+
+    // Nothing seen on this map, assume it's typical. Before anything's been seen at all every map
+    // is the same.
+    seconds = allSeconds.load(std::memory_order_relaxed);
+    return seconds > 0 ? seconds : 1;
+  }
+
+  //! How much a bot stretches a game.
+  float botFactor(BotId bot) const { return botFactors[bot].load(std::memory_order_relaxed); }
+
+  //! The expected length of a game in seconds.
+  float estimate(BotId bot0, BotId bot1, MapId map) const {
+    return mapEstimate(map) * (botFactor(bot0) + botFactor(bot1)) / 2;
+  }
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_DURATIONMODEL_H
@@ -1,11 +1,33 @@
 #ifndef SC2TM_GAMEGENERATOR_H
 #define SC2TM_GAMEGENERATOR_H
 
-#include "common/file_operations.h"
 #include "common/Game.h"
-#include "common/sha256.h"
+#include "common/HashRegistry.h"
+#include "common/IdBitset.h"
+#include "server/DurationModel.h"
+#include "server/MatchupMatrix.h"
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <vector>
 
 namespace sc2tm {
+
+//! Settings for a game generator.
+struct GeneratorConfig {
+  //! The shard the generator schedules.
+  uint32_t shard = 0;
+  //! The number of shards the matchups are split over.
+  uint32_t shardCount = 1;
+  //! Estimates to hand out the longest games first with, nullptr to hand them out in order.
+  const DurationModel *durations = nullptr;
+  //! The most copies of a game handed out at once near the end, 1 for no backup copies.
+  uint16_t maxCopies = 1;
+  //! Where to draw game ids from when generators share an id space, nullptr for our own.
+  std::atomic<GameId> *gameIds = nullptr;
+};
 // TODO TEST THE SHIT OUT OF THIS THING
 // Client has same maps/bots as us
 // Client has a subset of our maps/bots
@@ -16,107 +38,51 @@ namespace sc2tm {
 /**
  * This is part of an effort to reduce the amount of Game objects in memory due to the factorial
  * growth rate when adding more bots, more maps, and more games played.
+ *
+ * The public functions are safe to call from any thread, connections on every io thread share one
+ * generator.
  */
 class GameGenerator {
   //! The set of bots we have to work with.
-  HashSet bots;
+  IdBitset bots;
   //! The set of maps we have to work with.
-  HashSet maps;
-
-  //! Holds info about a particular matchup.
-  struct GameCounter {
-    // The difference between these two numbers is the number of games currently being played for this
-    // matchup.
-    //! The number of games left to be issued for this matchup.
-    /**
-     * The number of games left to be issued for this matchup. This number decreases as games are
-     * issued to clients, but can increase if a matchup fails to finish for some reason.
-     */
-    uint32_t left;
-
-    //! The number of games left to be confirmed as done.
-    /**
-     * The number of games left to be confirmed as done. This number will never increase. These
-     * games have been played and reported as done. When this hits 0 this set of games is considered
-     * to be entirely played.
-     */
-    uint32_t done;
-
-    //! No default constructor.
-    GameCounter() = delete;
-
-    //! Construct a game counter with a given number of games to play.
-    GameCounter(uint32_t games) : left(games), done(games) { }
-  };
+  IdBitset maps;
+
+  //! The shard this generator schedules.
+  uint32_t shard;
+  //! The number of shards the matchups are split over.
+  uint32_t shardCount;
 
-  //! A bot matchup.
+  //! Estimates of how long games take, nullptr to hand out games in order.
   /**
-   * A bot matchup. The constructor always ensures that the bots are in sorted order.
+   * Estimates of how long games take. If there are any, every step of generating a game picks the
+   * longest game it could give the client rather than the first. Starting the longest games first
+   * means the tournament isn't left waiting on a few long games at the end (longest processing
+   * time first scheduling). Which step a game comes from doesn't change, so the set of active
+   * matchups still stays small.
    */
-  struct Matchup {
-    //! The first bot in the matchup.
-    const SHA256Hash::ptr bot0;
-    //! The second bot in the matchup.
-    const SHA256Hash::ptr bot1;
-
-    //! No default constructor.
-    Matchup() = delete;
-
-    //! Construct a matchup from two bots.
-    Matchup(SHA256Hash::ptr bot0, SHA256Hash::ptr bot1);
-
-    //! Does this matchup contain the bot?
-    bool contains(const SHA256Hash::ptr bot) const;
-
-    //! Index of the bot in this matchup.
-    uint8_t indexOf(const SHA256Hash::ptr bot) const;
-  };
+  const DurationModel *durations;
 
-  //! Functor to order matchups.
-  struct CompareMatchupFtor {
-    int operator()(const Matchup &match0, const Matchup &match1) const {
-      int first = SHA256Hash::compare(match0.bot0, match1.bot0);
-      if (first == 0)
-        return SHA256Hash::compare(match0.bot1, match1.bot1);
-      else
-        return first;
-    }
-  };
-
-  //! Typedef that maps a map to its game counter.
-  typedef std::map<SHA256Hash::ptr, GameCounter, CompareHashPtrFtor> CounterMap;
-  //! Typedef that maps a matchup to map of game counters.
-  typedef std::map<Matchup, CounterMap, CompareMatchupFtor> MatchupMap;
-  //! Typedef that maps a matchup to a list of finished maps.
-  typedef std::map<Matchup, HashSet, CompareMatchupFtor> FinishedMap;
-  //! Typdef that holds matchups as a set.
-  typedef std::set<Matchup, CompareMatchupFtor> MatchupSet;
-
-  //! Map of games that are trying to be scheduled.
+  //! The scheduling state of every matchup.
   /**
-   * Map of games that are trying to be scheduled. This represents the set of matches that the
-   * generator has begun scheduling. It will keep trying to schedule games from these matchups and
-   * map combos any time a client asks for a new one. Only if a client doesn't have a matchup of
-   * bots or a map to go with a matchup will the scheduler begin a new matchup.
+   * The scheduling state of every matchup. An active matchup is one the generator has begun
+   * scheduling. It will keep trying to schedule games from these matchups and map combos any time
+   * a client asks for a new one. Only if a client doesn't have a matchup of bots or a map to go
+   * with a matchup will the scheduler begin a new matchup.
    *
-   * The idea is that we would like to keep this as small as possible. The way things are scheduled,
-   * "nice" clients, clients that have many of our bots and maps, that normally would have inserted
-   * a matchup that's sequentially earlier, will try to finish matchups that less forgiving clients
-   * have created out of necessity.
+   * The idea is that we would like to keep the active matchups as few as possible. The way things
+   * are scheduled, "nice" clients, clients that have many of our bots and maps, that normally
+   * would have inserted a matchup that's sequentially earlier, will try to finish matchups that
+   * less forgiving clients have created out of necessity.
    *
    * In the ideal situation (all clients have all bots and maps) clients will play through a single
-   * matchup and through each map sequentially. This would mean at most this map contains a single
-   * matchup and a single map with a counter (maybe two if we're on the cusp of finishing one).
-   */
-  MatchupMap active;
-
-  //! The map of matchups to maps that are completed.
-  /**
-   * This maps a matchup to a set of maps that have been completed. These will only be moved in here
-   * if the GameCounter.done hits the maximum. The generator will check here before adding a new
-   * matchup and maps to the active map.
+   * matchup and through each map sequentially. This would mean at most there's a single active
+   * matchup with a single active map (maybe two if we're on the cusp of finishing one).
+   *
+   * Once a map has finished for a matchup it's recorded in the matchup's finished maps, and once
+   * every map has finished the matchup collapses to a single finished bit.
    */
-  FinishedMap finished;
+  MatchupMatrix matrix;
 
   //! The set of bots that have played all of their matchups.
   /**
@@ -124,72 +90,220 @@ class GameGenerator {
    * played on every map the requisite number of times. Bots are added to this set when the final
    * for this bot's final matchup has been played.
    */
-  HashSet finishedBots;
+  IdBitset finishedBots;
+
+  //! The matchups this generator has finished, in the order they finished.
+  /**
+   * The matchups this generator has finished, in the order they finished. The matrix collapses a
+   * finished matchup down to a bit, which would mean walking every pair of bots to find them
+   * again, so snapshot reads them from here instead.
+   */
+  std::vector<MatchupMatrix::Matchup> finishedMatchups;
+
+  //! The most copies of a game handed out at once.
+  uint16_t maxCopies;
+
+  //! A game that's been handed out and hasn't been reported on.
+  struct Outstanding {
+    //! The game.
+    Game game;
+    //! The number of clients playing it.
+    uint16_t copies;
+  };
+
+  //! Games that have been handed out and not reported on, by id, only kept with backup copies.
+  /**
+   * Games that have been handed out and not reported on, by id. Ids are handed out in increasing
+   * order so the oldest games come first.
+   *
+   * Near the end of a tournament one slow or vanished client can hold up the last game while
+   * everyone else sits idle. So once a client can't be given new work it's given a backup copy of
+   * the oldest game it can play instead. The first success for a game is kept and the game leaves
+   * this map, any later results for it are ignored. A failure only gives the game back once every
+   * copy has failed, so the counters in the matrix only ever see one result per game, exactly as
+   * if there were no copies.
+   */
+  std::map<GameId, Outstanding> outstanding;
+
+  //! The number of games that haven't been handed out yet, given back games included.
+  uint64_t unissued = 0;
+
+  //! The id given to the next game handed out, when we don't share an id space.
+  std::atomic<GameId> ownGameIds{0};
+
+  //! The id given to the next game handed out, either our own or shared with other generators.
+  std::atomic<GameId> *gameIds;
+
+  //! Lock guarding all of the above, held for the whole of each public call.
+  std::mutex mutex;
 
 public:
-  // TODO This could (and should) be deleted once Server can construct this as part of its init.
-  // TODO This won't leave it invalid, but no games will be generated because the set of bots and
-  // TODO maps will be empty.
-  //! Default constructor.
-  GameGenerator() = default;
+  //! A client waiting on a game in a batch.
+  struct GameRequest {
+    //! The set of bots the client has available.
+    const IdBitset *bots;
+    //! The set of maps the client has available.
+    const IdBitset *maps;
+    //! The game found for the client.
+    Game game;
+    //! Was a game found?
+    bool found;
+  };
 
-  //! Construct a game generator for given bots and map sets.
-  GameGenerator(const SHAFileMap &botMap, const SHAFileMap &mapMap);
+  //! How many games of a matchup have been played on a map.
+  struct Progress {
+    //! The first (lower id) bot in the matchup.
+    BotId bot0;
+    //! The second (higher id) bot in the matchup.
+    BotId bot1;
+    //! The map, invalidHashId for every map.
+    MapId map;
+    //! The number of games that have succeeded.
+    uint16_t played;
+  };
+
+  //! Construct a game generator for every bot and map in the registries.
+  /**
+   * Construct a game generator for every bot and map in the registries. If the matchups are split
+   * over several shards this generator only schedules the matchups in its own shard.
+   *
+   * @param botRegistry The bots to schedule.
+   * @param mapRegistry The maps to schedule.
+   * @param config Which shard to schedule and how.
+   */
+  GameGenerator(const HashRegistry &botRegistry, const HashRegistry &mapRegistry,
+                const GeneratorConfig &config = GeneratorConfig());
 
   //! Generate a game for a client with given bot and map sets.
   /**
    * Generate a game for a client with given bot and map sets. This will try to finish matchups and
    * their active maps as soon as possible, within the list of bots and maps that the client has.
    * This means it will target its generated games to the maps and bots available to a client.
+   * Only new work is handed out, see generateBackup for copies of games already being played.
    *
    * @param game The game to fill in.
    * @param cBots The set of bots the client has available.
    * @param cMaps The set of maps the client has available.
    * @return True if a game was found, false otherwise.
    */
-  bool generateGame(Game &game, HashSet cBots, HashSet cMaps);
+  bool generateGame(Game &game, const IdBitset &cBots, const IdBitset &cMaps);
+
+  //! Generate games for a batch of clients at once.
+  /**
+   * Generate games for a batch of clients at once, trying to keep as many of them busy as
+   * possible. Handing games out one at a time gives each client the first game that fits, so a
+   * client that could play anything can take the last game a picky client could have played.
+   * Here the games left in active maps are assigned with a maximum matching between clients and
+   * games instead. Clients the matching can't serve go through the same steps as generateGame,
+   * least flexible first, and if one still has nothing a served client that can be given new
+   * work hands its game over. Backup copies are never handed out here, see generateBackup.
+   *
+   * Requests that are already found are left alone.
+   *
+   * @param requests The clients to find games for.
+   */
+  void generateGames(std::vector<GameRequest> &requests);
+
+  //! Give a client a copy of the oldest outstanding game it can play.
+  /**
+   * Give a client a copy of the oldest outstanding game it can play. Only meant for when there's
+   * no new work the client can start anywhere, which the caller has to decide since new work may
+   * be waiting in other generators.
+   *
+   * @param game The game to fill in.
+   * @param cBots The set of bots the client has available.
+   * @param cMaps The set of maps the client has available.
+   * @return True if a copy was handed out, false if there's nothing the client can help with.
+   */
+  bool generateBackup(Game &game, const IdBitset &cBots, const IdBitset &cMaps);
+
+  //! The number of games that haven't been handed out yet, given back games included.
+  uint64_t unissuedCount();
 
   //! Notify the generator that a game completed successfully.
   /**
    * Notify the generator that a game completed successfully. This will commit the game as done and
    * remove it from the in progress state. This function will also try to commit maps as done for a
    * matchup and bots as done entirely if they've competed against every other bot on every map the
-   * requisite number of times.
+   * requisite number of times. Results for a copy of a game that's already succeeded, or for a game
+   * that isn't out being played, are ignored.
    *
    * @param game The game that completed successfully.
+   * @return The number of games of the matchup that have now been played on the map, 0 if the
+   * result was ignored.
    */
-  void notifySuccess(const Game &game);
+  uint16_t notifySuccess(const Game &game);
 
   //! Notify the generator that a game did not complete successfully.
   /**
    * Notify the generator that a game did not complete successfully. This game will be added back
-   * into the pool of games to be rescheduled to another client.
+   * into the pool of games to be rescheduled to another client, unless another copy of it is still
+   * being played. Failures for games that aren't out being played are ignored.
    *
    * @param game The game that did not complete successfully.
+   * @return True if the game was given back, false if it's still being played or was ignored.
+   */
+  bool notifyFail(const Game &game);
+
+  //! Record the progress of every started matchup this generator schedules.
+  /**
+   * Record the progress of every started matchup this generator schedules. Finished matchups are
+   * recorded once for every map. Games that are out being played don't count.
+   *
+   * @param progress The list to add to.
+   */
+  void snapshot(std::vector<Progress> &progress);
+
+  //! Bring a matchup up to at least some progress.
+  /**
+   * Bring a matchup up to at least some progress, as though the games had been handed out and
+   * succeeded. Progress that's already been made isn't counted again, so restoring the same
+   * progress twice, or older progress after newer, changes nothing. Meant for rebuilding state
+   * before any games are handed out; matchups other shards schedule are ignored.
+   *
+   * @param progress The progress to restore.
    */
-  void notifyFail(const Game &game);
+  void restore(const Progress &progress);
+
+  //! Take a game that's already being played out of the pool.
+  /**
+   * Take a game that's already being played out of the pool, as though it had just been handed
+   * out, so a client carrying on with it from another server process can report on it. Copies of
+   * a game share an id, so adopting the same id again only counts another copy. Meant for use
+   * after restoring progress and before any games are handed out.
+   *
+   * @param game The game being played.
+   */
+  void adopt(const Game &game);
 
 private:
+  //! Get the bots and maps a client could be scheduled with, false if there can't be any games.
+  bool usableSets(const IdBitset &cBots, const IdBitset &cMaps, IdBitset &usableBots,
+                  IdBitset &usableMaps) const;
+
+  //! Try each way of generating a game in turn, for already usable bots and maps.
+  bool generateUsable(Game &game, const IdBitset &cBots, const IdBitset &cMaps);
+
   //! Try to generate a game for a client from an active matchup and map.
   /**
    * Try to generate a game for a client from an active matchup and map. An active matchup is one
    * that has not finished all of its games on every map, an active map is one that has not finished
-   * playing all of its games for a single matchup. Concretely this means that a matchup exists in
-   * the active map, in which one of the active maps has a counter whose left value is > 0.
+   * playing all of its games for a single matchup. Concretely this means that a matchup is active
+   * in the matrix, and one of its active maps has a counter whose left value is > 0.
    *
    * @param game The game to fill in.
    * @param cBots The set of bots the client has available.
    * @param cMaps The set of maps the client has available.
    * @return True if a game was found, false otherwise.
    */
-  bool generateActiveMap(Game &game, HashSet cBots, HashSet cMaps);
+  bool generateActiveMap(Game &game, const IdBitset &cBots, const IdBitset &cMaps);
 
   //! Try to generate a game for a client from an active matchup and new map.
   /**
    * Try to generate a game for a client from an active matchup and new map. An active matchup is
    * one that has not finished all of its games on every map. Concretely this means that a matchup
-   * exists in the active and/or finished maps where cMaps - active[matchup] - finished[matchup] is
-   * not empty. The new game is generated from this difference and added to the active map.
+   * is active in the matrix where cMaps - activeMaps - finishedMaps is not empty. The new game is
+   * generated from this difference and its map is started.
    *
    * This is meant to be used under the assumption that a game couldn't be generated by
    * generateActiveMap but even without that assumption a game generated by this function holds the
@@ -200,13 +314,13 @@ private:
    * @param cMaps The set of maps the client has available.
    * @return True if a game was found, false otherwise.
    */
-  bool generateActiveMatchup(Game &game, HashSet cBots, HashSet cMaps);
+  bool generateActiveMatchup(Game &game, const IdBitset &cBots, const IdBitset &cMaps);
 
   //! Try to generate a game for a client from a new matchup and map.
   /**
    * Try to generate a game for a client from a new matchup and map. A new matchup is one that is
-   * not in either the active or finished maps. A new matchup is generated and the first map
-   * possible is scheduled.
+   * neither active nor finished in the matrix. A new matchup is started and the first map possible
+   * is scheduled.
    *
    * This is meant to be used under the assumption that a game couldn't be generated by
    * generateActiveMatchup but even without that assumption a game generated by this function holds
@@ -217,7 +331,31 @@ private:
    * @param cMaps The set of maps the client has available.
    * @return True if a game was found, false otherwise.
    */
-  bool generateNewMatchup(Game &game, HashSet cBot, HashSet cMaps);
+  bool generateNewMatchup(Game &game, const IdBitset &cBots, const IdBitset &cMaps);
+
+  //! Bring a map of an active matchup up to some number of played games.
+  /**
+   * Bring a map of an active matchup up to some number of played games.
+   *
+   * @return True if that finished the whole matchup, in which case the cell has been recycled.
+   */
+  bool restoreMap(MatchupMatrix::Cell &cell, MapId map, uint16_t played);
+
+  //! Give a client a copy of the oldest outstanding game it can play, for already usable bots and
+  //! maps, false if there isn't one.
+  bool copyOutstanding(Game &game, const IdBitset &cBots, const IdBitset &cMaps);
+
+  //! The cell of a game that's out being played, nullptr if the game can't be out.
+  MatchupMatrix::Cell *findOut(const Game &game);
+
+  //! Give a game that's just been generated an id and track it if we're making backup copies.
+  void issue(Game &game);
+
+  //! The map to start next out of a set, the longest if we have estimates, else the first.
+  MapId longestMap(const IdBitset &cMaps) const;
+
+  //! The slowest bot in both sets, invalidHashId if there isn't one. Needs estimates.
+  BotId slowestBot(const IdBitset &opponents, const IdBitset &cBots) const;
 };
 
 } // End sc2tm namespace
@@ -0,0 +1,111 @@
+#ifndef SC2TM_HANDOFF_H
+#define SC2TM_HANDOFF_H
+
+#include "common/Game.h"
+#include "common/packets.h"
+#include "common/sha256.h"
+#include "server/GameGenerator.h"
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace sc2tm {
+
+//! A game a handed off client hasn't reported on.
+struct HandoffGame {
+  //! The ticket the game was handed out with.
+  GameTicket ticket;
+  //! The game.
+  Game game;
+  //! How long the client's been playing it, zero if the client hasn't got to it yet.
+  std::chrono::milliseconds elapsed;
+};
+
+//! A connection being handed to a new server process.
+struct HandoffConnection {
+  //! The connection's id.
+  uint32_t id;
+  //! The connection's socket.
+  int fd;
+  //! Does the client have a session?
+  bool hasSession = false;
+  //! The client's session, handed over alongside the connections.
+  SessionToken session;
+  //! The games the client hasn't reported on.
+  std::vector<HandoffGame> games;
+  //! The ticket the client's next game gets.
+  GameTicket nextTicket;
+  //! How many games the client wants queued up at once.
+  uint8_t queueDepth;
+  //! The bots the client has.
+  std::vector<HashId> bots;
+  //! The maps the client has.
+  std::vector<HashId> maps;
+  //! Bytes of the client's next frame that had already been read.
+  std::string pending;
+};
+
+//! A client session being handed to a new server process.
+struct HandoffSession {
+  //! The session's token.
+  SessionToken token;
+  //! Digest of the client's handshake.
+  uint8_t catalog[SHA256::DIGEST_SIZE];
+  //! Is a handed off connection using the session?
+  bool attached;
+  //! The connection using the session, if one is.
+  uint32_t owner;
+  //! The games a dropped client hadn't reported on, a connection keeps its own.
+  std::vector<HandoffGame> games;
+  //! The ticket the client's next game gets.
+  GameTicket nextTicket;
+  //! How many games the client wants queued up at once.
+  uint8_t queueDepth;
+  //! The bots the client has.
+  std::vector<HashId> bots;
+  //! The maps the client has.
+  std::vector<HashId> maps;
+};
+
+//! Everything a new server process needs to carry on from an old one.
+struct HandoffState {
+  //! The catalog the old process was scheduling.
+  uint8_t catalog[SHA256::DIGEST_SIZE];
+  //! The listening socket clients connect to.
+  int acceptorFd = -1;
+  //! The generator's progress.
+  std::vector<GameGenerator::Progress> progress;
+  //! The connections, each with games out.
+  std::vector<HandoffConnection> connections;
+  //! The sessions of the connections and of clients that have dropped and may come back.
+  std::vector<HandoffSession> sessions;
+};
+
+//! Send a handoff to a new server process.
+/**
+ * Send a handoff to a new server process over a connected Unix socket. The sockets are passed
+ * with SCM_RIGHTS, so the new process gets its own descriptors for them and the old process can
+ * close its copies without disturbing the clients.
+ *
+ * @param sock The Unix socket the new process connected on.
+ * @param state The state to send.
+ * @return True if everything was sent, false otherwise.
+ */
+bool sendHandoff(int sock, const HandoffState &state);
+
+//! Receive a handoff from an old server process.
+/**
+ * Receive a handoff from an old server process, connecting to its upgrade socket and blocking
+ * until everything's arrived.
+ *
+ * @param path The old process's upgrade socket.
+ * @param state The state to fill in.
+ * @return True if a whole handoff was received, false otherwise.
+ */
+bool receiveHandoff(const std::string &path, HandoffState &state);
+
+} // End sc2tm namespace
+
+#endif //SC2TM_HANDOFF_H
@@ -0,0 +1,81 @@
+#ifndef SC2TM_LEASEMANAGER_H
+#define SC2TM_LEASEMANAGER_H
+
+#include "server/TimerWheel.h"
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+#include <functional>
+#include <mutex>
+
+namespace sc2tm {
+
+//! Hands out leases on games that expire unless they're released or renewed in time.
+/**
+ * Hands out leases on games that expire unless they're released or renewed in time. A client that
+ * vanishes mid-game never reports back, so without a lease its game would never be played. When a
+ * lease expires its callback is run so the game can be given back to the generator.
+ *
+ * Leases live in a timer wheel driven by an io service timer, so granting, renewing and releasing
+ * are O(1) and a tick costs O(1) per lease no matter how many are outstanding. Every function is
+ * safe to call from any thread. Expiry callbacks are run on an io thread without the lease lock
+ * held, so they're free to grant and release leases themselves.
+ */
+class LeaseManager {
+public:
+  //! Identifies a lease.
+  typedef TimerWheel::TimerId LeaseId;
+
+  //! An id no lease has.
+  static const LeaseId invalidLease = TimerWheel::invalidTimer;
+
+  //! Construct a lease manager that ticks on an io service.
+  /**
+   * Construct a lease manager that ticks on an io service.
+   *
+   * @param service The io service to tick on.
+   * @param duration How long a lease lasts.
+   * @param tick How often leases are checked, expiry is rounded up to a multiple of this.
+   */
+  LeaseManager(boost::asio::io_service &service, std::chrono::milliseconds duration,
+               std::chrono::milliseconds tick = std::chrono::milliseconds(100));
+
+  //! Grant a lease that runs onExpire if it isn't released or renewed in time.
+  LeaseId grant(std::function<void()> onExpire);
+
+  //! Give a lease a full duration again, returns false if it had already expired.
+  bool renew(LeaseId lease);
+
+  //! Release a lease, returns false if it had already expired.
+  bool release(LeaseId lease);
+
+private:
+  //! Schedule the next tick.
+  void schedule();
+
+  //! Advance the wheel to the present and run whatever expired.
+  void tick(const boost::system::error_code &error);
+
+  //! The number of ticks a lease lasts.
+  uint64_t durationTicks;
+
+  //! How often leases are checked.
+  std::chrono::milliseconds tickLength;
+
+  //! When tick zero was.
+  std::chrono::steady_clock::time_point start;
+
+  //! The leases.
+  TimerWheel wheel;
+
+  //! Lock for the wheel.
+  std::mutex mutex;
+
+  //! Timer for the next tick.
+  boost::asio::steady_timer timer;
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_LEASEMANAGER_H
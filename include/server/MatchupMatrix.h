@@ -0,0 +1,196 @@
+#ifndef SC2TM_MATCHUPMATRIX_H
+#define SC2TM_MATCHUPMATRIX_H
+
+#include "common/HashRegistry.h"
+#include "common/IdBitset.h"
+
+#include <cassert>
+#include <cstdint>
+#include <set>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace sc2tm {
+
+//! Flat store of the scheduling state of every matchup.
+/**
+ * Flat store of the scheduling state of every matchup. Matchups live in a triangular array indexed
+ * by their pair of bots and are always in one of three states:
+ *   - new: no game has been scheduled yet,
+ *   - active: at least one map has been started and not every map has finished,
+ *   - finished: every map has been played the requisite number of times.
+ *
+ * New and finished matchups cost a bit each in the triangle. Only active matchups get a Cell with
+ * per-map counters, and those are recycled once the matchup finishes. Since the generator works to
+ * keep the number of active matchups small, this keeps even very large tournaments in memory.
+ *
+ * The matrix also keeps the indexes the generator searches, updated as state changes rather than
+ * rebuilt per request: the ordered set of (matchup, map) slots that still have games to give out,
+ * the ordered set of active matchups, and for each bot the set of opponents it hasn't started a
+ * matchup with. Games must be taken and returned through takeGame and returnGame so the ready
+ * slots stay in sync with the counters.
+ */
+class MatchupMatrix {
+public:
+  //! Holds info about a particular matchup on a particular map.
+  struct GameCounter {
+    // The difference between these two numbers is the number of games currently being played for
+    // this matchup.
+    //! The number of games left to be issued for this matchup.
+    /**
+     * The number of games left to be issued for this matchup. This number decreases as games are
+     * issued to clients, but can increase if a matchup fails to finish for some reason.
+     */
+    uint16_t left;
+
+    //! The number of games left to be confirmed as done.
+    /**
+     * The number of games left to be confirmed as done. This number will never increase. These
+     * games have been played and reported as done. When this hits 0 this set of games is
+     * considered to be entirely played.
+     */
+    uint16_t done;
+  };
+
+  //! The state of an active matchup.
+  struct Cell {
+    //! The first (lower id) bot in the matchup.
+    BotId bot0;
+    //! The second (higher id) bot in the matchup.
+    BotId bot1;
+    //! Counters for every map, only meaningful for maps in activeMaps.
+    std::vector<GameCounter> counters;
+    //! Maps that have been started but haven't finished.
+    IdBitset activeMaps;
+    //! Maps that have been played the requisite number of times.
+    IdBitset finishedMaps;
+  };
+
+  //! A pair of bots, ordered so bot0 < bot1.
+  typedef std::pair<BotId, BotId> Matchup;
+
+  //! A map in an active matchup.
+  struct Slot {
+    //! The first (lower id) bot in the matchup.
+    BotId bot0;
+    //! The second (higher id) bot in the matchup.
+    BotId bot1;
+    //! The map.
+    MapId map;
+
+    //! Order by matchup and then map, the order the generator prefers to hand games out in.
+    bool operator<(const Slot &other) const {
+      if (bot0 != other.bot0)
+        return bot0 < other.bot0;
+      if (bot1 != other.bot1)
+        return bot1 < other.bot1;
+      return map < other.map;
+    }
+  };
+
+  //! Construct an empty matrix.
+  MatchupMatrix() = default;
+
+  //! Construct a matrix where every matchup between botCount bots over mapCount maps is new.
+  /**
+   * Construct a matrix where every matchup between botCount bots over mapCount maps is new. When
+   * the matchups are split over several shards only the ones belonging to this shard are new, the
+   * rest start out finished so they're never scheduled or counted towards a bot's remaining work.
+   *
+   * @param botCount The number of bots.
+   * @param mapCount The number of maps.
+   * @param shard The shard this matrix schedules.
+   * @param shardCount The number of shards the matchups are split over.
+   */
+  MatchupMatrix(size_t botCount, size_t mapCount, uint32_t shard = 0, uint32_t shardCount = 1);
+
+  //! The shard a matchup belongs to when matchups are split over shardCount shards.
+  static uint32_t shardOf(BotId b0, BotId b1, uint32_t shardCount) {
+    // Mix the index so neighbouring matchups, which tend to be scheduled together, spread out
+    uint64_t mixed = (uint64_t) cellIndex(b0, b1) * 0x9E3779B97F4A7C15ull;
+    return (uint32_t) ((mixed >> 32) % shardCount);
+  }
+
+  //! Has the matchup been started (it's either active or finished)?
+  bool isStarted(BotId b0, BotId b1) const { return started.test(cellIndex(b0, b1)); }
+
+  //! Has the matchup played every map?
+  bool isFinished(BotId b0, BotId b1) const { return finished.test(cellIndex(b0, b1)); }
+
+  //! Has the bot played every map against every opponent?
+  bool isFinished(BotId bot) const { return remaining[bot] == 0; }
+
+  //! Get an active matchup's cell, nullptr if the matchup isn't active.
+  Cell *find(BotId b0, BotId b1);
+
+  //! Move a new matchup to active and get its cell, with no maps started.
+  Cell &start(BotId b0, BotId b1);
+
+  //! Start a map in an active matchup with a given number of games.
+  void startMap(Cell &cell, MapId map, uint16_t games);
+
+  //! Mark a map in an active matchup as finished.
+  /**
+   * Mark a map in an active matchup as finished. If that was the last map the matchup becomes
+   * finished and its cell is recycled, so the cell must not be used again.
+   *
+   * @return True if the whole matchup is now finished.
+   */
+  bool finishMap(Cell &cell, MapId map);
+
+  //! Take a game from an active map, it must have games left.
+  void takeGame(Cell &cell, MapId map);
+
+  //! Give a game back to an active map.
+  void returnGame(Cell &cell, MapId map);
+
+  //! The number of active matchups.
+  size_t activeCount() const { return activeIndex.size(); }
+
+  //! Active maps with games left to give out, in matchup then map order.
+  const std::set<Slot> &readySlots() const { return ready; }
+
+  //! Active matchups in order.
+  const std::set<Matchup> &activeMatchups() const { return active; }
+
+  //! The opponents a bot hasn't started a matchup with.
+  const IdBitset &unstartedOpponents(BotId bot) const { return unstarted[bot]; }
+
+private:
+  //! Index of a pair of bots in the triangle.
+  static uint32_t cellIndex(BotId b0, BotId b1) {
+    assert(b0 != b1);
+    if (b0 > b1)
+      std::swap(b0, b1);
+    return (uint32_t) ((uint64_t) b1 * (b1 - 1) / 2 + b0);
+  }
+
+  //! The number of maps each matchup is played on.
+  size_t mapCount = 0;
+
+  //! Matchups that have been started, one bit per pair of bots.
+  IdBitset started;
+  //! Matchups that have finished, one bit per pair of bots.
+  IdBitset finished;
+
+  //! Storage for active matchups' cells.
+  std::vector<Cell> cells;
+  //! Cells that can be reused.
+  std::vector<uint32_t> freeCells;
+  //! Maps an active matchup's triangle index to its cell.
+  std::unordered_map<uint32_t, uint32_t> activeIndex;
+
+  //! Active maps with games left to give out.
+  std::set<Slot> ready;
+  //! Active matchups.
+  std::set<Matchup> active;
+  //! For each bot, the opponents it hasn't started a matchup with.
+  std::vector<IdBitset> unstarted;
+  //! For each bot, the number of (opponent, map) pairs that haven't finished.
+  std::vector<uint64_t> remaining;
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_MATCHUPMATRIX_H
@@ -0,0 +1,192 @@
+#ifndef SC2TM_REPLICATION_H
+#define SC2TM_REPLICATION_H
+
+#include "common/Game.h"
+#include "common/sha256.h"
+#include "server/GameGenerator.h"
+
+#include <boost/asio.hpp>
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace sc2tm {
+
+class ShardedGameGenerator;
+
+//! A record on the replication stream, a GameGenerator::Progress as it's laid out on the wire.
+struct ReplicaRecord {
+  BotId bot0;
+  BotId bot1;
+  MapId map;
+  uint16_t played;
+  uint16_t pad;
+};
+
+//! The start of the replication stream.
+struct ReplicaHello {
+  uint8_t magic[8];
+  //! The catalog the primary is scheduling.
+  uint8_t catalog[SHA256::DIGEST_SIZE];
+  //! The games per (matchup, map) the primary is scheduling.
+  uint32_t numGames;
+  uint32_t pad;
+};
+
+//! Streams a primary server's progress to standby servers.
+/**
+ * Streams a primary server's progress to standby servers. A standby that connects is sent a hello
+ * and then a snapshot of the generator's progress, followed by every success as it happens. Every
+ * record says how many games of a (matchup, map) have been played, the same as the state log, so
+ * the standby can restore them in any order and an event the snapshot already holds changes
+ * nothing. That's what lets the snapshot be taken after the standby starts receiving events
+ * without stopping the scheduler.
+ *
+ * Records are queued per standby and written out asynchronously on the io service, so reporting a
+ * result never waits on the network. A standby that falls too far behind is dropped; it can
+ * reconnect and start again from a snapshot.
+ */
+class ReplicationSource {
+public:
+  //! Start listening for standbys.
+  /**
+   * Start listening for standbys.
+   *
+   * @param service The io service to run on.
+   * @param gen The generator being replicated, it must outlive the source.
+   * @param catalog The catalog digest standbys must match.
+   * @param port The port to listen on.
+   */
+  ReplicationSource(boost::asio::io_service &service, ShardedGameGenerator &gen,
+                    const SHA256Hash &catalog, uint16_t port);
+
+  //! Send a success to every standby.
+  void publish(const Game &game, uint16_t played);
+
+  //! Stop listening and hang up on every standby.
+  void close();
+
+private:
+  //! A connected standby.
+  struct Standby {
+    Standby(boost::asio::io_service &service) : socket(service) { }
+
+    //! The standby's socket.
+    boost::asio::ip::tcp::socket socket;
+    //! Records waiting to be sent.
+    std::vector<ReplicaRecord> pending;
+    //! The bytes being sent.
+    std::vector<uint8_t> sending;
+    //! Is a write in progress?
+    bool writing = false;
+  };
+
+  //! Start accepting a standby.
+  void startAccept();
+
+  //! Write out a standby's pending records, if there are any. Call with the lock held.
+  void flush(const std::shared_ptr<Standby> &standby);
+
+  //! Drop a standby. Call with the lock held.
+  void drop(const std::shared_ptr<Standby> &standby);
+
+  //! The io service standbys are served on.
+  boost::asio::io_service &service;
+
+  //! The generator being replicated.
+  ShardedGameGenerator &gen;
+
+  //! The catalog digest.
+  uint8_t catalog[SHA256::DIGEST_SIZE];
+
+  //! Accepts standbys.
+  boost::asio::ip::tcp::acceptor acceptor;
+
+  //! Guards the standbys and their queues.
+  std::mutex mutex;
+  //! The connected standbys.
+  std::vector<std::shared_ptr<Standby>> standbys;
+};
+
+//! Follows a primary server's replication stream, keeping a standby's generator up to date.
+/**
+ * Follows a primary server's replication stream, keeping a standby's generator up to date. The
+ * sink keeps trying to connect until it reaches the primary. Once it's been following and the
+ * stream ends it tries once more, in case the primary was handing over to a new process, and if
+ * that fails the primary is gone and the takeover handler is called so the standby can start
+ * serving clients from where the primary left off.
+ */
+class ReplicationSink {
+public:
+  //! Start following a primary.
+  /**
+   * Start following a primary.
+   *
+   * @param service The io service to run on.
+   * @param gen The generator to keep up to date, it must outlive the sink.
+   * @param catalog The catalog digest the primary must match.
+   * @param host The primary's host.
+   * @param port The primary's replication port.
+   * @param onTakeover Called once, on the io service, when the primary goes away.
+   * @throws std::runtime_error From the io service if the primary's catalog doesn't match.
+   */
+  ReplicationSink(boost::asio::io_service &service, ShardedGameGenerator &gen,
+                  const SHA256Hash &catalog, const std::string &host, uint16_t port,
+                  std::function<void()> onTakeover);
+
+private:
+  //! Try to connect to the primary.
+  void connect();
+
+  //! Try to connect to the primary again after a delay.
+  void connectLater();
+
+  //! Read the hello.
+  void readHello();
+
+  //! Read the next batch of records.
+  void readRecords();
+
+  //! The stream ended, take over if we'd been following.
+  void lost();
+
+  //! The primary's gone for good, take over.
+  void takeOver();
+
+  //! The generator being kept up to date.
+  ShardedGameGenerator &gen;
+
+  //! The catalog digest.
+  uint8_t catalog[SHA256::DIGEST_SIZE];
+
+  //! The primary.
+  boost::asio::ip::tcp::endpoint primary;
+
+  //! The connection to the primary.
+  boost::asio::ip::tcp::socket socket;
+
+  //! Waits between connection attempts.
+  boost::asio::steady_timer retry;
+
+  //! Bytes read from the primary, a record may be split across reads.
+  std::vector<uint8_t> buffer;
+  //! The number of bytes in buffer.
+  size_t buffered = 0;
+
+  //! The number of records applied.
+  uint64_t applied = 0;
+
+  //! Is the primary gone if the next connection attempt fails?
+  bool lastChance = false;
+
+  //! Called when the primary goes away.
+  std::function<void()> onTakeover;
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_REPLICATION_H
@@ -0,0 +1,167 @@
+#ifndef SC2TM_SCHEDULER_H
+#define SC2TM_SCHEDULER_H
+
+#include "common/Game.h"
+#include "common/IdBitset.h"
+#include "server/ShardedGameGenerator.h"
+
+#include <boost/asio.hpp>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sc2tm {
+
+//! Runs the game generator on its own thread, fed by a queue of requests.
+/**
+ * Runs the game generator on its own thread, fed by a queue of requests. Connections post
+ * schedule, success and failure requests to a lock-free multiple producer, single consumer queue
+ * and carry on. The scheduler thread drains the queue in batches, so a burst of completions (a
+ * round of clients finishing at once) is handled together while the generator's state stays hot
+ * in one core's cache and no io thread ever waits on a generator lock.
+ *
+ * Within a batch every completion is applied before any game is handed out, which frees up as much
+ * work as possible for the waiting clients. Results are posted back to the requesting connection's
+ * strand.
+ *
+ * With a gather window the scheduler holds on to a batch with clients waiting in it a little
+ * longer to let more clients join, then assigns the whole batch at once with
+ * ShardedGameGenerator::generateGames rather than one client at a time.
+ */
+class Scheduler {
+public:
+  //! Called with whether a game was found and, if so, the game.
+  typedef std::function<void(bool found, const Game &game)> ScheduleHandler;
+
+  //! Start a scheduler thread over a generator.
+  /**
+   * Start a scheduler thread over a generator. The generator must outlive the scheduler and should
+   * no longer be used directly.
+   *
+   * @param gen The generator to schedule with.
+   * @param maxBatch The most requests handled in one batch.
+   * @param window How long to gather waiting clients for, zero to serve them as they arrive.
+   */
+  Scheduler(ShardedGameGenerator &gen, size_t maxBatch,
+            std::chrono::milliseconds window = std::chrono::milliseconds::zero());
+
+  //! Stop the scheduler thread, then handle whatever requests are still queued.
+  ~Scheduler();
+
+  //! Ask for a game for a client.
+  /**
+   * Ask for a game for a client. The handler is run on the strand once the request is handled.
+   * The bot and map sets aren't copied, they must be left alone until the handler runs.
+   *
+   * @param bots The set of bots the client has available.
+   * @param maps The set of maps the client has available.
+   * @param home The client's home shard.
+   * @param strand The strand to run the handler on.
+   * @param handler The handler to call with the result.
+   */
+  void schedule(const IdBitset &bots, const IdBitset &maps, uint32_t home,
+                boost::asio::io_service::strand &strand, ScheduleHandler handler);
+
+  //! Report that a game completed successfully and how many seconds it took, zero if unknown.
+  void notifySuccess(const Game &game, float seconds = 0);
+
+  //! Report that a game did not complete successfully.
+  void notifyFail(const Game &game);
+
+  //! Wait until every request queued so far has been handled.
+  void drain();
+
+private:
+  //! The kinds of request.
+  enum RequestType : uint8_t {
+    SCHEDULE = 0,
+    SUCCESS,
+    FAIL,
+    DRAIN
+  };
+
+  //! A request from a connection.
+  struct Request {
+    //! What's being asked.
+    RequestType type = SCHEDULE;
+    //! The game being reported, or the game found for a schedule request.
+    Game game{};
+    //! How long a successful game took.
+    float seconds = 0;
+    //! The client's bots for a schedule request.
+    const IdBitset *bots = nullptr;
+    //! The client's maps for a schedule request.
+    const IdBitset *maps = nullptr;
+    //! The client's home shard for a schedule request.
+    uint32_t home = 0;
+    //! The strand to answer a schedule request on.
+    boost::asio::io_service::strand *strand = nullptr;
+    //! The handler to answer a schedule request with, or to call once a drain is reached.
+    ScheduleHandler handler;
+  };
+
+  //! A node in the request queue.
+  struct Node {
+    //! The next node in the queue, written by whoever pushes after this one.
+    std::atomic<Node *> next{nullptr};
+    //! The request.
+    Request request;
+  };
+
+  //! Push a request onto the queue and wake the scheduler thread if it's asleep.
+  void push(Request request);
+
+  //! Pop the oldest request, false if the queue is empty. Scheduler thread only.
+  bool pop(Request &request);
+
+  //! Pop requests into a batch until it's full or the queue is empty, true if any were popped.
+  bool fill(std::vector<Request> &batch);
+
+  //! The scheduler thread's loop.
+  void run();
+
+  //! Handle a batch of requests.
+  void handleBatch(std::vector<Request> &batch);
+
+  //! The generator everything is scheduled with.
+  ShardedGameGenerator &gen;
+
+  //! The most requests handled in one batch.
+  size_t maxBatch;
+
+  //! How long to gather waiting clients for.
+  std::chrono::milliseconds window;
+
+  //! The clients in the current batch, kept to reuse its storage.
+  std::vector<GameGenerator::GameRequest> waiting;
+
+  // The queue is Vyukov's MPSC queue. Producers swap their node in at the head with a single
+  // exchange, the consumer follows next pointers from the tail. The tail is always a node whose
+  // request has already been taken (or the initial stub), so the queue is never truly empty.
+  //! The most recently pushed node, producers only.
+  std::atomic<Node *> head;
+  //! The node whose request was taken last, consumer only.
+  Node *tail;
+
+  //! Is the scheduler thread waiting for work?
+  std::atomic<bool> sleeping{false};
+  //! Is the scheduler shutting down?
+  std::atomic<bool> stopping{false};
+  //! Lock for sleeping and waking the scheduler thread.
+  std::mutex sleepMutex;
+  //! Wakes the scheduler thread.
+  std::condition_variable wake;
+
+  //! The scheduler thread, started last.
+  std::thread thread;
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_SCHEDULER_H
@@ -3,28 +3,78 @@
 
 #include "common/config.h"
 #include "common/file_operations.h"
+#include "common/HashRegistry.h"
 #include "server/Connection.h"
-#include "server/GameGenerator.h"
+#include "server/LeaseManager.h"
+#include "server/Replication.h"
+#include "server/Scheduler.h"
+#include "server/SessionTable.h"
+#include "server/ShardedGameGenerator.h"
+#include "server/StateLog.h"
 
 #include <boost/asio.hpp>
 
+#include <atomic>
+#include <memory>
 #include <mutex>
 #include <map>
+#include <string>
 
 using namespace boost;
 using boost::asio::ip::tcp;
 
 namespace sc2tm {
 
+//! Settings for running a server.
+struct ServerConfig {
+  //! The number of shards to split scheduling over, 0 means one per core.
+  unsigned schedShards = 1;
+  //! The most requests the scheduler thread handles at once, 0 schedules on the io threads.
+  unsigned schedBatch = 0;
+  //! Milliseconds the scheduler thread gathers waiting clients for, 0 serves them as they arrive.
+  unsigned schedWindow = 0;
+  //! Hand out the games expected to take longest first.
+  bool longestFirst = false;
+  //! The most copies of a game handed out at once near the end, 1 for no backup copies.
+  unsigned tailCopies = 1;
+  //! Seconds a client has to report on or heartbeat a game before it's given away, 0 for forever.
+  unsigned leaseSeconds = 0;
+  //! Seconds a dropped client's session and game are kept for it to reconnect, 0 for no sessions.
+  unsigned sessionSeconds = 0;
+  //! Directory the tournament's progress is logged to and recovered from, empty to not keep it.
+  std::string stateDir;
+  //! Milliseconds of results gathered into each sync of the log.
+  unsigned stateCommitMs = 10;
+  //! Logged events between snapshots.
+  unsigned snapshotEvery = 100000;
+  //! Port standbys follow a primary on, 0 to not replicate.
+  unsigned replicaPort = 0;
+  //! Host of the primary to stand by for, empty to serve straight away.
+  std::string standbyOf;
+  //! Unix socket a new server process connects to to take over from us, empty for none.
+  std::string upgradeSocket;
+  //! Unix socket of an old server process to take over from, empty to start fresh.
+  std::string upgradeFrom;
+};
+
 //! Represents a server that clients connect to.
 /**
  * Represents a server that clients connect to. Handles organizing games, distributing them to
  * clients to play, and aggregating the results.
  */
 class Server {
-  //! The TCP acceptor.
+  //! The io service connections run on.
+  asio::io_service &service;
+
+  //! The TCP acceptor, only opened once we start serving.
   tcp::acceptor acceptor;
 
+  //! How the server was asked to run.
+  ServerConfig config;
+
+  //! Digest of the bot and map registries, saved state and replicas must match it.
+  SHA256Hash catalog;
+
   //! The map for maps that are involved in this run.
   /**
    * The map for maps that are involved in this run. This should only be built once, at server
@@ -39,6 +89,12 @@ class Server {
    */
   SHAFileMap botMap;
 
+  //! Interned ids for the maps in mapMap.
+  HashRegistry mapRegistry;
+
+  //! Interned ids for the bots in botMap.
+  HashRegistry botRegistry;
+
   //! The id that will be give to the next incoming connection.
   /**
    * The id that will be give to the next incoming connection. Careful care needs to be taken to
@@ -60,18 +116,71 @@ class Server {
   std::mutex connMutex;
 
   //! The game generator.
-  GameGenerator gen;
+  /**
+   * The game generator. Created once the bots and maps have been hashed and shared by every
+   * connection, it does its own locking. A connection's id picks its home shard.
+   */
+  std::unique_ptr<ShardedGameGenerator> gen;
+
+  //! The log of the generator's progress, nullptr if it isn't kept.
+  std::unique_ptr<StateLog> stateLog;
+
+  //! Streams progress to standbys, nullptr if we aren't replicating.
+  std::unique_ptr<ReplicationSource> replicas;
+
+  //! The scheduler thread.
+  /**
+   * The scheduler thread. If there is one every request for the generator goes through it rather
+   * than to the generator directly, nullptr if games are scheduled on the io threads.
+   */
+  std::unique_ptr<Scheduler> scheduler;
+
+  //! Leases on the games clients are playing, nullptr if clients have forever.
+  std::unique_ptr<LeaseManager> leases;
+
+  //! Sessions clients can reconnect to, nullptr if clients always handshake.
+  std::unique_ptr<SessionTable> sessions;
+
+  //! Follows the primary while we're a standby, nullptr otherwise.
+  std::unique_ptr<ReplicationSink> standby;
+
+  //! Listens for a new server process to hand over to.
+  asio::local::stream_protocol::acceptor upgradeAcceptor;
+
+  //! The new server process we're handing over to.
+  asio::local::stream_protocol::socket successor;
+
+  //! Is the server being handed over to a new process?
+  /**
+   * Is the server being handed over to a new process? Once set no new clients are accepted and
+   * every connection parks itself as soon as its client is playing a game.
+   */
+  std::atomic<bool> handingOff{false};
+
+  //! Has the handoff been sent?
+  std::atomic<bool> handedOff{false};
+
+  //! The number of parked connections. Use connMutex.
+  size_t parkedCount = 0;
+
+  //! Gives up on connections that don't park in time.
+  asio::steady_timer handoffDeadline;
 
 public:
   //! Construct a server.
   /**
-   * Construct a server that handles sending clients SC2 games to play in a tournament.
+   * Construct a server that handles sending clients SC2 games to play in a tournament. The io
+   * service may be run on any number of threads.
    *
    * @param service The io service this server runs on.
    * @param botDir The directory where the bots are located.
    * @param mapDir The directory where the maps are located.
+   * @param hashConfig How to hash the bot and map directories.
+   * @param config How to run the server.
+   * @throws std::runtime_error If the saved state is for a different set of bots or maps.
    */
-  Server(asio::io_service &service, const std::string &botDir, const std::string &mapDir);
+  Server(asio::io_service &service, const std::string &botDir, const std::string &mapDir,
+         const HashConfig &hashConfig, const ServerConfig &config = ServerConfig());
 
   //! Declare Connection as a friend class.
   /**
@@ -80,14 +189,45 @@ public:
   friend Connection;
 
 private:
+  //! Open the state log and recover the progress it holds into the generator.
+  void openStateLog();
+
+  //! Start serving clients, recovering saved state and replicating if configured.
+  void takeOver();
+
   //! Start accepting new connections asynchronously.
   void startAccept();
 
   //! Handle accepting a new connection.
-  void handleAccept(Connection &newCon, const boost::system::error_code& error);
+  void handleAccept(Connection &newCon, Connection::ConnId id,
+                    const boost::system::error_code& error);
 
   //! Request that a connection be destroyed.
   void requestDestroyConnection(Connection::ConnId id);
+
+  //! Carry on from an old server process, adopting its clients and progress.
+  void resumeFrom(const std::string &path);
+
+  //! Start listening for a new server process to hand over to.
+  void startUpgradeAccept();
+
+  //! A new process connected, start parking every connection.
+  void beginHandoff();
+
+  //! A connection has parked itself.
+  void connectionParked();
+
+  //! Hand off if every connection has parked. Use connMutex.
+  void checkParked();
+
+  //! Send everything to the new process and stop.
+  void finishHandoff();
+
+  //! Add the sessions that can go to the new process to a handoff, the connections already in it.
+  void handOffSessions(HandoffState &state);
+
+  //! Take over the sessions from an old server process, before its connections.
+  void takeOverSessions(const HandoffState &state);
 };
 
 } // End namespace sc2tm
@@ -3,6 +3,7 @@
 
 #include "common/CLOpts.h"
 #include "common/config.h"
+#include "server/Server.h"
 
 namespace sc2tm {
 
@@ -10,8 +11,46 @@ class ServerOpts : public CLOpts {
 public:
   ServerOpts() : CLOpts() {
     usageHeader = "Starcraft 2 Tournament Manager Server v" + sc2tm::serverVersionStr;
+    registerOption("io-threads", "Threads running the network service, 0 for one per core", false);
+    registerOption("sched-shards", "Shards to split game scheduling over, 0 for one per core",
+                   false);
+    registerOption("sched-batch",
+                   "Requests a scheduler thread handles at once, 0 to schedule on the io threads",
+                   false);
+    registerOption("sched-window",
+                   "Milliseconds the scheduler thread gathers clients to assign games together",
+                   false);
+    registerFlag("sched-lpt", "Hand out the games expected to take longest first");
+    registerOption("tail-copies",
+                   "Most copies of a game given to idle clients near the end, 1 for no copies",
+                   false);
+    registerOption("lease-seconds",
+                   "Seconds a client has to report on a game before it's given away, 0 for forever",
+                   false);
+    registerOption("session-seconds",
+                   "Seconds a dropped client has to reconnect and resume its game, 0 for never",
+                   false);
+    registerOption("state-dir", "Directory to keep the tournament's progress in across restarts",
+                   false);
+    registerOption("state-commit-ms", "Milliseconds of results gathered into each log sync",
+                   false);
+    registerOption("state-snapshot-every", "Logged events between snapshots of the progress",
+                   false);
+    registerOption("replica-port",
+                   "Port standbys follow the primary on, 0 to not replicate",
+                   false);
+    registerOption("standby-of",
+                   "Host of a primary to follow on the replica port, serving once it goes away",
+                   false);
+    registerOption("upgrade-socket",
+                   "Unix socket a new server build connects to to take over without dropping clients",
+                   false);
+    registerOption("upgrade-from", "Unix socket of a running server to take over from", false);
   }
 
+  //! Get the server settings from the options.
+  ServerConfig getServerConfig();
+
 private:
 };
 
@@ -0,0 +1,165 @@
+#ifndef SC2TM_SESSIONTABLE_H
+#define SC2TM_SESSIONTABLE_H
+
+#include "common/Game.h"
+#include "common/IdBitset.h"
+#include "common/packets.h"
+#include "common/sha256.h"
+#include "server/LeaseManager.h"
+
+#include <boost/asio.hpp>
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <mutex>
+
+namespace sc2tm {
+
+//! A game handed to a client that it hasn't reported on.
+struct Assignment {
+  //! The game.
+  Game game;
+  //! When the client started playing it, the default until the client gets to it.
+  /**
+   * When the client started playing it, the default until the client gets to it. A client plays
+   * its games in ticket order, so a game starts when the one ahead of it is reported rather than
+   * when it's sent. Only the time spent playing goes into the duration estimates.
+   */
+  std::chrono::steady_clock::time_point start;
+  //! The lease on it, only meaningful to the connection holding it.
+  LeaseManager::LeaseId lease = LeaseManager::invalidLease;
+};
+
+//! A client's games, by the ticket each was handed out with.
+typedef std::map<GameTicket, Assignment> Assignments;
+
+//! Remembers clients between connections, so a reconnecting client can skip the handshake.
+/**
+ * Remembers clients between connections, so a reconnecting client can skip the handshake. A
+ * client is given a session once its handshake is read. If its connection drops the session holds
+ * on to the client's bots, maps and any games it was handed, and a client that reconnects with the
+ * session's token and handshake digest picks them all back up without resending a single hash.
+ *
+ * A client often reconnects before the server has noticed its old connection is gone. Resuming
+ * a session that's still attached supersedes the old connection, which is asked to hang up, and
+ * the resume finishes once it has, with whatever games it was holding.
+ *
+ * A dropped session only lasts so long. Expiry is driven by a LeaseManager, and a session that
+ * expires while holding games hands each to the expiry callback so it can be given back to the
+ * generator. Every function is safe to call from any thread, callbacks are run without the table
+ * locked.
+ */
+class SessionTable {
+public:
+  //! Identifies the connection a session is attached to.
+  typedef uint32_t ConnId;
+
+  //! What a session remembers about its client.
+  struct Session {
+    //! The connection the session's attached to, if it is.
+    ConnId owner;
+    //! Digest of the client's handshake, a resuming client must present it.
+    SHA256Hash catalog;
+    //! The client's bots.
+    IdBitset bots;
+    //! The client's maps.
+    IdBitset maps;
+    //! How many games the client wants queued up at once.
+    uint8_t queueDepth = 1;
+    //! The games the client hadn't reported on when it dropped.
+    Assignments games;
+    //! The ticket the client's next game gets, so tickets are never reused.
+    GameTicket nextTicket = 0;
+    //! Is a connection using the session?
+    bool attached = true;
+    //! Counts drops so an expiry can tell if it's for the current one.
+    uint32_t serial = 0;
+    //! Finishes a resume waiting for the old connection to let go.
+    std::function<void(bool, const Session &)> waiter;
+  };
+
+  //! Called when a resume finishes, with whether it worked and the session if it did.
+  typedef std::function<void(bool, const Session &)> ResumeHandler;
+
+  //! Construct a session table.
+  /**
+   * Construct a session table.
+   *
+   * @param service The io service expiry runs on.
+   * @param grace How long a dropped session is kept for its client to come back.
+   * @param onExpire Called with every game of a session that expires while holding some.
+   * @param onSupersede Called with a connection that should hang up, its client has reconnected.
+   */
+  SessionTable(boost::asio::io_service &service, std::chrono::seconds grace,
+               std::function<void(const Game &)> onExpire,
+               std::function<void(ConnId)> onSupersede);
+
+  //! Open a session for a client that's just handshaken, attached to its connection.
+  SessionToken open(ConnId owner, const SHA256Hash &catalog, const IdBitset &bots,
+                    const IdBitset &maps, uint8_t queueDepth);
+
+  //! Attach a new connection to a session.
+  /**
+   * Attach a new connection to a session. The games it was holding are handed to the connection
+   * along with everything else. If the session's still attached the old connection is
+   * superseded and onResumed waits for it to let go.
+   *
+   * @param token The session's token.
+   * @param catalog The digest the client presented.
+   * @param owner The new connection.
+   * @param onResumed Called once the resume finishes, maybe before this returns. It fails if
+   *        there's no such session, the digest doesn't match, another resume is already waiting
+   *        on it or the old connection closes the session rather than letting go.
+   */
+  void resume(const SessionToken &token, const uint8_t *catalog, ConnId owner,
+              ResumeHandler onResumed);
+
+  //! The session's connection dropped, keep it for a while in case the client comes back.
+  /**
+   * The session's connection dropped, keep it for a while in case the client comes back.
+   *
+   * @param token The session's token.
+   * @param games The games the client hadn't reported on.
+   * @param nextTicket The ticket the client's next game would have got.
+   */
+  void detach(const SessionToken &token, const Assignments &games, GameTicket nextTicket);
+
+  //! The client's done, forget its session. A resume waiting on it fails.
+  void close(const SessionToken &token);
+
+  //! Copy out every session, for handing to a new server process.
+  void snapshot(std::map<SessionToken, Session> &out);
+
+  //! Take over a session from an old server process.
+  /**
+   * Take over a session from an old server process. A detached session's grace period starts
+   * over, since its client may have been waiting out the handoff to reconnect.
+   *
+   * @param token The session's token.
+   * @param session The session, with its games if it's detached.
+   */
+  void restore(const SessionToken &token, const Session &session);
+
+private:
+  //! The expiry for a drop ran out.
+  void expire(const SessionToken &token, uint32_t serial);
+
+  //! Runs the expiry of dropped sessions.
+  LeaseManager expiry;
+
+  //! Called with every game of a session that expires holding some.
+  std::function<void(const Game &)> onExpire;
+
+  //! Called with a connection whose client has reconnected.
+  std::function<void(ConnId)> onSupersede;
+
+  //! Guards everything below.
+  std::mutex mutex;
+  //! Every session.
+  std::map<SessionToken, Session> sessions;
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_SESSIONTABLE_H
@@ -0,0 +1,154 @@
+#ifndef SC2TM_SHARDEDGAMEGENERATOR_H
+#define SC2TM_SHARDEDGAMEGENERATOR_H
+
+#include "common/Game.h"
+#include "common/HashRegistry.h"
+#include "common/IdBitset.h"
+#include "server/DurationModel.h"
+#include "server/GameGenerator.h"
+#include "server/Replication.h"
+#include "server/StateLog.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace sc2tm {
+
+//! Splits scheduling over several independently locked game generators.
+/**
+ * Splits scheduling over several independently locked game generators. Matchups are partitioned
+ * by hash so each belongs to exactly one shard, which keeps the number of games played for every
+ * (matchup, map) the same as with a single generator.
+ *
+ * Connections are spread over the shards and ask their home shard first, so connections on
+ * different threads usually don't contend for a lock. When the home shard has nothing that fits a
+ * client's bots and maps the other shards are tried in turn, stealing their work rather than
+ * turning the client away.
+ *
+ * Backup copies of outstanding games are only handed out once every shard has been asked for new
+ * work, and only once there's less new work left over all the shards than clients waiting on it.
+ * Game ids come from one counter shared by every shard so they're unique across the server.
+ */
+class ShardedGameGenerator {
+  //! Estimates of how long games take, shared by every shard.
+  DurationModel durations;
+
+  //! The shards, each owning the matchups MatchupMatrix::shardOf assigns to it.
+  std::vector<std::unique_ptr<GameGenerator>> shards;
+
+  //! The id given to the next game handed out by any shard.
+  std::atomic<GameId> nextGameId{0};
+
+  //! Where schedules and results are logged, nullptr to not log them.
+  StateLog *log = nullptr;
+
+  //! Where results are streamed to standbys, nullptr to not stream them.
+  ReplicationSource *replicas = nullptr;
+
+public:
+  //! Construct a generator for every bot and map in the registries.
+  /**
+   * Construct a generator for every bot and map in the registries.
+   *
+   * @param botRegistry The bots to schedule.
+   * @param mapRegistry The maps to schedule.
+   * @param shardCount The number of shards to split the matchups over.
+   * @param longestFirst Hand out the games expected to take longest first.
+   * @param maxCopies The most copies of a game handed out at once near the end.
+   */
+  ShardedGameGenerator(const HashRegistry &botRegistry, const HashRegistry &mapRegistry,
+                       uint32_t shardCount, bool longestFirst = false, uint16_t maxCopies = 1);
+
+  //! The number of shards.
+  uint32_t shardCount() const { return (uint32_t) shards.size(); }
+
+  //! Generate a game for a client with given bot and map sets.
+  /**
+   * Generate a game for a client with given bot and map sets. The home shard is tried first, then
+   * every other shard in order. If none of them has new work for the client it's given a backup
+   * copy of a game being played, but only if there's no new work left at all.
+   *
+   * @param game The game to fill in.
+   * @param cBots The set of bots the client has available.
+   * @param cMaps The set of maps the client has available.
+   * @param home The client's home shard, any number, it's wrapped to the shard count.
+   * @return True if a game was found, false otherwise.
+   */
+  bool generateGame(Game &game, const IdBitset &cBots, const IdBitset &cMaps, uint32_t home);
+
+  //! Generate games for a batch of clients at once.
+  /**
+   * Generate games for a batch of clients at once, see GameGenerator::generateGames. Each shard
+   * matches the clients the shards before it couldn't serve. Clients still waiting after that are
+   * given backup copies if there's less new work left than there are of them.
+   *
+   * @param requests The clients to find games for.
+   */
+  void generateGames(std::vector<GameGenerator::GameRequest> &requests);
+
+  //! The number of games no shard has handed out yet.
+  uint64_t unissuedCount();
+
+  //! Notify the shard that owns a game's matchup that it completed successfully.
+  /**
+   * Notify the shard that owns a game's matchup that it completed successfully. If the result
+   * counted, learn from how long it took.
+   *
+   * @param game The game that completed successfully.
+   * @param seconds How long the game took, zero if unknown.
+   */
+  void notifySuccess(const Game &game, float seconds = 0) {
+    // A copy that lost the race, or a result that was ignored, says nothing about the game
+    uint16_t played = shardFor(game).notifySuccess(game);
+    if (played == 0)
+      return;
+    durations.record(game, seconds);
+    if (log)
+      log->append(StateLog::SUCCESS, game, played);
+    if (replicas)
+      replicas->publish(game, played);
+  }
+
+  //! Notify the shard that owns a game's matchup that it did not complete successfully.
+  void notifyFail(const Game &game) {
+    if (shardFor(game).notifyFail(game) && log)
+      log->append(StateLog::FAIL, game);
+  }
+
+  //! Log every schedule and result from now on, nullptr to stop.
+  void setLog(StateLog *log) { this->log = log; }
+
+  //! Stream every result to standbys from now on, nullptr to stop.
+  void setReplicas(ReplicationSource *replicas) { this->replicas = replicas; }
+
+  //! Record the progress of every shard, see GameGenerator::snapshot.
+  void snapshot(std::vector<GameGenerator::Progress> &progress) {
+    for (std::unique_ptr<GameGenerator> &shard : shards)
+      shard->snapshot(progress);
+  }
+
+  //! Restore progress to the shard that owns its matchup, see GameGenerator::restore.
+  void restore(const GameGenerator::Progress &progress) {
+    if (progress.bot0 == progress.bot1)
+      return;
+    shards[MatchupMatrix::shardOf(progress.bot0, progress.bot1, shardCount())]->restore(progress);
+  }
+
+  //! Take a game that's already being played out of the pool, see GameGenerator::adopt.
+  void adopt(const Game &game) {
+    if (game.bot0 != game.bot1)
+      shardFor(game).adopt(game);
+  }
+
+private:
+  //! The shard that owns a game's matchup.
+  GameGenerator &shardFor(const Game &game) {
+    return *shards[MatchupMatrix::shardOf(game.bot0, game.bot1, shardCount())];
+  }
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_SHARDEDGAMEGENERATOR_H
@@ -0,0 +1,170 @@
+#ifndef SC2TM_STATELOG_H
+#define SC2TM_STATELOG_H
+
+#include "common/Game.h"
+#include "common/sha256.h"
+#include "server/GameGenerator.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace sc2tm {
+
+class ShardedGameGenerator;
+
+//! Write-ahead log and snapshots of the tournament's progress.
+/**
+ * Write-ahead log and snapshots of the tournament's progress, so a restarted server picks up where
+ * the last one left off instead of replaying every game.
+ *
+ * Every schedule, success and failure is appended to an in-memory buffer without blocking. A
+ * flusher thread writes the buffer out and syncs it once per commit interval, so one sync covers
+ * every event in the interval no matter how many connections produced them. A crash loses at most
+ * the last interval of results, and those games are just played again.
+ *
+ * Every so many events the flusher takes a snapshot: it starts a new log segment, records the
+ * generator's progress, writes it beside the old snapshot and renames it into place, then deletes
+ * the segments the snapshot covers. Recovery loads the snapshot and replays the segments after it,
+ * stopping at the first torn or corrupt record.
+ *
+ * Success events carry how many games of their (matchup, map) had been played rather than a
+ * delta, and restoring takes the maximum, so replaying an event the snapshot already holds changes
+ * nothing. That's what lets the snapshot be taken while games keep completing. Games being played
+ * when the server stopped are void after a restart, so schedule and failure events are only kept
+ * for the record.
+ *
+ * Everything is tied to a catalog digest of the bot and map registries, since the log is in terms
+ * of their ids. Files are in host byte order, like the hash cache.
+ */
+class StateLog {
+public:
+  //! The kinds of event.
+  enum EventType : uint8_t {
+    SCHEDULE = 1,
+    SUCCESS,
+    FAIL
+  };
+
+  //! Open a log directory, creating it if needed.
+  /**
+   * Open a log directory, creating it if needed. Nothing is read or written until recover and
+   * start are called.
+   *
+   * @param dir The directory the log and snapshot live in.
+   * @param catalog The catalog digest the log must match.
+   * @param commitInterval How long events are gathered before being synced to disk.
+   * @param snapshotEvery The number of events between snapshots.
+   */
+  StateLog(const std::string &dir, const SHA256Hash &catalog,
+           std::chrono::milliseconds commitInterval, uint64_t snapshotEvery);
+
+  //! Flush anything buffered and stop the flusher thread.
+  ~StateLog();
+
+  //! No copying, we own a thread and a file.
+  StateLog(const StateLog &) = delete;
+  StateLog &operator=(const StateLog &) = delete;
+
+  //! Restore a generator from the snapshot and the log after it.
+  /**
+   * Restore a generator from the snapshot and the log after it. The generator should be fresh,
+   * with nothing handed out yet.
+   *
+   * @param gen The generator to restore.
+   * @return The number of log events replayed.
+   * @throws std::runtime_error If the log belongs to a different set of bots and maps.
+   */
+  uint64_t recover(ShardedGameGenerator &gen);
+
+  //! Start logging a generator's events.
+  /**
+   * Start logging a generator's events. A snapshot is taken straight away, compacting whatever
+   * was recovered, then the flusher thread is started.
+   *
+   * @param gen The generator to snapshot, it must outlive the log.
+   */
+  void start(ShardedGameGenerator &gen);
+
+  //! Flush anything buffered and stop writing, events appended afterwards are dropped.
+  void stop();
+
+  //! Append an event to the log, it's synced to disk within a commit interval.
+  void append(EventType type, const Game &game, uint16_t played = 0);
+
+private:
+  //! An event as it's laid out on disk.
+  struct Record {
+    //! What happened.
+    uint8_t type;
+    uint8_t pad;
+    //! For a success, how many games of the (matchup, map) have now been played.
+    uint16_t played;
+    //! The game.
+    BotId bot0;
+    BotId bot1;
+    MapId map;
+    //! Checksum of everything above, so a torn write isn't replayed.
+    uint32_t check;
+  };
+
+  //! The flusher thread's loop.
+  void run();
+
+  //! Write a buffer to the current segment and sync it.
+  bool writeOut(const std::vector<Record> &records);
+
+  //! Start a new segment whose first event is lsn, closing the current one.
+  bool openSegment(uint64_t lsn);
+
+  //! Take a snapshot, flushing everything before it first. Flusher thread only, or before start.
+  void snapshot();
+
+  //! Path of the segment starting at lsn.
+  std::string segmentPath(uint64_t lsn) const;
+
+  //! The start of every segment on disk, in order.
+  std::vector<uint64_t> listSegments() const;
+
+  //! The directory everything lives in.
+  std::string dir;
+
+  //! The catalog digest.
+  uint8_t catalog[SHA256::DIGEST_SIZE];
+
+  //! How long events are gathered before being synced.
+  std::chrono::milliseconds commitInterval;
+
+  //! The number of events between snapshots.
+  uint64_t snapshotEvery;
+
+  //! The generator being logged.
+  ShardedGameGenerator *gen = nullptr;
+
+  //! The current segment, -1 if none is open.
+  int fd = -1;
+
+  //! Guards everything below.
+  std::mutex mutex;
+  //! Events appended since the last flush.
+  std::vector<Record> pending;
+  //! The sequence number the next appended event gets.
+  uint64_t nextLsn = 0;
+  //! The sequence number of the last snapshot.
+  uint64_t snapshotLsn = 0;
+  //! Is the log shutting down?
+  bool stopping = false;
+  //! Wakes the flusher early for shutdown.
+  std::condition_variable wake;
+
+  //! The flusher thread.
+  std::thread thread;
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_STATELOG_H
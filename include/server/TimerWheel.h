@@ -0,0 +1,114 @@
+#ifndef SC2TM_TIMERWHEEL_H
+#define SC2TM_TIMERWHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace sc2tm {
+
+//! Hierarchical timing wheel.
+/**
+ * Hierarchical timing wheel. Time is counted in ticks and timers live in a slot on one of several
+ * wheels: the first wheel has a slot per tick for the next 64 ticks, the second a slot per 64
+ * ticks for the next 64 * 64, and so on. Each tick only looks at one slot of the first wheel, and
+ * every 64 ticks the next slot of the wheel above is spread down over the wheel below. Adding and
+ * cancelling timers is O(1) and a timer is moved at most once per wheel, so tens of thousands of
+ * timers cost O(1) each per tick no matter how far out they are.
+ *
+ * Timers are stored in a pool and linked into their slot through indices, so nothing is allocated
+ * once the pool has grown to the number of live timers.
+ *
+ * The wheel isn't thread safe.
+ */
+class TimerWheel {
+public:
+  //! Called when a timer expires.
+  typedef std::function<void()> Callback;
+
+  //! Identifies a timer, stays unique after the timer has expired or been cancelled.
+  typedef uint64_t TimerId;
+
+  //! An id that no timer has.
+  static const TimerId invalidTimer = UINT64_MAX;
+
+  //! Construct an empty wheel at tick 0.
+  TimerWheel();
+
+  //! The current tick.
+  uint64_t now() const { return current; }
+
+  //! The number of live timers.
+  size_t size() const { return live; }
+
+  //! Add a timer that expires a number of ticks from now, at least one.
+  TimerId add(uint64_t ticks, Callback callback);
+
+  //! Cancel a timer, returns false if it already expired or was cancelled.
+  bool cancel(TimerId id);
+
+  //! Move a timer to expire a number of ticks from now, returns false if it's not live.
+  bool reset(TimerId id, uint64_t ticks);
+
+  //! Advance to a tick, adding the callbacks of every timer that expires on the way to expired.
+  /**
+   * Advance to a tick, adding the callbacks of every timer that expires on the way to expired.
+   * The callbacks aren't called so the caller can run them once it's safe to touch the wheel
+   * again.
+   *
+   * @param tick The tick to advance to, ignored if it's in the past.
+   * @param expired The list to add the expired timers' callbacks to.
+   */
+  void advance(uint64_t tick, std::vector<Callback> &expired);
+
+private:
+  //! Bits of a tick each wheel covers.
+  static const uint32_t slotBits = 6;
+  //! Slots in each wheel.
+  static const uint32_t slotCount = 1u << slotBits;
+  //! Number of wheels, enough for 2^24 ticks ahead. Timers further out are clamped.
+  static const uint32_t wheelCount = 4;
+  //! Marks the end of a list.
+  static const uint32_t none = UINT32_MAX;
+
+  //! A timer in the pool.
+  struct Entry {
+    //! The tick the timer expires on.
+    uint64_t expiry;
+    //! What to call on expiry.
+    Callback callback;
+    //! Bumped every time the entry is freed so stale ids can be told apart.
+    uint32_t generation;
+    //! The slot list the entry is in, none if it's free.
+    uint32_t slot;
+    //! The previous entry in the list.
+    uint32_t prev;
+    //! The next entry in the list.
+    uint32_t next;
+  };
+
+  //! The index of a live timer's entry, none if the id is stale.
+  uint32_t find(TimerId id) const;
+  //! Put an entry in the slot for its expiry.
+  void place(uint32_t index);
+  //! Take an entry out of its slot.
+  void unlink(uint32_t index);
+  //! Free an entry.
+  void release(uint32_t index);
+
+  //! The pool of entries.
+  std::vector<Entry> entries;
+  //! Free entries, linked through next.
+  uint32_t freeList = none;
+  //! The first entry in each slot of each wheel, wheel major.
+  std::vector<uint32_t> heads;
+  //! The current tick.
+  uint64_t current = 0;
+  //! The number of live timers.
+  size_t live = 0;
+};
+
+} // End sc2tm namespace
+
+#endif //SC2TM_TIMERWHEEL_H
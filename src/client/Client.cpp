@@ -5,11 +5,19 @@
 #include <iostream>
 
 sc2tm::Client::Client(asio::io_service &service, std::string host, std::string port,
-                      std::string botDir, std::string mapDir) :
-    _socket(service) {
+                      std::string botDir, std::string mapDir, const HashConfig &hashConfig,
+                      uint8_t queueDepth) :
+    _socket(service), queueDepth(queueDepth) {
   // Generate our bot and map hashes.
-  hashBotDirectory(botDir, botMap);
-  hashMapDirectory(mapDir, mapMap);
+  hashBotDirectory(botDir, botMap, hashConfig);
+  hashMapDirectory(mapDir, mapMap, hashConfig);
+
+  // Save what we hashed for the next run
+  saveHashCache(hashConfig);
+
+  // Intern the hashes so games can be tracked by id
+  botRegistry = HashRegistry(botMap);
+  mapRegistry = HashRegistry(mapMap);
 
   // TODO DEBUG
   for (const auto &info : botMap)
@@ -32,84 +40,108 @@ sc2tm::Client::Client(asio::io_service &service, std::string host, std::string p
 
 void sc2tm::Client::sendHandshake() {
   // Make a handshake packet from our data
-  sc2tm::ClientHandshakePacket handshake(botMap, mapMap);
-  size_t size = handshake.size(); // Get data for check later
+  sc2tm::ClientHandshakePacket handshake(botMap, mapMap, queueDepth);
+  catalog = handshake.digest();
 
   // Put the handshake into our buffer.
-  handshake.toBuffer(buffer);
-  std::cout << "GOT BUFFER SIZE: " << buffer.size() << "\n"; // TODO DEBUG
-
+  handshake.toBuffer(outbox);
+  size_t size = outbox.size(); // Get data for check later
+  std::cout << "GOT BUFFER SIZE: " << size << "\n"; // TODO DEBUG
 
-  // Build the function that will respond to the write being done by starting a wait for a read.
-  auto waitPregameCmdFn =
+  // Build the function that will respond to the write being done.
+  auto writtenFn =
       [&, size] (const boost::system::error_code& error, std::size_t byteCount) {
-        assert(error == boost::system::errc::success); // TODO handle error
-        assert(byteCount == size + sizeof(uint32_t)); // Add sizeof size
-
-        // Build the function that will respond to the buffer being filled with the server's
-        // response, which will be some PregameCommand.
-        auto readPregameCommandFn =
-            [&] (const boost::system::error_code& error2, std::size_t byteCount2) {
-              assert(error2 == boost::system::errc::success); // TODO handle error
-              assert(byteCount2 == PregameCommandPacket::size());
-              readPregameCommand();
-            };
-
-        // Async wait for the buffer to be filled with a PregameCommand. Respond by calling the
-        // function that reads PregameCommands.
-        boost::asio::async_read(_socket, buffer,
-                                boost::asio::transfer_exactly(PregameCommandPacket::size()),
-                                readPregameCommandFn);
+        // If we've hung up already there's nothing more to do
+        if (error) {
+          if (error != boost::asio::error::operation_aborted)
+            dropServer("LOST SERVER: " + error.message());
+          return;
+        }
+        assert(byteCount == size);
       };
+  boost::asio::async_write(_socket, outbox, writtenFn);
 
-  // Async wait for the client handshake data to be written. Respond by waiting for a response from
-  // the server, namely a PregameCommand.
-  boost::asio::async_write(_socket, buffer, waitPregameCmdFn);
+  // Whatever the server sends back can be read while the handshake is still going out
+  readFrames();
 }
 
-void sc2tm::Client::readPregameCommand() {
-  PregameCommandPacket p(buffer);
-  std::cout << "GOT PREGAME COMMAND: " << p.cmd << '\n'; // TODO debug
-
-  switch (p.cmd) {
-  case DISCONNECT: {
-    // Make wait for reason function
-    auto waitForReasonFn =
-        [&] (const boost::system::error_code& error, std::size_t byteCount)  {
-          assert(error == boost::system::errc::success); // TODO handle error
-          assert(byteCount == PregameDisconnectPacket::size());
-
-          // Once we have the data we can handle it
-          readPregameDisconnectReason();
-        };
-    boost::asio::async_read(_socket, buffer,
-                            boost::asio::transfer_exactly(PregameDisconnectPacket::size()),
-                            waitForReasonFn);
-    break;
-  }
-  case START_GAME: {
-    // Make wait for game function
-    auto waitForGameFn =
-        [&] (const boost::system::error_code& error, std::size_t byteCount) {
-          assert(error == boost::system::errc::success); // TODO handle error
-          assert(byteCount == StartGamePacket::size());
-
-          // Once we have the data we can handle it
-          readStartGame();
-        };
-    boost::asio::async_read(_socket, buffer,
-                            boost::asio::transfer_exactly(StartGamePacket::size()),
-                            waitForGameFn);
-    break;
+void sc2tm::Client::readFrames() {
+  // Handle every whole frame we have, a frame may be the last we need
+  FrameHeader header;
+  FrameState state;
+  while ((state = nextFrame(inbox, header)) == FrameState::READY)
+    if (!handleFrame(header))
+      return;
+
+  // A frame that can't be right means we can't make sense of anything after it either
+  if (state == FrameState::INVALID) {
+    dropServer("BAD FRAME FROM SERVER");
+    return;
   }
+
+  // Take whatever's arrived, as much as there is
+  auto readFn =
+      [&] (const boost::system::error_code& error, std::size_t byteCount) {
+        if (error) {
+          if (error != boost::asio::error::operation_aborted)
+            dropServer("LOST SERVER: " + error.message());
+          return;
+        }
+        inbox.commit(byteCount);
+        readFrames();
+      };
+  _socket.async_read_some(inbox.prepare(4096), readFn);
+}
+
+bool sc2tm::Client::handleFrame(const FrameHeader &header) {
+  std::cout << "GOT MESSAGE: " << (int) header.type << '\n'; // TODO debug
+
+  // A message we don't know or of the wrong size means the server's broken, or isn't one of ours
+  switch (header.type) {
+  case DISCONNECT:
+    if (!PregameDisconnectPacket::accepts(header.length))
+      break;
+    readPregameDisconnectReason(header.length);
+    return false;
+  case START_GAME:
+    if (!StartGamePacket::accepts(header.length))
+      break;
+    readStartGame(header.length);
+    // We can't play games yet, so stop once our queue's full
+    return ++gamesReceived < queueDepth;
+  case SESSION:
+    if (!SessionPacket::accepts(header.length))
+      break;
+    // A resumed game carries on where it was, otherwise the server has another message for us
+    return !readSession(header.length);
   default:
-    assert(false); // TODO handle bad command?
+    break;
   }
+
+  dropServer("UNEXPECTED MESSAGE " + std::to_string((int) header.type) + " FROM SERVER");
+  return false;
+}
+
+void sc2tm::Client::dropServer(const std::string &reason) {
+  std::cout << reason << '\n';
+
+  // Closing cancels anything still in flight, after that the io service runs out of work
+  boost::system::error_code ignored;
+  _socket.close(ignored);
 }
 
-void sc2tm::Client::readPregameDisconnectReason() {
+bool sc2tm::Client::readSession(size_t length) {
+  // Keep the session in case we have to reconnect
+  SessionPacket p(inbox, length);
+  session = p.token;
+  hasSession = true;
+  std::cout << "GOT SESSION" << (p.resumed ? ", RESUMED GAME\n" : "\n"); // TODO DEBUG
+  return p.resumed != 0;
+}
+
+void sc2tm::Client::readPregameDisconnectReason(size_t length) {
   // Get our packet
-  PregameDisconnectPacket p(buffer);
+  PregameDisconnectPacket p(inbox, length);
   std::cout << "GOT PREGAME DISCONNECT REASON: " << p.reason << '\n';
 
   // Note that we don't schedule any work here thus the ioservice will have no more work and should
@@ -118,17 +150,19 @@ void sc2tm::Client::readPregameDisconnectReason() {
   // TODO print useful disconnect message.
 }
 
-void sc2tm::Client::readStartGame() {
+void sc2tm::Client::readStartGame(size_t length) {
   // Get our packet
-  StartGamePacket p(buffer);
+  StartGamePacket p(inbox, length);
 
   // Build a game from it
-  game.bot0 = std::make_shared<SHA256Hash>(p.data[0]);
-  game.bot1 = std::make_shared<SHA256Hash>(p.data[1]);
-  game.map = std::make_shared<SHA256Hash>(p.data[2]);
-
-  std::cout << "GOT GAME:\n"
-            << "  " << game.bot0 << '\n'
-            << "  " << game.bot1 << '\n'
-            << "  " << game.map << '\n';
+  // The server only sends games from the hashes we gave it, anything else we can't play
+  if (!p.toGame(botRegistry, mapRegistry, game)) {
+    std::cout << "GOT GAME WE DON'T HAVE\n";
+    return;
+  }
+
+  std::cout << "GOT GAME " << p.ticket << ":\n"
+            << "  " << botRegistry.hash(game.bot0) << '\n'
+            << "  " << botRegistry.hash(game.bot1) << '\n'
+            << "  " << mapRegistry.hash(game.map) << '\n';
 }
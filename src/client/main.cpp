@@ -1,9 +1,10 @@
 #include "client/Client.h"
-#include "common/CLOpts.h"
+#include "client/ClientOpts.h"
 #include "common/config.h"
 
 #include <boost/asio.hpp>
 
+#include <algorithm>
 #include <iostream>
 
 // Shorten the crazy long namespacing to asio tcp
@@ -12,14 +13,15 @@ using boost::asio::ip::tcp;
 
 int main(int argc, char **argv) {
   // Parse out command line options
-  sc2tm::CLOpts opts;
+  sc2tm::ClientOpts opts;
   if (!opts.parseOpts(argc, argv))
     return 0;
 
   try {
     boost::asio::io_service service;
     sc2tm::Client s(service, "localhost", sc2tm::serverPortStr, opts.getOpt("bots"),
-                    opts.getOpt("maps"));
+                    opts.getOpt("maps"), opts.getHashConfig(),
+                    (uint8_t) std::min(opts.getUnsignedOpt("queue-depth", 1), 255u));
     service.run();
   }
   catch (std::exception& e) {
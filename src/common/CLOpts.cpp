@@ -21,6 +21,8 @@ void printOption(std::string name, sc2tm::OptionInfo info) {
 sc2tm::CLOpts::CLOpts() {
   registerOption("maps", "Directory containing maps");
   registerOption("bots", "Directory containing bots");
+  registerOption("hash-threads", "Threads used to hash bots and maps, 0 for one per core", false);
+  registerOption("hash-cache", "File to cache bot and map hashes in between runs", false);
 }
 
 void sc2tm::CLOpts::registerOption(std::string name, std::string description, bool require) {
@@ -30,6 +32,11 @@ void sc2tm::CLOpts::registerOption(std::string name, std::string description, bo
     ++requiredCount;
 }
 
+void sc2tm::CLOpts::registerFlag(std::string name, std::string description) {
+  assert(options.find(name) == options.end()); // Don't overwrite options
+  options[name] = OptionInfo(description, false, true);
+}
+
 bool sc2tm::CLOpts::parseOpts(int argc, char **argv) {
   // Shift off exe name
   --argc;
@@ -68,7 +75,7 @@ bool sc2tm::CLOpts::parseOpts(int argc, char **argv) {
 
     // If it does, we want to split it
     if (eqIt != std::string::npos)
-      args.emplace_back(arg.substr(0, eqIt), arg.substr(eqIt+2, arg.length()));
+      args.emplace_back(arg.substr(0, eqIt), arg.substr(eqIt+1, arg.length()));
       // If it doesn't then the second half is empty
     else
       args.emplace_back(arg, "");
@@ -138,6 +145,31 @@ bool sc2tm::CLOpts::parseOpts(int argc, char **argv) {
   return true;
 }
 
+unsigned sc2tm::CLOpts::getUnsignedOpt(std::string name, unsigned def) {
+  auto it = optionResults.find(name);
+  if (it == optionResults.end())
+    return def;
+
+  // Fall back to the default on anything that isn't a number
+  try {
+    return (unsigned) std::stoul(it->second);
+  }
+  catch (const std::exception &) {
+    std::cout << "Bad value for " << name << ": " << it->second << "\n";
+    return def;
+  }
+}
+
+sc2tm::HashConfig sc2tm::CLOpts::getHashConfig() {
+  HashConfig config;
+  config.threads = getUnsignedOpt("hash-threads", config.threads);
+
+  auto cacheIt = optionResults.find("hash-cache");
+  if (cacheIt != optionResults.end())
+    config.cache = std::make_shared<HashCache>(cacheIt->second);
+  return config;
+}
+
 void sc2tm::CLOpts::usage() {
   std::cout << usageHeader << "\n\n";
 
@@ -0,0 +1,186 @@
+#include "common/HashCache.h"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+//! Identifies a hash cache file, the last byte is the format version.
+const uint8_t cacheMagic[8] = { 'S', 'C', '2', 'T', 'M', 'H', 'C', 1 };
+
+//! The cache file header.
+struct CacheHeader {
+  uint8_t magic[8];
+  //! The number of records following the header.
+  uint32_t recordCount;
+  //! The number of bytes of path strings following the records.
+  uint32_t stringBytes;
+};
+
+//! A fixed size cache record.
+struct CacheRecord {
+  sc2tm::FileKey key;
+  //! Offset of the path in the string table.
+  uint32_t pathOffset;
+  //! Length of the path.
+  uint32_t pathLen;
+  //! The file's hash.
+  uint8_t digest[SHA256::DIGEST_SIZE];
+};
+
+} // End anonymous namespace
+
+bool sc2tm::FileKey::fromFile(const fs::path &path, FileKey &key) {
+#ifdef _WIN32
+  // No inodes to key on, never cache
+  return false;
+#else
+  struct stat st;
+  if (::stat(path.c_str(), &st) != 0)
+    return false;
+
+  key.dev = (uint64_t) st.st_dev;
+  key.ino = (uint64_t) st.st_ino;
+  key.size = (uint64_t) st.st_size;
+#ifdef __APPLE__
+  key.mtimeNs = (int64_t) st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+  key.mtimeNs = (int64_t) st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+  return true;
+#endif
+}
+
+sc2tm::HashCache::HashCache(const std::string &path) : path(path) {
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+
+  struct stat st;
+  if (::fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(CacheHeader)) {
+    ::close(fd);
+    return;
+  }
+
+  void *addr = ::mmap(nullptr, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd); // The mapping keeps the file alive
+  if (addr == MAP_FAILED)
+    return;
+
+  mapped = (const uint8_t *) addr;
+  mappedSize = (size_t) st.st_size;
+
+  // Make sure this is actually a cache and it's not truncated before trusting any offsets
+  CacheHeader header;
+  std::memcpy(&header, mapped, sizeof(header));
+  size_t expected = sizeof(CacheHeader) + (size_t) header.recordCount * sizeof(CacheRecord) +
+                    header.stringBytes;
+  if (std::memcmp(header.magic, cacheMagic, sizeof(cacheMagic)) != 0 || expected != mappedSize) {
+    std::cout << "Ignoring invalid hash cache: " << path << '\n';
+    return;
+  }
+
+  recordCount = header.recordCount;
+#endif
+}
+
+sc2tm::HashCache::~HashCache() {
+#ifndef _WIN32
+  if (mapped)
+    ::munmap((void *) mapped, mappedSize);
+#endif
+}
+
+SHA256Hash::ptr sc2tm::HashCache::lookup(const fs::path &filePath, const FileKey &key) const {
+  if (!mapped) {
+    ++missCount;
+    return nullptr;
+  }
+
+  const std::string pathStr = filePath.string();
+  const uint8_t *records = mapped + sizeof(CacheHeader);
+  const char *strings = (const char *) records + (size_t) recordCount * sizeof(CacheRecord);
+  const size_t stringBytes = mappedSize - (strings - (const char *) mapped);
+
+  // Binary search the records, they're sorted by path
+  uint32_t lo = 0;
+  uint32_t hi = recordCount;
+  while (lo < hi) {
+    uint32_t mid = lo + (hi - lo) / 2;
+    CacheRecord record;
+    std::memcpy(&record, records + (size_t) mid * sizeof(CacheRecord), sizeof(record));
+
+    // A corrupt offset just means a miss
+    if ((size_t) record.pathOffset + record.pathLen > stringBytes)
+      break;
+
+    int cmp = pathStr.compare(0, std::string::npos, strings + record.pathOffset, record.pathLen);
+    if (cmp < 0) {
+      hi = mid;
+    }
+    else if (cmp > 0) {
+      lo = mid + 1;
+    }
+    else {
+      if (!(record.key == key))
+        break;
+      ++hitCount;
+      return std::make_shared<SHA256Hash>(record.digest);
+    }
+  }
+
+  ++missCount;
+  return nullptr;
+}
+
+void sc2tm::HashCache::record(const fs::path &filePath, const FileKey &key,
+                              const SHA256Hash::ptr &hash) {
+  recorded[filePath.string()] = Entry{key, hash};
+}
+
+bool sc2tm::HashCache::save() const {
+  // Lay out the records and string table
+  std::vector<CacheRecord> records;
+  std::string strings;
+  records.reserve(recorded.size());
+  for (const auto &pair : recorded) {
+    CacheRecord record;
+    std::memset(&record, 0, sizeof(record));
+    record.key = pair.second.key;
+    record.pathOffset = (uint32_t) strings.size();
+    record.pathLen = (uint32_t) pair.first.size();
+    std::memcpy(record.digest, pair.second.hash->get(), SHA256::DIGEST_SIZE);
+    records.push_back(record);
+    strings += pair.first;
+  }
+
+  CacheHeader header;
+  std::memcpy(header.magic, cacheMagic, sizeof(cacheMagic));
+  header.recordCount = (uint32_t) records.size();
+  header.stringBytes = (uint32_t) strings.size();
+
+  // Write beside the real file and then swap it in
+  std::string tmpPath = path + ".tmp";
+  {
+    std::ofstream file(tmpPath, std::fstream::out | std::fstream::binary | std::fstream::trunc);
+    file.write((const char *) &header, sizeof(header));
+    file.write((const char *) records.data(), records.size() * sizeof(CacheRecord));
+    file.write(strings.data(), strings.size());
+    if (!file)
+      return false;
+  }
+
+  std::error_code error;
+  fs::rename(tmpPath, path, error);
+  return !error;
+}
@@ -0,0 +1,46 @@
+#include "common/HashRegistry.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+
+// Order hashes by their bytes.
+bool hashLess(const SHA256Hash &hash1, const SHA256Hash &hash2) {
+  return std::memcmp(hash1.get(), hash2.get(), SHA256::DIGEST_SIZE) < 0;
+}
+
+} // End anonymous namespace
+
+sc2tm::HashRegistry::HashRegistry(const SHAFileMap &files) {
+  hashes.reserve(files.size());
+  for (const auto &pair : files)
+    hashes.push_back(*pair.second);
+
+  // Sort and drop duplicates (identical files in two places), this fixes the ids
+  std::sort(hashes.begin(), hashes.end(), hashLess);
+  auto last = std::unique(hashes.begin(), hashes.end(),
+                          [] (const SHA256Hash &hash1, const SHA256Hash &hash2) {
+                            return SHA256Hash::compare(hash1, hash2) == 0;
+                          });
+  hashes.erase(last, hashes.end());
+}
+
+sc2tm::HashId sc2tm::HashRegistry::lookup(const uint8_t * const digest) const {
+  SHA256Hash target(digest);
+  auto it = std::lower_bound(hashes.begin(), hashes.end(), target, hashLess);
+  if (it == hashes.end() || SHA256Hash::compare(*it, target) != 0)
+    return invalidHashId;
+  return (HashId) (it - hashes.begin());
+}
+
+SHA256Hash sc2tm::HashRegistry::digest() const {
+  SHA256 ctx;
+  ctx.init();
+  for (const SHA256Hash &hash : hashes)
+    ctx.update(hash.get(), SHA256::DIGEST_SIZE);
+
+  SHA256Hash result;
+  ctx.final(result.get());
+  return result;
+}
@@ -1,21 +1,26 @@
 #include "common/buffer_operations.h"
-#include "common/sha256.h"
 
-void sc2tm::writeUint32(uint32_t val, std::ostream &os) {
-  val = htonl(val);
-  os.write((const char *) &val, sizeof(val));
+#include <algorithm>
+
+sc2tm::BufferWriter::BufferWriter(boost::asio::streambuf &buffer, size_t size) : buffer(buffer) {
+  // A streambuf's prepared room is always one contiguous block
+  start = boost::asio::buffer_cast<uint8_t *>(buffer.prepare(size));
+  cursor = start;
+  end = start + size;
 }
 
-uint32_t sc2tm::readUint32(std::istream &is) {
-  uint32_t value = 0;
-  is.read((char *) &value, sizeof(value));
-  return ntohl(value);
+sc2tm::BufferWriter::~BufferWriter() {
+  buffer.commit((size_t) (cursor - start));
 }
 
-void sc2tm::writeHashBuffer(const uint8_t * const buffer, std::ostream &os) {
-  os.write((const char *) buffer, SHA256::DIGEST_SIZE);
+sc2tm::BufferReader::BufferReader(boost::asio::streambuf &buffer, size_t limit) :
+    buffer(buffer) {
+  // As is its waiting data
+  start = boost::asio::buffer_cast<const uint8_t *>(buffer.data());
+  cursor = start;
+  end = start + std::min(buffer.size(), limit);
 }
 
-void sc2tm::readHashBuffer(uint8_t *buffer, std::istream &is) {
-  is.read((char *) buffer, SHA256::DIGEST_SIZE);
+sc2tm::BufferReader::~BufferReader() {
+  buffer.consume((size_t) (cursor - start));
 }
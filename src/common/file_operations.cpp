@@ -3,9 +3,13 @@
 
 #include <boost/iterator/filter_iterator.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <fstream>
 #include <iostream>
+#include <thread>
+#include <vector>
 
 namespace {
 
@@ -24,26 +28,179 @@ struct FileExtFilter {
 typedef fs::recursive_directory_iterator rd_it;
 typedef boost::filter_iterator<FileExtFilter, rd_it> frd_it;
 
-void hashDirectory(frd_it it, sc2tm::SHAFileMap &map) {
+// Files at or below this size are read whole and hashed in groups through SHA256's multi-buffer
+// path, anything larger is streamed.
+const uintmax_t smallFileSize = 1 << 20;
+
+// Read an entire file of a known size into memory. Returns false if the file couldn't be opened
+// or didn't hold exactly size bytes, it's gone or changed since we listed it.
+bool readFile(const fs::path &filePath, uintmax_t size, std::vector<uint8_t> &contents) {
+  std::ifstream file(filePath.string(), std::fstream::in | std::fstream::binary);
+  if (!file.is_open())
+    return false;
+
+  contents.resize(size);
+  file.read((char *) contents.data(), size);
+  if ((uintmax_t) file.gcount() != size)
+    return false;
+
+  // Anything past the size means the file grew
+  return file.peek() == std::ifstream::traits_type::eof();
+}
+
+// A file we've found and its hash once we know it.
+struct FileInfo {
+  //! The file's path as found in the directory.
+  fs::path path;
+  //! The file's size.
+  uintmax_t size;
+  //! The file's version for the hash cache, only valid if keyed is true.
+  sc2tm::FileKey key;
+  //! Whether we have a key for the file.
+  bool keyed = false;
+  //! The file's hash, filled in from the cache or by a worker.
+  SHA256Hash::ptr hash;
+  //! Whether the hash is of exactly size bytes, only then does it belong under the file's key.
+  bool exact = false;
+};
+
+// A unit of hashing work: either one large file that gets streamed, or up to MULTI_LANES small
+// files that get hashed together.
+struct HashJob {
+  //! Indices of the files in this job.
+  std::vector<size_t> files;
+  //! The total bytes in the job, used to schedule the largest first.
+  uintmax_t bytes = 0;
+  //! Whether the files are small enough to go through the multi-buffer path.
+  bool small = false;
+};
+
+// Hash every file in a job. Jobs never share files, so workers can write the hashes directly.
+void runJob(const HashJob &job, std::vector<FileInfo> &files) {
+  if (!job.small) {
+    assert(job.files.size() == 1);
+    FileInfo &info = files[job.files[0]];
+
+    // Large files go through the mmap path, which hashes whatever size the file is by then
+    info.hash = sha256File(info.path.string());
+    std::error_code error;
+    info.exact = info.hash && fs::file_size(info.path, error) == info.size && !error;
+    return;
+  }
+
+  // Files we can't read are left without a hash and skipped
+  std::vector<std::vector<uint8_t>> contents;
+  std::vector<size_t> read;
+  for (size_t i : job.files) {
+    contents.emplace_back();
+    if (readFile(files[i].path, files[i].size, contents.back()))
+      read.push_back(i);
+    else
+      contents.pop_back();
+  }
+
+  std::vector<SHA256Hash::ptr> hashes = sha256(contents);
+  for (size_t j = 0; j < read.size(); ++j) {
+    files[read[j]].hash = hashes[j];
+    files[read[j]].exact = true;
+  }
+}
+
+void hashDirectory(frd_it it, sc2tm::SHAFileMap &map, const sc2tm::HashConfig &config) {
+  std::vector<FileInfo> files;
   for (auto end = frd_it(); it != end; ++it) {
     assert(fs::is_regular_file(*it)); // Anything coming in here should be a regular file
 
-    // Open our file
-    fs::path filePath = it->path();
-    std::cout << "SEE FILE: " << filePath << "\n"; // TODO DEBUG
-    std::ifstream file(filePath.string(), std::fstream::in | std::fstream::binary);
+    FileInfo info;
+    info.path = it->path();
+    info.size = fs::file_size(info.path);
+    std::cout << "SEE FILE: " << info.path << "\n"; // TODO DEBUG
+
+    // Unchanged files can skip hashing entirely
+    if (config.cache) {
+      info.keyed = sc2tm::FileKey::fromFile(info.path, info.key);
+      if (info.keyed)
+        info.hash = config.cache->lookup(fs::canonical(info.path), info.key);
+    }
+
+    files.push_back(info);
+  }
+
+  // Path order makes the map, cache and job grouping the same no matter how the work is split
+  std::sort(files.begin(), files.end(),
+            [] (const FileInfo &a, const FileInfo &b) { return a.path < b.path; });
+
+  // Large files get a job each, small files are set aside to be grouped
+  std::vector<HashJob> jobs;
+  std::vector<size_t> smallFiles;
+  for (size_t i = 0; i < files.size(); ++i) {
+    if (files[i].hash)
+      continue;
+
+    if (files[i].size <= smallFileSize) {
+      smallFiles.push_back(i);
+      continue;
+    }
+
+    jobs.emplace_back();
+    jobs.back().files.push_back(i);
+    jobs.back().bytes = files[i].size;
+  }
+
+  // Lanes run until their longest message is done, so group files of similar size
+  std::stable_sort(smallFiles.begin(), smallFiles.end(),
+                   [&] (size_t a, size_t b) { return files[a].size < files[b].size; });
+  for (size_t i = 0; i < smallFiles.size(); i += SHA256::MULTI_LANES) {
+    jobs.emplace_back();
+    HashJob &job = jobs.back();
+    job.small = true;
+    for (size_t j = i; j < smallFiles.size() && j < i + SHA256::MULTI_LANES; ++j) {
+      job.files.push_back(smallFiles[j]);
+      job.bytes += files[smallFiles[j]].size;
+    }
+  }
+
+  // Largest jobs first so a huge file picked up last doesn't leave every other worker idle
+  std::stable_sort(jobs.begin(), jobs.end(),
+                   [] (const HashJob &a, const HashJob &b) { return a.bytes > b.bytes; });
+
+  std::atomic<size_t> nextJob(0);
+  auto workerFn =
+      [&] () {
+        for (size_t i = nextJob++; i < jobs.size(); i = nextJob++)
+          runJob(jobs[i], files);
+      };
 
-    // Add its hash to our map
-    map[filePath] = sha256(file);
+  // The calling thread is one of the workers
+  unsigned threads = config.threads == 0 ? std::thread::hardware_concurrency() : config.threads;
+  threads = std::max(1u, std::min<unsigned>(threads, jobs.size()));
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < threads; ++i)
+    workers.emplace_back(workerFn);
+  workerFn();
+  for (auto &worker : workers)
+    worker.join();
 
-    // Close the file
-    file.close();
+  // Add the hashes to our map and remember them for next time
+  for (const auto &info : files) {
+    // The file disappeared or became unreadable after we listed it
+    if (!info.hash) {
+      std::cout << "Failed to hash " << info.path << '\n';
+      continue;
+    }
+
+    // A file that changed size while we hashed it would keep its wrong hash until it's modified
+    // again, so only cache what we know matches the key
+    map[info.path] = info.hash;
+    if (config.cache && info.keyed && info.exact)
+      config.cache->record(fs::canonical(info.path), info.key, info.hash);
   }
 }
 
 } // End anonymous namespace
 
-bool sc2tm::hashMapDirectory(std::string filepath, sc2tm::SHAFileMap &map) {
+bool sc2tm::hashMapDirectory(std::string filepath, sc2tm::SHAFileMap &map,
+                             const HashConfig &config) {
   // Make a path out of the string
   fs::path dir(filepath);
 
@@ -64,12 +221,12 @@ bool sc2tm::hashMapDirectory(std::string filepath, sc2tm::SHAFileMap &map) {
   auto dirIt = rd_it(dir);
   auto it = boost::filter_iterator<FileExtFilter, rd_it>(FileExtFilter(".SC2Map"), dirIt);
 
-  hashDirectory(it, map);
+  hashDirectory(it, map, config);
 
   return true;
 }
 
-bool sc2tm::hashBotDirectory(std::string filepath, SHAFileMap &map) {
+bool sc2tm::hashBotDirectory(std::string filepath, SHAFileMap &map, const HashConfig &config) {
   // Make a path out of the string
 
   // Check if it exists, if so canonicalize it
@@ -99,7 +256,17 @@ bool sc2tm::hashBotDirectory(std::string filepath, SHAFileMap &map) {
   auto dirIt = rd_it(dir);
   auto it = boost::filter_iterator<FileExtFilter, rd_it>(FileExtFilter(extension), dirIt);
 
-  hashDirectory(it, map);
+  hashDirectory(it, map, config);
 
   return true;
 }
+
+void sc2tm::saveHashCache(const HashConfig &config) {
+  if (!config.cache)
+    return;
+
+  std::cout << "HASH CACHE: " << config.cache->hits() << " hits, " << config.cache->misses()
+            << " misses\n";
+  if (!config.cache->save())
+    std::cout << "Failed to save hash cache\n";
+}
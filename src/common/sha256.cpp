@@ -37,10 +37,18 @@
 
 #include "common/sha256.h"
 
+#include <cassert>
 #include <cstring>
 #include <fstream>
 #include <iomanip>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 const unsigned int SHA256::sha256_k[64] = //UL = uint32
             {0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
              0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
@@ -59,7 +67,197 @@ const unsigned int SHA256::sha256_k[64] = //UL = uint32
              0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
              0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
 
-void SHA256::transform(const unsigned char *message, unsigned int block_nb)
+const unsigned int SHA256::sha256_h0[8] =
+            {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+             0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+
+namespace {
+
+// Pick the fastest compression function this machine supports.
+SHA256::Backend bestBackend()
+{
+    if (SHA256::isSupported(SHA256::X86_SHA_NI))
+        return SHA256::X86_SHA_NI;
+    if (SHA256::isSupported(SHA256::ARMV8_SHA2))
+        return SHA256::ARMV8_SHA2;
+    return SHA256::SCALAR;
+}
+
+// Digest a whole message with a fresh context.
+void digestOne(const unsigned char *message, size_t len, unsigned char *digest)
+{
+    SHA256 ctx = SHA256();
+    ctx.init();
+
+    // update() takes an unsigned int length, so feed huge buffers in pieces
+    const size_t maxChunk = 1u << 30;
+    while (len > maxChunk) {
+        ctx.update(message, maxChunk);
+        message += maxChunk;
+        len -= maxChunk;
+    }
+    ctx.update(message, (unsigned int) len);
+    ctx.final(digest);
+}
+
+} // End anonymous namespace
+
+SHA256::TransformFn SHA256::s_transform = SHA256::transformScalar;
+bool SHA256::s_multiBuffer = false;
+
+namespace {
+
+// Installs the fastest backends before main runs. The statics above are constant initialized so
+// they're already set up by the time this runs. SHA-NI on a single buffer outruns the AVX2 lanes,
+// so the multi-buffer path is only worth it when we're stuck with the scalar transform.
+struct BackendSelector {
+    BackendSelector()
+    {
+        SHA256::selectBackend(bestBackend());
+        SHA256::selectMultiBuffer(SHA256::isMultiBufferSupported() &&
+                                  SHA256::selectedBackend() == SHA256::SCALAR);
+    }
+} backendSelector;
+
+} // End anonymous namespace
+
+bool SHA256::isSupported(Backend backend)
+{
+    switch (backend) {
+    case SCALAR:
+        return true;
+    case X86_SHA_NI:
+#ifdef SHA256_HAVE_X86_BACKENDS
+        return cpuHasShaNi();
+#else
+        return false;
+#endif
+    case ARMV8_SHA2:
+#ifdef SHA256_HAVE_ARM_BACKENDS
+        return cpuHasArmv8Sha2();
+#else
+        return false;
+#endif
+    }
+    return false;
+}
+
+bool SHA256::selectBackend(Backend backend)
+{
+    if (!isSupported(backend))
+        return false;
+
+    switch (backend) {
+#ifdef SHA256_HAVE_X86_BACKENDS
+    case X86_SHA_NI:
+        s_transform = transformShaNi;
+        break;
+#endif
+#ifdef SHA256_HAVE_ARM_BACKENDS
+    case ARMV8_SHA2:
+        s_transform = transformArmv8;
+        break;
+#endif
+    default:
+        s_transform = transformScalar;
+        break;
+    }
+    return true;
+}
+
+SHA256::Backend SHA256::selectedBackend()
+{
+#ifdef SHA256_HAVE_X86_BACKENDS
+    if (s_transform == transformShaNi)
+        return X86_SHA_NI;
+#endif
+#ifdef SHA256_HAVE_ARM_BACKENDS
+    if (s_transform == transformArmv8)
+        return ARMV8_SHA2;
+#endif
+    return SCALAR;
+}
+
+bool SHA256::isMultiBufferSupported()
+{
+#ifdef SHA256_HAVE_X86_BACKENDS
+    return cpuHasAvx2();
+#else
+    return false;
+#endif
+}
+
+bool SHA256::selectMultiBuffer(bool enable)
+{
+    if (enable && !isMultiBufferSupported())
+        return false;
+    s_multiBuffer = enable;
+    return true;
+}
+
+void SHA256::digestLanes(const unsigned char * const *messages, const size_t *lens,
+                         unsigned int count, unsigned char * const *digests)
+{
+    assert(count <= MULTI_LANES);
+
+#ifdef SHA256_HAVE_X86_BACKENDS
+    // A single message gains nothing from the lanes
+    if (s_multiBuffer && count > 1) {
+        uint32 state[8][MULTI_LANES];
+        // The padded final block(s) of each lane, the rest is read from the message in place
+        unsigned char tails[MULTI_LANES][2 * SHA224_256_BLOCK_SIZE] = { };
+        size_t fullBlocks[MULTI_LANES] = { };
+        size_t totalBlocks[MULTI_LANES] = { };
+        size_t maxBlocks = 0;
+
+        for (unsigned int l = 0; l < count; l++) {
+            for (int j = 0; j < 8; j++)
+                state[j][l] = sha256_h0[j];
+
+            fullBlocks[l] = lens[l] / SHA224_256_BLOCK_SIZE;
+            size_t rem = lens[l] % SHA224_256_BLOCK_SIZE;
+            size_t tailBlocks = rem + 9 > SHA224_256_BLOCK_SIZE ? 2 : 1;
+            totalBlocks[l] = fullBlocks[l] + tailBlocks;
+            if (totalBlocks[l] > maxBlocks)
+                maxBlocks = totalBlocks[l];
+
+            memcpy(tails[l], messages[l] + fullBlocks[l] * SHA224_256_BLOCK_SIZE, rem);
+            tails[l][rem] = 0x80;
+            uint64 len_b = (uint64) lens[l] << 3;
+            unsigned char *lenPos = tails[l] + tailBlocks * SHA224_256_BLOCK_SIZE - 8;
+            SHA2_UNPACK32((uint32) (len_b >> 32), lenPos);
+            SHA2_UNPACK32((uint32) len_b, lenPos + 4);
+        }
+
+        // Lanes that have run out (or were never used) read a dummy block and are masked off
+        const unsigned char *blocks[MULTI_LANES];
+        for (size_t b = 0; b < maxBlocks; b++) {
+            unsigned int mask = 0;
+            for (unsigned int l = 0; l < MULTI_LANES; l++) {
+                if (l < count && b < fullBlocks[l])
+                    blocks[l] = messages[l] + b * SHA224_256_BLOCK_SIZE;
+                else if (l < count && b < totalBlocks[l])
+                    blocks[l] = tails[l] + (b - fullBlocks[l]) * SHA224_256_BLOCK_SIZE;
+                else
+                    blocks[l] = tails[0];
+                if (l < count && b < totalBlocks[l])
+                    mask |= 1u << l;
+            }
+            transformAvx2x8(state, blocks, mask);
+        }
+
+        for (unsigned int l = 0; l < count; l++)
+            for (int j = 0; j < 8; j++)
+                SHA2_UNPACK32(state[j][l], &digests[l][j << 2]);
+        return;
+    }
+#endif
+
+    for (unsigned int l = 0; l < count; l++)
+        digestOne(messages[l], lens[l], digests[l]);
+}
+
+void SHA256::transformScalar(uint32 *state, const unsigned char *message, unsigned int block_nb)
 {
     uint32 w[64];
     uint32 wv[8];
@@ -76,7 +274,7 @@ void SHA256::transform(const unsigned char *message, unsigned int block_nb)
             w[j] =  SHA256_F4(w[j -  2]) + w[j -  7] + SHA256_F3(w[j - 15]) + w[j - 16];
         }
         for (j = 0; j < 8; j++) {
-            wv[j] = m_h[j];
+            wv[j] = state[j];
         }
         for (j = 0; j < 64; j++) {
             t1 = wv[7] + SHA256_F2(wv[4]) + SHA2_CH(wv[4], wv[5], wv[6])
@@ -92,21 +290,14 @@ void SHA256::transform(const unsigned char *message, unsigned int block_nb)
             wv[0] = t1 + t2;
         }
         for (j = 0; j < 8; j++) {
-            m_h[j] += wv[j];
+            state[j] += wv[j];
         }
     }
 }
 
 void SHA256::init()
 {
-    m_h[0] = 0x6a09e667;
-    m_h[1] = 0xbb67ae85;
-    m_h[2] = 0x3c6ef372;
-    m_h[3] = 0xa54ff53a;
-    m_h[4] = 0x510e527f;
-    m_h[5] = 0x9b05688c;
-    m_h[6] = 0x1f83d9ab;
-    m_h[7] = 0x5be0cd19;
+    memcpy(m_h, sha256_h0, sizeof(m_h));
     m_len = 0;
     m_tot_len = 0;
 }
@@ -131,14 +322,14 @@ void SHA256::update(const unsigned char *message, unsigned int len)
     rem_len = new_len % SHA224_256_BLOCK_SIZE;
     memcpy(m_block, &shifted_message[block_nb << 6], rem_len);
     m_len = rem_len;
-    m_tot_len += (block_nb + 1) << 6;
+    m_tot_len += (uint64) (block_nb + 1) << 6;
 }
 
 void SHA256::final(unsigned char *digest)
 {
     unsigned int block_nb;
     unsigned int pm_len;
-    unsigned int len_b;
+    uint64 len_b;
     int i;
     block_nb = (1 + ((SHA224_256_BLOCK_SIZE - 9)
                      < (m_len % SHA224_256_BLOCK_SIZE)));
@@ -146,7 +337,8 @@ void SHA256::final(unsigned char *digest)
     pm_len = block_nb << 6;
     memset(m_block + m_len, 0, pm_len - m_len);
     m_block[m_len] = 0x80;
-    SHA2_UNPACK32(len_b, m_block + pm_len - 4);
+    SHA2_UNPACK32((uint32) (len_b >> 32), m_block + pm_len - 8);
+    SHA2_UNPACK32((uint32) len_b, m_block + pm_len - 4);
     transform(m_block, block_nb);
     for (i = 0 ; i < 8; i++) {
         SHA2_UNPACK32(m_h[i], &digest[i << 2]);
@@ -159,11 +351,6 @@ SHA256Hash::ptr sha256(std::ifstream &file)
     // Construct our digest
     SHA256Hash::ptr digest = std::make_shared<SHA256Hash>();
 
-    // get length of file:
-    file.seekg (0, file.end);
-    std::streamsize length = file.tellg();
-    file.seekg (0, file.beg);
-
     // Initialize the SHA context
     SHA256 ctx = SHA256();
     ctx.init();
@@ -172,21 +359,18 @@ SHA256Hash::ptr sha256(std::ifstream &file)
     const int buffSize = 0x8000; // This could be increased
     unsigned char buff[buffSize] = { };
 
-    // Iteratively update the context
-    std::streamsize totalRead = 0;
+    // Iteratively update the context until the stream runs dry. We don't ask for the length up
+    // front because pipes can't tell us.
     std::streamsize read = 0;
-    while (totalRead < length)
+    do
     {
         // Read into the buffer
         file.read((char *) buff, buffSize);
 
         // Update the context with how much we read
         read = file.gcount();
-        ctx.update(buff, read);
-
-        // Update our total
-        totalRead += read;
-    }
+        ctx.update(buff, (unsigned int) read);
+    } while (read > 0);
 
     // Get our final digest, note that this is getting the buffer from the digest, not getting
     // the smart pointer's bare pointer
@@ -195,6 +379,81 @@ SHA256Hash::ptr sha256(std::ifstream &file)
     return std::move(digest);
 }
 
+SHA256Hash::ptr sha256File(const std::string &path)
+{
+#ifndef _WIN32
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return nullptr;
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        ::close(fd);
+        return nullptr;
+    }
+
+    // Only regular files can be mapped, and there's nothing to map in an empty one
+    size_t length = (size_t) st.st_size;
+    void *addr = MAP_FAILED;
+    if (S_ISREG(st.st_mode) && length > 0 && (off_t) length == st.st_size)
+        addr = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd); // The mapping keeps the file alive
+
+    if (addr != MAP_FAILED) {
+        // We read front to back exactly once so ask for aggressive readahead
+        ::madvise(addr, length, MADV_SEQUENTIAL);
+
+        SHA256 ctx = SHA256();
+        ctx.init();
+
+        // Feed the context in huge page sized pieces aligned to the mapping (which is page aligned
+        // itself) rather than all at once, update() only takes an unsigned int length
+        const size_t chunkSize = 2 << 20;
+        const unsigned char *message = (const unsigned char *) addr;
+        for (size_t offset = 0; offset < length; offset += chunkSize) {
+            size_t len = length - offset < chunkSize ? length - offset : chunkSize;
+            ctx.update(message + offset, (unsigned int) len);
+        }
+
+        SHA256Hash::ptr digest = std::make_shared<SHA256Hash>();
+        ctx.final(digest->get());
+        ::munmap(addr, length);
+        return digest;
+    }
+#endif
+
+    // Couldn't map it so stream it instead
+    std::ifstream file(path, std::fstream::in | std::fstream::binary);
+    if (!file)
+        return nullptr;
+    return sha256(file);
+}
+
+std::vector<SHA256Hash::ptr> sha256(const std::vector<std::vector<uint8_t>> &buffers)
+{
+    std::vector<SHA256Hash::ptr> digests;
+    digests.reserve(buffers.size());
+
+    // Hand the buffers to the lanes in groups
+    for (size_t i = 0; i < buffers.size(); i += SHA256::MULTI_LANES) {
+        const unsigned char *messages[SHA256::MULTI_LANES];
+        size_t lens[SHA256::MULTI_LANES];
+        unsigned char *out[SHA256::MULTI_LANES];
+
+        unsigned int count = 0;
+        for (; count < SHA256::MULTI_LANES && i + count < buffers.size(); ++count) {
+            digests.push_back(std::make_shared<SHA256Hash>());
+            messages[count] = buffers[i + count].data();
+            lens[count] = buffers[i + count].size();
+            out[count] = digests.back()->get();
+        }
+
+        SHA256::digestLanes(messages, lens, count, out);
+    }
+
+    return digests;
+}
+
 SHA256Hash::SHA256Hash(const uint8_t * const bytes) : buff() {
     std::memcpy(buff, bytes, SHA256::DIGEST_SIZE);
 }
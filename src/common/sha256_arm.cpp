@@ -0,0 +1,62 @@
+// ARMv8 SHA256 backend using the cryptography extensions. Compiled with a function level target so
+// the rest of the program doesn't require them, SHA256 only calls it after checking the hwcaps.
+#include "common/sha256.h"
+
+#ifdef SHA256_HAVE_ARM_BACKENDS
+
+#include <arm_neon.h>
+
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#if defined(__clang__)
+#define SHA256_ARM_TARGET __attribute__((target("crypto")))
+#else
+#define SHA256_ARM_TARGET __attribute__((target("+crypto")))
+#endif
+
+bool SHA256::cpuHasArmv8Sha2() {
+#if defined(__linux__)
+  return (getauxval(AT_HWCAP) & HWCAP_SHA2) != 0;
+#elif defined(__APPLE__)
+  return true; // Every Apple arm64 core has them
+#else
+  return false;
+#endif
+}
+
+// Each group of four rounds derives its message words from the previous four groups.
+SHA256_ARM_TARGET
+void SHA256::transformArmv8(uint32 *state, const unsigned char *message, unsigned int block_nb) {
+  uint32x4_t state0 = vld1q_u32(&state[0]); // ABCD
+  uint32x4_t state1 = vld1q_u32(&state[4]); // EFGH
+
+  for (unsigned int i = 0; i < block_nb; ++i) {
+    const unsigned char *block = message + (i << 6);
+    uint32x4_t abcdSave = state0;
+    uint32x4_t efghSave = state1;
+
+    uint32x4_t w[16];
+    for (int j = 0; j < 16; ++j) {
+      if (j < 4)
+        w[j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(block + (j << 4))));
+      else
+        w[j] = vsha256su1q_u32(vsha256su0q_u32(w[j - 4], w[j - 3]), w[j - 2], w[j - 1]);
+
+      uint32x4_t wk = vaddq_u32(w[j], vld1q_u32(&sha256_k[j << 2]));
+      uint32x4_t tmp = state0;
+      state0 = vsha256hq_u32(state0, state1, wk);
+      state1 = vsha256h2q_u32(state1, tmp, wk);
+    }
+
+    state0 = vaddq_u32(state0, abcdSave);
+    state1 = vaddq_u32(state1, efghSave);
+  }
+
+  vst1q_u32(&state[0], state0);
+  vst1q_u32(&state[4], state1);
+}
+
+#endif // SHA256_HAVE_ARM_BACKENDS
@@ -0,0 +1,170 @@
+// x86 SHA256 backends: a SHA extensions (SHA-NI) compression function and an 8 lane AVX2
+// multi-buffer compression function. Each is compiled with a function level target so the rest of
+// the program doesn't require these instruction sets, SHA256 only calls them after checking cpuid.
+#include "common/sha256.h"
+
+#ifdef SHA256_HAVE_X86_BACKENDS
+
+#include <cpuid.h>
+#include <immintrin.h>
+
+namespace {
+
+// Check that the OS saves the AVX (ymm) registers on context switch.
+bool osSavesYmm() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(ecx & bit_OSXSAVE))
+    return false;
+
+  unsigned int xcr0Lo, xcr0Hi;
+  __asm__ volatile("xgetbv" : "=a"(xcr0Lo), "=d"(xcr0Hi) : "c"(0));
+  return (xcr0Lo & 0x6) == 0x6; // XMM and YMM state
+}
+
+// Rotate each lane right.
+__attribute__((target("avx2")))
+inline __m256i rotr(__m256i x, int n) {
+  return _mm256_or_si256(_mm256_srli_epi32(x, n), _mm256_slli_epi32(x, 32 - n));
+}
+
+// Read a big endian word.
+inline uint32_t loadBe32(const unsigned char *p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) |
+         (uint32_t) p[3];
+}
+
+} // End anonymous namespace
+
+bool SHA256::cpuHasShaNi() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx))
+    return false;
+  if (!(ecx & bit_SSSE3) || !(ecx & bit_SSE4_1))
+    return false;
+
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (ebx & (1u << 29)) != 0; // SHA
+}
+
+bool SHA256::cpuHasAvx2() {
+  unsigned int eax, ebx, ecx, edx;
+  if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx))
+    return false;
+  return (ebx & bit_AVX2) && osSavesYmm();
+}
+
+// The state is kept as ABEF/CDGH pairs because that's what sha256rnds2 works on. Each group of
+// four rounds derives its message words from the previous four groups.
+__attribute__((target("sha,sse4.1,ssse3")))
+void SHA256::transformShaNi(uint32 *state, const unsigned char *message, unsigned int block_nb) {
+  const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+  // Shuffle the state from ABCD/EFGH into ABEF/CDGH
+  __m128i tmp = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[0]), 0xB1); // CDAB
+  __m128i state1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) &state[4]), 0x1B); // EFGH
+  __m128i state0 = _mm_alignr_epi8(tmp, state1, 8); // ABEF
+  state1 = _mm_blend_epi16(state1, tmp, 0xF0); // CDGH
+
+  for (unsigned int i = 0; i < block_nb; ++i) {
+    const unsigned char *block = message + (i << 6);
+    __m128i abefSave = state0;
+    __m128i cdghSave = state1;
+
+    __m128i w[16];
+    for (int j = 0; j < 16; ++j) {
+      if (j < 4) {
+        w[j] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (block + (j << 4))), byteSwap);
+      }
+      else {
+        __m128i sum = _mm_add_epi32(_mm_sha256msg1_epu32(w[j - 4], w[j - 3]),
+                                    _mm_alignr_epi8(w[j - 1], w[j - 2], 4));
+        w[j] = _mm_sha256msg2_epu32(sum, w[j - 1]);
+      }
+
+      __m128i wk = _mm_add_epi32(w[j], _mm_loadu_si128((const __m128i *) &sha256_k[j << 2]));
+      state1 = _mm_sha256rnds2_epu32(state1, state0, wk);
+      state0 = _mm_sha256rnds2_epu32(state0, state1, _mm_shuffle_epi32(wk, 0x0E));
+    }
+
+    state0 = _mm_add_epi32(state0, abefSave);
+    state1 = _mm_add_epi32(state1, cdghSave);
+  }
+
+  // Shuffle back into ABCD/EFGH
+  tmp = _mm_shuffle_epi32(state0, 0x1B); // FEBA
+  state1 = _mm_shuffle_epi32(state1, 0xB1); // DCHG
+  state0 = _mm_blend_epi16(tmp, state1, 0xF0); // DCBA
+  state1 = _mm_alignr_epi8(state1, tmp, 8); // ABEF
+
+  _mm_storeu_si128((__m128i *) &state[0], state0);
+  _mm_storeu_si128((__m128i *) &state[4], state1);
+}
+
+// Straight vectorization of the scalar transform with one message per 32 bit lane.
+__attribute__((target("avx2")))
+void SHA256::transformAvx2x8(uint32 state[8][MULTI_LANES], const unsigned char * const *blocks,
+                             unsigned int laneMask) {
+  __m256i w[16];
+  for (int j = 0; j < 16; ++j) {
+    int off = j << 2;
+    w[j] = _mm256_set_epi32(loadBe32(blocks[7] + off), loadBe32(blocks[6] + off),
+                            loadBe32(blocks[5] + off), loadBe32(blocks[4] + off),
+                            loadBe32(blocks[3] + off), loadBe32(blocks[2] + off),
+                            loadBe32(blocks[1] + off), loadBe32(blocks[0] + off));
+  }
+
+  __m256i h[8];
+  __m256i wv[8];
+  for (int j = 0; j < 8; ++j)
+    wv[j] = h[j] = _mm256_loadu_si256((const __m256i *) state[j]);
+
+  for (int j = 0; j < 64; ++j) {
+    // Extend the schedule in place once we're past the message words
+    if (j >= 16) {
+      __m256i w2 = w[(j - 2) & 15];
+      __m256i w15 = w[(j - 15) & 15];
+      __m256i s1 = _mm256_xor_si256(_mm256_xor_si256(rotr(w2, 17), rotr(w2, 19)),
+                                    _mm256_srli_epi32(w2, 10));
+      __m256i s0 = _mm256_xor_si256(_mm256_xor_si256(rotr(w15, 7), rotr(w15, 18)),
+                                    _mm256_srli_epi32(w15, 3));
+      w[j & 15] = _mm256_add_epi32(_mm256_add_epi32(s1, w[(j - 7) & 15]),
+                                   _mm256_add_epi32(s0, w[j & 15]));
+    }
+
+    __m256i f2 = _mm256_xor_si256(_mm256_xor_si256(rotr(wv[4], 6), rotr(wv[4], 11)),
+                                  rotr(wv[4], 25));
+    __m256i ch = _mm256_xor_si256(_mm256_and_si256(wv[4], wv[5]),
+                                  _mm256_andnot_si256(wv[4], wv[6]));
+    __m256i t1 = _mm256_add_epi32(_mm256_add_epi32(wv[7], f2),
+                                  _mm256_add_epi32(ch, _mm256_add_epi32(
+                                      _mm256_set1_epi32((int) sha256_k[j]), w[j & 15])));
+    __m256i f1 = _mm256_xor_si256(_mm256_xor_si256(rotr(wv[0], 2), rotr(wv[0], 13)),
+                                  rotr(wv[0], 22));
+    __m256i maj = _mm256_xor_si256(_mm256_xor_si256(_mm256_and_si256(wv[0], wv[1]),
+                                                    _mm256_and_si256(wv[0], wv[2])),
+                                   _mm256_and_si256(wv[1], wv[2]));
+    __m256i t2 = _mm256_add_epi32(f1, maj);
+
+    wv[7] = wv[6];
+    wv[6] = wv[5];
+    wv[5] = wv[4];
+    wv[4] = _mm256_add_epi32(wv[3], t1);
+    wv[3] = wv[2];
+    wv[2] = wv[1];
+    wv[1] = wv[0];
+    wv[0] = _mm256_add_epi32(t1, t2);
+  }
+
+  // Only lanes that were fed a real block get updated
+  const __m256i mask = _mm256_set_epi32(
+      laneMask & 0x80 ? -1 : 0, laneMask & 0x40 ? -1 : 0, laneMask & 0x20 ? -1 : 0,
+      laneMask & 0x10 ? -1 : 0, laneMask & 0x08 ? -1 : 0, laneMask & 0x04 ? -1 : 0,
+      laneMask & 0x02 ? -1 : 0, laneMask & 0x01 ? -1 : 0);
+  for (int j = 0; j < 8; ++j) {
+    __m256i updated = _mm256_blendv_epi8(h[j], _mm256_add_epi32(h[j], wv[j]), mask);
+    _mm256_storeu_si256((__m256i *) state[j], updated);
+  }
+}
+
+#endif // SHA256_HAVE_X86_BACKENDS
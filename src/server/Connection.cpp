@@ -5,126 +5,587 @@
 #include "common/packets.h"
 #include "server/Server.h"
 
+#include <algorithm>
 #include <iostream>
+#include <stdexcept>
+
+namespace {
+
+//! The most one read takes from the socket, a handshake bigger than this takes a few.
+const size_t readChunk = 64 * 1024;
+
+//! The most games a client can have queued up, so one client can't take a whole tournament.
+const uint8_t maxQueueDepth = 16;
+
+} // End anonymous namespace
+
+sc2tm::Connection::ptr sc2tm::Connection::resume(Server &server, asio::io_service &service,
+                                                 const HandoffConnection &handoff) {
+  ptr conn = create(server, service, handoff.id);
+  conn->_socket.assign(tcp::v4(), handoff.fd);
+
+  // Rebuild what the handshake told us
+  conn->bots = IdBitset(server.botRegistry.size());
+  conn->maps = IdBitset(server.mapRegistry.size());
+  for (HashId bot : handoff.bots)
+    if (bot < conn->bots.size())
+      conn->bots.set(bot);
+  for (HashId map : handoff.maps)
+    if (map < conn->maps.size())
+      conn->maps.set(map);
+
+  // Pick the games back up, including whatever of the next frame had already arrived. Only the
+  // game at the front of the queue is being played.
+  auto now = std::chrono::steady_clock::now();
+  for (const HandoffGame &game : handoff.games) {
+    Assignment &assignment = conn->assigned[game.ticket];
+    assignment.game = game.game;
+    if (game.ticket == handoff.games.front().ticket)
+      assignment.start = now - game.elapsed;
+  }
+  conn->nextTicket = handoff.nextTicket;
+  conn->queueDepth = handoff.queueDepth;
+  conn->hasSession = handoff.hasSession && server.sessions;
+  conn->session = handoff.session;
+  conn->greeted = true;
+  BufferWriter(conn->inbox, handoff.pending.size()).putBytes(handoff.pending.data(),
+                                                          handoff.pending.size());
+
+  // The old process stopped topping the client up to hand it over
+  conn->strand.post([conn] () {
+    for (const auto &entry : conn->assigned)
+      conn->grantLease(entry.first);
+    conn->readFrames();
+    conn->scheduleGames();
+  });
+  return conn;
+}
 
 sc2tm::Connection::~Connection() {
   std::cout << "CONNECTION DYING\n";
 };
 
 void sc2tm::Connection::start() {
-  auto readHandshakeSizeFn =
-      [&] (const boost::system::error_code& error, std::size_t byteCount) {
-        // Sanity checking
-        assert(error.value() == boost::system::errc::success); // TODO handle failures
-        assert(byteCount == sizeof(uint32_t));
-
-        // Create an istream from the buffer
-        std::istream is(&buffer);
-
-        // Read in size and convert to host
-        uint32_t size = readUint32(is);
-
-        // Make the second callback that actually reads the handshake
-        auto readHandshakeFn =
-            [&, size] (const boost::system::error_code& error2, std::size_t byteCount2) {
-              assert(error2.value() == boost::system::errc::success); // TODO handle failures
-              assert(byteCount2 == size);
-              readHandshake();
-            };
-        boost::asio::async_read(_socket, buffer, boost::asio::transfer_exactly(size),
-                                readHandshakeFn);
+  // The client's first frame is its handshake or resume
+  ptr self = shared_from_this();
+  strand.post([self] () { self->readFrames(); });
+}
+
+void sc2tm::Connection::readFrames() {
+  // Handle everything that's arrived, a handler may tear us down or start hanging up
+  FrameHeader header;
+  FrameState state = FrameState::PARTIAL;
+  while (!done && !hangingUp && (state = nextFrame(inbox, header)) == FrameState::READY)
+    handleFrame(header);
+
+  if (done || hangingUp)
+    return;
+
+  if (state == FrameState::INVALID) {
+    std::cout << "FRAME TOO LONG ON CONNECTION " << id << '\n';
+    dropClient();
+    return;
+  }
+
+  // The server's being handed to a new process, whatever's left of a frame goes with us
+  if (canPark()) {
+    parkNow();
+    return;
+  }
+
+  // Take whatever's arrived, as much as there is
+  ptr self = shared_from_this();
+  auto readFn =
+      [self] (const boost::system::error_code& error, std::size_t byteCount) {
+        self->reading = false;
+        self->inbox.commit(byteCount);
+        if (self->done)
+          return;
+
+        // We were interrupted to be handed off, if something's come up since we carry on until
+        // we can stop
+        if (error == boost::asio::error::operation_aborted && self->server.handingOff) {
+          if (self->canPark())
+            self->parkNow();
+          else
+            self->readFrames();
+          return;
+        }
+
+        // Either the client's gone or we hung up on it. The client may come back for its games,
+        // otherwise someone else will have to play them.
+        if (error) {
+          self->dropClient();
+          return;
+        }
+        self->readFrames();
       };
-  boost::asio::async_read(_socket, buffer, boost::asio::transfer_exactly(sizeof(uint32_t)),
-                          readHandshakeSizeFn);
-};
+  reading = true;
+  _socket.async_read_some(inbox.prepare(readChunk), strand.wrap(readFn));
+}
+
+void sc2tm::Connection::handleFrame(const FrameHeader &header) {
+  // Every message is only welcome at one point in the conversation, anything else means the
+  // client's broken. So does a message that doesn't decode.
+  bool valid = false;
+  try {
+    switch (header.type) {
+    case HANDSHAKE:
+      valid = !greeted && ClientHandshakePacket::accepts(header.length);
+      if (valid) {
+        greeted = true;
+        readHandshake(header.length);
+      }
+      break;
+    case RESUME:
+      valid = !greeted && ClientResumePacket::accepts(header.length);
+      if (valid) {
+        greeted = true;
+        readResume(header.length);
+      }
+      break;
+    case GAME_STATUS:
+      valid = greeted && GameStatusPacket::accepts(header.length);
+      if (valid)
+        readGameStatus(header.length);
+      break;
+    default:
+      break;
+    }
+  }
+  catch (const std::runtime_error &error) {
+    std::cout << error.what() << " ON CONNECTION " << id << '\n';
+    dropClient();
+    return;
+  }
+
+  if (!valid) {
+    std::cout << "UNEXPECTED MESSAGE " << (int) header.type << " ON CONNECTION " << id << '\n';
+    dropClient();
+  }
+}
+
+void sc2tm::Connection::flush() {
+  boost::asio::streambuf &outbox = outboxes[filling];
+  if (writing || done || outbox.size() == 0)
+    return;
+
+  // Anything queued from here on goes out with the next write
+  filling ^= 1;
+  writing = true;
+
+  ptr self = shared_from_this();
+  auto writtenFn =
+      [self] (const boost::system::error_code& error, std::size_t) {
+        self->handleWritten(error);
+      };
+  boost::asio::async_write(_socket, outbox, strand.wrap(writtenFn));
+}
 
-void sc2tm::Connection::readHandshake() {
-  ClientHandshakePacket packet(buffer);
+void sc2tm::Connection::handleWritten(const boost::system::error_code &error) {
+  writing = false;
+  if (done)
+    return;
+
+  // The client's gone, it may come back for its games or someone else will have to play them
+  if (error) {
+    dropClient();
+    return;
+  }
+
+  flush();
+  if (writing)
+    return;
+
+  // Everything's out, we can hang up now
+  if (hangingUp) {
+    finish();
+    return;
+  }
+
+  // The client has its games, if we're being handed off this is where we stop
+  if (canPark() && reading) {
+    boost::system::error_code ignored;
+    _socket.cancel(ignored);
+  }
+}
+
+void sc2tm::Connection::finish() {
+  if (done)
+    return;
+
+  // Anything still pending fails and finds us done
+  done = true;
+  boost::system::error_code ignored;
+  _socket.close(ignored);
+  server.requestDestroyConnection(id);
+}
+
+void sc2tm::Connection::readHandshake(size_t length) {
+  ClientHandshakePacket packet(inbox, length);
   std::cout << "\nClient connect: \n";
   std::cout << "VERSION: "
             << (int) packet.clientMajorVersion << '.'
             << (int) packet.clientMinorVersion << '.'
             << (int) packet.clientPatchVersion << '\n';
 
-  // Import the client's bots
-  std::cout << "bots\n"; // TODO DEBUG
-  for (auto hash : packet.botHashes) {
-    bots.insert(std::make_shared<SHA256Hash>(hash.data()));
-    std::cout << SHA256Hash(hash.data()) << "\n"; // TODO DEBUG
-  }
-
-  // Import the client's maps
-  std::cout << "maps\n"; // TODO DEBUG
-  for (auto hash : packet.mapHashes) {
-    maps.insert(std::make_shared<SHA256Hash>(hash.data()));
-    std::cout << SHA256Hash(hash.data()) << "\n"; // TODO DEBUG
-  }
+  // Import the client's bots and maps, anything we don't have is dropped
+  packet.toIds(server.botRegistry, server.mapRegistry, bots, maps);
 
   // If there's a version mismatch we should just disconnect
   // This might be more complicated later but for now it's reasonable to not deal with clients
   // with the wrong version
   if (packet.clientMajorVersion != clientMajorVersion ||
       packet.clientMinorVersion != clientMinorVersion ||
-      packet.clientPatchVersion != clientPatchVersion)
+      packet.clientPatchVersion != clientPatchVersion) {
     sendPregameDisconnect(BAD_VERSION);
+    return;
+  }
+
+  // A client that doesn't ask for a queue still gets a game at a time
+  queueDepth = std::max<uint8_t>(1, std::min(packet.queueDepth, maxQueueDepth));
+
+  // Give the client a session so it won't have to do this again if it drops. The session goes
+  // out ahead of whatever we send next.
+  if (server.sessions) {
+    session = server.sessions->open(id, packet.digest(), bots, maps, queueDepth);
+    hasSession = true;
+    send(SessionPacket(session, false));
+  }
+
+  // No client version mismatch, so we can send them games
+  scheduleGames();
+}
+
+void sc2tm::Connection::readResume(size_t length) {
+  ClientResumePacket packet(inbox, length);
+  std::cout << "\nClient resume\n";
+
+  if (packet.clientMajorVersion != clientMajorVersion ||
+      packet.clientMinorVersion != clientMinorVersion ||
+      packet.clientPatchVersion != clientPatchVersion) {
+    sendPregameDisconnect(BAD_VERSION);
+    return;
+  }
+
+  // Finding the session may mean waiting for our client's old connection to hang up. Hold onto
+  // ourselves until then and carry on on our strand.
+  if (!server.sessions) {
+    sendPregameDisconnect(BAD_SESSION);
+    return;
+  }
+  ptr self = shared_from_this();
+  SessionToken token = packet.token;
+  auto resumedFn =
+      [self, token] (bool found, const SessionTable::Session &resumed) {
+        self->strand.post([self, token, found, resumed] () {
+          self->handleResumed(found, token, resumed);
+        });
+      };
+  server.sessions->resume(packet.token, packet.catalog, id, resumedFn);
+}
+
+void sc2tm::Connection::handleResumed(bool found, const SessionToken &token,
+                                      const SessionTable::Session &resumed) {
+  // We lost the client while we were waiting, the session's still its to come back to
+  if (done) {
+    if (found)
+      server.sessions->detach(token, resumed.games, resumed.nextTicket);
+    return;
+  }
 
-  // No client version mismatch, so we can send them a game
-  scheduleGame();
+  // The client will have to handshake if we can't find its session
+  if (!found) {
+    sendPregameDisconnect(BAD_SESSION);
+    return;
+  }
+
+  // Pick up everything the handshake told us
+  session = token;
+  hasSession = true;
+  bots = resumed.bots;
+  maps = resumed.maps;
+
+  queueDepth = resumed.queueDepth;
+  nextTicket = resumed.nextTicket;
+
+  // The client carries on with whatever games the session kept and is topped back up
+  send(SessionPacket(session, !resumed.games.empty()));
+  assigned = resumed.games;
+  for (const auto &entry : assigned)
+    grantLease(entry.first);
+  startNextGame();
+  scheduleGames();
+  flush();
 }
 
-void sc2tm::Connection::scheduleGame() {
-  // Try to find a game, if we do, send it, if we don't that means there are no games for it, so
-  // we might as well disconnect it
-  bool success = server.gen.generateGame(game, bots, maps);
-  if (!success)
-    sendPregameDisconnect(NO_GAMES);
-  sendStartGame();
+void sc2tm::Connection::scheduleGames() {
+  // Ask for a game for every free slot in the client's queue. Once we're handing off a client
+  // with games just waits to be parked.
+  while (!done && !hangingUp && !starved && assigned.size() + scheduling < queueDepth &&
+         !(server.handingOff && !assigned.empty())) {
+    ++scheduling;
+
+    // With a scheduler thread we queue the request and pick things up again once it answers, on
+    // our strand. Hold onto ourselves until then.
+    if (server.scheduler) {
+      ptr self = shared_from_this();
+      auto scheduledFn =
+          [self] (bool found, const Game &scheduled) {
+            self->handleScheduled(found, scheduled);
+          };
+      server.scheduler->schedule(bots, maps, id, strand, scheduledFn);
+      continue;
+    }
+
+    Game game;
+    bool found = server.gen->generateGame(game, bots, maps, id);
+    handleScheduled(found, game);
+  }
+}
+
+void sc2tm::Connection::handleScheduled(bool found, const Game &game) {
+  --scheduling;
+
+  // The client left while we were finding it a game, put the game back
+  if (done || hangingUp) {
+    if (found)
+      giveBack(game);
+    return;
+  }
+
+  // A backup copy of a game the client already has is no use to it
+  for (const auto &entry : assigned) {
+    const Game &held = entry.second.game;
+    if (found && held.id == game.id && held.bot0 == game.bot0 && held.bot1 == game.bot1 &&
+        held.map == game.map) {
+      giveBack(game);
+      found = false;
+      break;
+    }
+  }
+
+  // If we found a game, send it. If we didn't there's nothing for the client until one of its
+  // games is reported, and if it has none that means there are no games for it, so we might as
+  // well disconnect it.
+  if (!found) {
+    starved = true;
+    if (assigned.empty() && scheduling == 0)
+      sendPregameDisconnect(NO_GAMES);
+    return;
+  }
+  sendStartGame(game);
 }
 
 void sc2tm::Connection::sendPregameDisconnect(PregameDisconnectReason r) {
-  // Generate our packets and put them in the buffer.
-  PregameCommandPacket cmd(DISCONNECT);
-  PregameDisconnectPacket reason(r);
-  cmd.toBuffer(buffer);
-  reason.toBuffer(buffer);
-
-  // Make a function to write the bytes and then request that we destroy this client connection
-  auto destroyConnectionFn =
-      [&] (const boost::system::error_code& error, std::size_t byteCount) {
-        assert(error == boost::system::errc::success); // TODO handle error
-        assert(byteCount == PregameCommandPacket::size());
-        server.requestDestroyConnection(id);
-      };
-  boost::asio::async_write(_socket, buffer, destroyConnectionFn);
-}
-
-void sc2tm::Connection::sendStartGame() {
-  // Generate our packets and put them in the buffer.
-  PregameCommandPacket cmd(START_GAME);
-  StartGamePacket gamePacket(game);
-  cmd.toBuffer(buffer);
-  gamePacket.toBuffer(buffer);
-
-  // Make a function to wait on reading the game play status code back
-  auto waitReadStatusFn =
-      [&] (const boost::system::error_code& error, std::size_t byteCount) {
-        assert(error.value() == boost::system::errc::success); // TODO handle failures
-        assert(byteCount == PregameCommandPacket::size() + StartGamePacket::size());
-
-        // Make a function to call the readHandshake function
-        auto readStatusFn =
-            [&] (const boost::system::error_code& error2, std::size_t byteCount2) {
-              assert(error2.value() == boost::system::errc::success); // TODO handle failures
-              assert(byteCount2 == GameStatusPacket::size());
-              readGameStatus();
-            };
-        boost::asio::async_read(_socket, buffer,
-                                boost::asio::transfer_exactly(GameStatusPacket::size()),
-                                readStatusFn);
+  // The client won't be back
+  if (hasSession) {
+    server.sessions->close(session);
+    hasSession = false;
+  }
+
+  // Hang up once the reason, and anything queued ahead of it, has gone out
+  send(PregameDisconnectPacket(r));
+  hangingUp = true;
+  flush();
+}
+
+void sc2tm::Connection::sendStartGame(const Game &game) {
+  GameTicket ticket = nextTicket++;
+  assigned[ticket].game = game;
+  startNextGame();
+  send(StartGamePacket(ticket, game, server.botRegistry, server.mapRegistry));
+
+  grantLease(ticket);
+  flush();
+}
+
+void sc2tm::Connection::readGameStatus(size_t length) {
+  GameStatusPacket packet(inbox, length);
+
+  // A game we've already given away, the client will have heard from us
+  auto it = assigned.find(packet.ticket);
+  if (it == assigned.end()) {
+    std::cout << "STATUS FOR UNKNOWN TICKET " << packet.ticket << " ON CONNECTION " << id << '\n';
+    return;
+  }
+
+  // The client's still playing, give it more time and keep waiting
+  if (packet.status == HEARTBEAT) {
+    if (server.leases)
+      server.leases->renew(it->second.lease);
+    return;
+  }
+
+  // The game's over, it no longer needs a lease
+  if (server.leases)
+    server.leases->release(it->second.lease);
+
+  // Tell the generator how it went, a failed game goes back in the pool
+  reportGame(it->second, packet.status == SUCCESS);
+  assigned.erase(it);
+  startNextGame();
+
+  // The client has a free slot again, find it something else to do
+  starved = false;
+  scheduleGames();
+}
+
+void sc2tm::Connection::startNextGame() {
+  // Games are played in ticket order, so the client's on the first one it hasn't reported
+  if (assigned.empty())
+    return;
+  Assignment &next = assigned.begin()->second;
+  if (next.start == std::chrono::steady_clock::time_point())
+    next.start = std::chrono::steady_clock::now();
+}
+
+void sc2tm::Connection::reportGame(const Assignment &assignment, bool success) {
+  if (!success) {
+    giveBack(assignment.game);
+    return;
+  }
+
+  // A game reported before the client got to it can't tell us how long it takes
+  float seconds = 0;
+  if (assignment.start != std::chrono::steady_clock::time_point())
+    seconds = std::chrono::duration<float>(std::chrono::steady_clock::now() -
+                                           assignment.start).count();
+  if (server.scheduler)
+    server.scheduler->notifySuccess(assignment.game, seconds);
+  else
+    server.gen->notifySuccess(assignment.game, seconds);
+}
+
+void sc2tm::Connection::giveBack(const Game &game) {
+  if (server.scheduler)
+    server.scheduler->notifyFail(game);
+  else
+    server.gen->notifyFail(game);
+}
+
+void sc2tm::Connection::abandonGames() {
+  releaseLeases();
+  for (const auto &entry : assigned)
+    giveBack(entry.second.game);
+  assigned.clear();
+}
+
+void sc2tm::Connection::dropClient() {
+  if (done)
+    return;
+
+  if (hasSession) {
+    // The leases are the session's job now
+    releaseLeases();
+    server.sessions->detach(session, assigned, nextTicket);
+    assigned.clear();
+    hasSession = false;
+  }
+  else {
+    abandonGames();
+  }
+  finish();
+}
+
+void sc2tm::Connection::expireGame(GameTicket ticket) {
+  // The game may have been reported since the lease expired, and a parked connection's games are
+  // the new process's to expire
+  auto it = assigned.find(ticket);
+  if (parked || it == assigned.end())
+    return;
+
+  std::cout << "LEASE EXPIRED ON CONNECTION " << id << '\n';
+
+  // Give the game back and hang up, the pending read will clean up after us
+  giveBack(it->second.game);
+  assigned.erase(it);
+  boost::system::error_code ignored;
+  _socket.close(ignored);
+}
+
+void sc2tm::Connection::grantLease(GameTicket ticket) {
+  // Take out a lease on the game, if the client doesn't report back in time it's given to someone
+  // else. The lease can outlive us so it only holds a weak reference, and it can fire at any time
+  // so it hops onto our strand before touching anything.
+  if (!server.leases)
+    return;
+
+  std::weak_ptr<Connection> weak = shared_from_this();
+  auto expireFn =
+      [weak, ticket] () {
+        if (ptr self = weak.lock())
+          self->strand.post([self, ticket] () { self->expireGame(ticket); });
       };
-  boost::asio::async_write(_socket, buffer, waitReadStatusFn);
+  assigned[ticket].lease = server.leases->grant(expireFn);
+}
+
+void sc2tm::Connection::releaseLeases() {
+  if (!server.leases)
+    return;
+  for (auto &entry : assigned) {
+    server.leases->release(entry.second.lease);
+    entry.second.lease = LeaseManager::invalidLease;
+  }
+}
+
+void sc2tm::Connection::hangUp() {
+  ptr self = shared_from_this();
+  strand.post([self] () {
+    // Whatever's pending fails and drops the client, handing its session over
+    boost::system::error_code ignored;
+    self->_socket.close(ignored);
+  });
+}
+
+void sc2tm::Connection::park() {
+  ptr self = shared_from_this();
+  strand.post([self] () {
+    // Interrupt the read, the read handler parks us. Anywhere else we'll park once we get there.
+    if (self->canPark() && self->reading) {
+      boost::system::error_code ignored;
+      self->_socket.cancel(ignored);
+    }
+  });
+}
+
+bool sc2tm::Connection::canPark() const {
+  // Only a client with games and nothing on its way to it can be picked up by the new process
+  return server.handingOff && !assigned.empty() && scheduling == 0 && !writing && !hangingUp &&
+         !done;
+}
+
+void sc2tm::Connection::parkNow() {
+  if (parked)
+    return;
+
+  // The new process takes out its own leases
+  parked = true;
+  releaseLeases();
+  server.connectionParked();
 }
 
-void sc2tm::Connection::readGameStatus() {
-  // TODO
+sc2tm::HandoffConnection sc2tm::Connection::handoffState() {
+  HandoffConnection handoff;
+  handoff.id = id;
+  handoff.fd = _socket.native_handle();
+  handoff.hasSession = hasSession;
+  handoff.session = session;
+  auto now = std::chrono::steady_clock::now();
+  for (const auto &entry : assigned) {
+    std::chrono::milliseconds elapsed(0);
+    if (entry.second.start != std::chrono::steady_clock::time_point())
+      elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - entry.second.start);
+    handoff.games.push_back(HandoffGame{entry.first, entry.second.game, elapsed});
+  }
+  handoff.nextTicket = nextTicket;
+  handoff.queueDepth = queueDepth;
+  for (HashId bot = bots.first(); bot != invalidHashId; bot = bots.next(bot + 1))
+    handoff.bots.push_back(bot);
+  for (HashId map = maps.first(); map != invalidHashId; map = maps.next(map + 1))
+    handoff.maps.push_back(map);
+
+  handoff.pending.resize(inbox.size());
+  inbox.sgetn(&handoff.pending[0], (std::streamsize) handoff.pending.size());
+  return handoff;
 }
@@ -0,0 +1,50 @@
+#include "server/DurationModel.h"
+
+namespace {
+
+//! How much weight a new observation gets.
+const float newWeight = 0.2f;
+
+//! Move an estimate towards an observation.
+void blend(std::atomic<float> &estimate, float observed) {
+  float old = estimate.load(std::memory_order_relaxed);
+  estimate.store(old + newWeight * (observed - old), std::memory_order_relaxed);
+}
+
+} // End anonymous namespace
+
+sc2tm::DurationModel::DurationModel(size_t botCount, size_t mapCount) :
+    mapSeconds(new std::atomic<float>[mapCount]), botFactors(new std::atomic<float>[botCount]),
+    allSeconds(0) {
+  for (size_t map = 0; map < mapCount; ++map)
+    mapSeconds[map].store(0, std::memory_order_relaxed);
+  for (size_t bot = 0; bot < botCount; ++bot)
+    botFactors[bot].store(1, std::memory_order_relaxed);
+}
+
+void sc2tm::DurationModel::record(const Game &game, float seconds) {
+  if (seconds <= 0)
+    return;
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  // Split the game's length into its map's part and its bots' part using what we believed before
+  float pairFactor = (botFactor(game.bot0) + botFactor(game.bot1)) / 2;
+  float mapPart = seconds / pairFactor;
+  float botPart = seconds / mapEstimate(game.map);
+
+  // The first game on a map or at all tells us much more than an average would
+  if (mapSeconds[game.map].load(std::memory_order_relaxed) > 0)
+    blend(mapSeconds[game.map], mapPart);
+  else
+    mapSeconds[game.map].store(mapPart, std::memory_order_relaxed);
+
+  if (allSeconds.load(std::memory_order_relaxed) > 0)
+    blend(allSeconds, seconds);
+  else
+    allSeconds.store(seconds, std::memory_order_relaxed);
+
+  // We can't tell which bot made the game long, so both move towards what the pair did
+  blend(botFactors[game.bot0], botPart);
+  blend(botFactors[game.bot1], botPart);
+}
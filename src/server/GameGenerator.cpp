@@ -4,393 +4,650 @@
 
 #include <algorithm>
 #include <cassert>
-#include <iterator>
 
-sc2tm::GameGenerator::GameGenerator(const SHAFileMap &botMap, const SHAFileMap &mapMap) {
-  for (auto it : botMap)
-    bots.insert(it.second);
+// The matrix packs its counters into 16 bits.
+static_assert(sc2tm::numGames <= UINT16_MAX, "numGames must fit in a GameCounter");
+
+namespace {
+
+//! Finds a maximum matching of clients to ready slots, where a slot can take several clients.
+class SlotMatcher {
+  //! The slots each client could play.
+  const std::vector<std::vector<uint32_t>> &adj;
+  //! The number of clients each slot can take.
+  const std::vector<uint32_t> &capacity;
+  //! The clients each slot has taken.
+  std::vector<std::vector<uint32_t>> holders;
+  //! Slots already tried in the current search.
+  std::vector<bool> visited;
+
+public:
+  //! The slot each client got, UINT32_MAX if none.
+  std::vector<uint32_t> match;
+
+  SlotMatcher(const std::vector<std::vector<uint32_t>> &adj,
+              const std::vector<uint32_t> &capacity) :
+      adj(adj), capacity(capacity), holders(capacity.size()), visited(capacity.size()),
+      match(adj.size(), UINT32_MAX) { }
+
+  //! Try to fit a client in, moving other clients around if it helps.
+  bool add(uint32_t client) {
+    std::fill(visited.begin(), visited.end(), false);
+    return augment(client);
+  }
 
-  for (auto it : mapMap)
-    maps.insert(it.second);
+private:
+  bool augment(uint32_t client) {
+    // Take a free place if there is one
+    for (uint32_t slot : adj[client]) {
+      if (visited[slot] || holders[slot].size() == capacity[slot])
+        continue;
+      visited[slot] = true;
+      holders[slot].push_back(client);
+      match[client] = slot;
+      return true;
+    }
+
+    // Otherwise see if someone in a full slot can move somewhere else
+    for (uint32_t slot : adj[client]) {
+      if (visited[slot])
+        continue;
+      visited[slot] = true;
+      for (uint32_t &holder : holders[slot]) {
+        if (augment(holder)) {
+          holder = client;
+          match[client] = slot;
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+};
+
+} // End anonymous namespace
+
+sc2tm::GameGenerator::GameGenerator(const HashRegistry &botRegistry,
+                                    const HashRegistry &mapRegistry,
+                                    const GeneratorConfig &config) :
+    bots(botRegistry.size(), true), maps(mapRegistry.size(), true), shard(config.shard),
+    shardCount(std::max(1u, config.shardCount)), durations(config.durations),
+    matrix(botRegistry.size(), mapRegistry.size(), config.shard, config.shardCount),
+    finishedBots(botRegistry.size()), maxCopies(std::max<uint16_t>(1, config.maxCopies)),
+    gameIds(config.gameIds ? config.gameIds : &ownGameIds) {
+  // A shard may not own any matchups for some bots, they're done before we start
+  for (BotId bot = 0; bot < botRegistry.size(); ++bot)
+    if (matrix.isFinished(bot))
+      finishedBots.set(bot);
+
+  // Every map of every matchup we own still has all of its games to give out
+  for (BotId bot1 = 1; bot1 < botRegistry.size(); ++bot1)
+    for (BotId bot0 = 0; bot0 < bot1; ++bot0)
+      if (MatchupMatrix::shardOf(bot0, bot1, shardCount) == shard)
+        unissued += (uint64_t) mapRegistry.size() * numGames;
 }
 
-sc2tm::GameGenerator::Matchup::Matchup(SHA256Hash::ptr b0, SHA256Hash::ptr b1) :
-    bot0(SHA256Hash::compare(b0, b1) < 0 ? b0 : b1),
-    bot1(SHA256Hash::compare(b0, b1) < 0 ? b1 : b0) { }
+bool sc2tm::GameGenerator::generateGame(Game &game, const IdBitset &cBots,
+                                        const IdBitset &cMaps) {
+  std::lock_guard<std::mutex> lock(mutex);
 
-bool sc2tm::GameGenerator::Matchup::contains(const SHA256Hash::ptr bot) const {
-  return SHA256Hash::compare(bot, bot0) == 0 || SHA256Hash::compare(bot, bot1) == 0;
-}
+  IdBitset usableBots, usableMaps;
+  if (!usableSets(cBots, cMaps, usableBots, usableMaps))
+    return false;
 
-uint8_t sc2tm::GameGenerator::Matchup::indexOf(const SHA256Hash::ptr bot) const {
-  assert(contains(bot));
-  if (SHA256Hash::compare(bot, bot0) == 0)
-    return 0;
-  return 1;
+  return generateUsable(game, usableBots, usableMaps);
 }
 
+void sc2tm::GameGenerator::generateGames(std::vector<GameRequest> &requests) {
+  std::lock_guard<std::mutex> lock(mutex);
 
-// TODO We need to lock this when multithreading happens
-bool sc2tm::GameGenerator::generateGame(Game &game, HashSet cBots, HashSet cMaps){
-  // Get the bots and maps that the client and us have in common
-  // Use temporary scopes to destroy the extra hash sets we make during intersection and subtraction
-  {
-    // Bots
-    HashSet botInter;
-    std::set_intersection(bots.begin(), bots.end(),
-                          cBots.begin(), cBots.end(),
-                          std::inserter(botInter, botInter.end()),
-                          CompareHashPtrFtor());
-
-    HashSet unfinishedBots;
-    std::set_difference(botInter.begin(), botInter.end(),
-                        finishedBots.begin(), finishedBots.end(),
-                        std::inserter(unfinishedBots, unfinishedBots.end()),
-                        CompareHashPtrFtor());
-
-    // Assign over the input set
-    cBots = unfinishedBots;
+  // Work out what each waiting client could play, dropping those with nothing in common with us
+  std::vector<uint32_t> waiting;
+  std::vector<IdBitset> usableBots(requests.size()), usableMaps(requests.size());
+  for (uint32_t i = 0; i < requests.size(); ++i)
+    if (!requests[i].found &&
+        usableSets(*requests[i].bots, *requests[i].maps, usableBots[i], usableMaps[i]))
+      waiting.push_back(i);
+
+  if (waiting.empty())
+    return;
+
+  // Least flexible clients first, they have the fewest ways of being served
+  auto flexibility = [&] (uint32_t i) { return usableBots[i].count() * usableMaps[i].count(); };
+  std::stable_sort(waiting.begin(), waiting.end(),
+                   [&] (uint32_t a, uint32_t b) { return flexibility(a) < flexibility(b); });
+
+  // Match the clients against the games left in the active maps. The generator keeps those few,
+  // so the graph is small.
+  std::vector<MatchupMatrix::Slot> slots(matrix.readySlots().begin(), matrix.readySlots().end());
+  std::vector<uint32_t> capacity;
+  capacity.reserve(slots.size());
+  for (const MatchupMatrix::Slot &slot : slots)
+    capacity.push_back(matrix.find(slot.bot0, slot.bot1)->counters[slot.map].left);
+
+  std::vector<std::vector<uint32_t>> adj(waiting.size());
+  for (uint32_t w = 0; w < waiting.size(); ++w) {
+    const IdBitset &cBots = usableBots[waiting[w]];
+    const IdBitset &cMaps = usableMaps[waiting[w]];
+    for (uint32_t s = 0; s < slots.size(); ++s)
+      if (cBots.test(slots[s].bot0) && cBots.test(slots[s].bot1) && cMaps.test(slots[s].map))
+        adj[w].push_back(s);
+  }
+
+  // The matcher fills free slots in order, so put the longest games first if that's what we want
+  if (durations) {
+    std::vector<float> seconds;
+    seconds.reserve(slots.size());
+    for (const MatchupMatrix::Slot &slot : slots)
+      seconds.push_back(durations->estimate(slot.bot0, slot.bot1, slot.map));
+    for (std::vector<uint32_t> &fits : adj)
+      std::stable_sort(fits.begin(), fits.end(),
+                       [&] (uint32_t a, uint32_t b) { return seconds[a] > seconds[b]; });
+  }
+
+  SlotMatcher matcher(adj, capacity);
+  for (uint32_t w = 0; w < waiting.size(); ++w)
+    matcher.add(w);
+
+  // Hand out the matched games
+  std::vector<uint32_t> served, unserved;
+  for (uint32_t w = 0; w < waiting.size(); ++w) {
+    uint32_t s = matcher.match[w];
+    if (s == UINT32_MAX) {
+      unserved.push_back(waiting[w]);
+      continue;
+    }
+
+    GameRequest &request = requests[waiting[w]];
+    request.game.bot0 = slots[s].bot0;
+    request.game.bot1 = slots[s].bot1;
+    request.game.map = slots[s].map;
+    request.found = true;
+    matrix.takeGame(*matrix.find(slots[s].bot0, slots[s].bot1), slots[s].map);
+    issue(request.game);
+    served.push_back(waiting[w]);
   }
 
-  {
-    // Maps
-    HashSet mapInter;
-    std::set_intersection(maps.begin(), maps.end(),
-                          cMaps.begin(), cMaps.end(),
-                          std::inserter(mapInter, mapInter.end()),
-                          CompareHashPtrFtor());
+  // Everyone left needs new work started for them, still least flexible first
+  for (uint32_t i : unserved) {
+    GameRequest &request = requests[i];
+    request.found = generateUsable(request.game, usableBots[i], usableMaps[i]);
+    if (request.found) {
+      served.push_back(i);
+      continue;
+    }
+
+    // Nothing could be started for this client. One last try: if a served client could play
+    // this one's game and can have new work started for itself, swap.
+    for (uint32_t j : served) {
+      GameRequest &other = requests[j];
+      if (!usableBots[i].test(other.game.bot0) || !usableBots[i].test(other.game.bot1) ||
+          !usableMaps[i].test(other.game.map))
+        continue;
+
+      Game replacement;
+      if (!generateUsable(replacement, usableBots[j], usableMaps[j]))
+        continue;
 
-    // Assign over the input set
-    cMaps = mapInter;
+      request.game = other.game;
+      request.found = true;
+      other.game = replacement;
+      break;
+    }
   }
+}
+
+bool sc2tm::GameGenerator::generateBackup(Game &game, const IdBitset &cBots,
+                                          const IdBitset &cMaps) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  IdBitset usableBots, usableMaps;
+  if (!usableSets(cBots, cMaps, usableBots, usableMaps))
+    return false;
+
+  return copyOutstanding(game, usableBots, usableMaps);
+}
+
+uint64_t sc2tm::GameGenerator::unissuedCount() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return unissued;
+}
+
+bool sc2tm::GameGenerator::usableSets(const IdBitset &cBots, const IdBitset &cMaps,
+                                      IdBitset &usableBots, IdBitset &usableMaps) const {
+  // Get the bots and maps that the client and us have in common. These are a few words each so
+  // the copies are cheap.
+  usableBots = cBots & bots;
+  usableBots.andNot(finishedBots);
+  usableMaps = cMaps & maps;
 
   // If there's not enough bots for a matchup or a single map to play on then there's no games
   // to give out for this client.
-  if (cBots.size() < 2 || cMaps.empty())
+  return usableBots.count() >= 2 && usableMaps.any();
+}
+
+bool sc2tm::GameGenerator::generateUsable(Game &game, const IdBitset &cBots,
+                                          const IdBitset &cMaps) {
+  // Try to find a matchup in the active matches from our list of common bots. If we don't find an
+  // already active matchup that this client could participate in, we'll try scheduling a new map
+  // for an existing matchup. Couldn't find an existing matchup and new map, time to just see what
+  // sticks and generate an entirely new matchup. If this fails there's no new work for the client.
+  if (!generateActiveMap(game, cBots, cMaps) &&
+      !generateActiveMatchup(game, cBots, cMaps) &&
+      !generateNewMatchup(game, cBots, cMaps))
     return false;
 
-  // Try to find a matchup in the active matches from our list of common bots
-  if (generateActiveMap(game, cBots, cMaps))
-    return true;
+  issue(game);
+  return true;
+}
 
-  // Well we didn't find an already active matchup that this client could participate in, so we'll
-  // try scheduling a new map for an existing matchup.
-  if (generateActiveMatchup(game, cBots, cMaps))
+sc2tm::MatchupMatrix::Cell *sc2tm::GameGenerator::findOut(const Game &game) {
+  if (game.bot0 == game.bot1 || game.bot0 >= bots.size() || game.bot1 >= bots.size() ||
+      game.map >= maps.size())
+    return nullptr;
+
+  // Only an active map with games handed out and not yet confirmed can take a result
+  MatchupMatrix::Cell *cell = matrix.find(game.bot0, game.bot1);
+  if (!cell || !cell->activeMaps.test(game.map))
+    return nullptr;
+  const MatchupMatrix::GameCounter &counter = cell->counters[game.map];
+  return counter.left < counter.done ? cell : nullptr;
+}
+
+bool sc2tm::GameGenerator::copyOutstanding(Game &game, const IdBitset &cBots,
+                                           const IdBitset &cMaps) {
+  // Oldest first, those are the ones most likely to be stuck
+  for (auto &entry : outstanding) {
+    Outstanding &out = entry.second;
+    if (out.copies >= maxCopies || !cBots.test(out.game.bot0) || !cBots.test(out.game.bot1) ||
+        !cMaps.test(out.game.map))
+      continue;
+
+    ++out.copies;
+    game = out.game;
     return true;
+  }
 
-  // Couldn't find an existing matchup and new map, time to just see what sticks and generate an
-  // entirely new matchup. If this fails there's no hope for the client.
-  return generateNewMatchup(game, cBots, cMaps);
+  return false;
 }
 
-bool sc2tm::GameGenerator::generateActiveMap(Game &game, HashSet cBots, HashSet cMaps) {
-  // Want end0 to be one before, because the opponent for the second last bot is the last one
-  for (auto botIt0 = cBots.begin(), end0 = std::prev(cBots.end()); botIt0 != end0; ++botIt0) {
-    for (auto botIt1 = std::next(botIt0), end1 = cBots.end(); botIt1 != end1; ++botIt1) {
-      // Make the matchup and try to find it in the map
-      Matchup matchup(*botIt0, *botIt1);
-      auto activePairIt = active.find(matchup);
-
-      // If we found a matchup we need to find an active map that we also have in common
-      if (activePairIt != active.end()) {
-        for (const auto &map : cMaps) {
-          CounterMap &activeMaps = activePairIt->second;
-
-          // Try to find the map in the counter map that still has games left
-          auto counterIt = activeMaps.find(map);
-          if (counterIt != activeMaps.end() && counterIt->second.left > 0) {
-            // Found a match to give out!
-            // Fill in the game
-            game.bot0 = matchup.bot0;
-            game.bot1 = matchup.bot1;
-            game.map = map;
-
-            // Decrement the game counter
-            --counterIt->second.left;
-
-            // Notify success
-            return true;
-          }
-        }
-      }
+void sc2tm::GameGenerator::issue(Game &game) {
+  game.id = gameIds->fetch_add(1);
+  --unissued;
+  if (maxCopies > 1)
+    outstanding.emplace(game.id, Outstanding{game, 1});
+}
+
+bool sc2tm::GameGenerator::generateActiveMap(Game &game, const IdBitset &cBots,
+                                             const IdBitset &cMaps) {
+  // Walk the slots that still have games to give out. They're ordered the same way as the client's
+  // bot pairs would be, and the generator keeps them few, so the first one usually fits. When
+  // we're handing out the longest games first we have to look at all of them though.
+  const MatchupMatrix::Slot *best = nullptr;
+  float bestSeconds = -1;
+  for (const MatchupMatrix::Slot &slot : matrix.readySlots()) {
+    if (!cBots.test(slot.bot0) || !cBots.test(slot.bot1) || !cMaps.test(slot.map))
+      continue;
+
+    if (!durations) {
+      best = &slot;
+      break;
+    }
+
+    float seconds = durations->estimate(slot.bot0, slot.bot1, slot.map);
+    if (seconds > bestSeconds) {
+      best = &slot;
+      bestSeconds = seconds;
     }
   }
 
   // Failure
-  return false;
+  if (!best)
+    return false;
+
+  // Found a match to give out!
+  // Fill in the game
+  game.bot0 = best->bot0;
+  game.bot1 = best->bot1;
+  game.map = best->map;
+
+  // Take a game from the counter, this may drop the slot so it can't be used after
+  MatchupMatrix::Cell *cell = matrix.find(game.bot0, game.bot1);
+  assert(cell);
+  matrix.takeGame(*cell, game.map);
+
+  // Notify success
+  return true;
 }
 
-bool sc2tm::GameGenerator::generateActiveMatchup(Game &game, HashSet cBots, HashSet cMaps) {
-  for (auto botIt0 = cBots.begin(), end0 = std::prev(cBots.end()); botIt0 != end0; ++botIt0) {
-    for (auto botIt1 = std::next(botIt0), end1 = cBots.end(); botIt1 != end1; ++botIt1) {
-      // Make the matchup
-      Matchup matchup(*botIt0, *botIt1);
+bool sc2tm::GameGenerator::generateActiveMatchup(Game &game, const IdBitset &cBots,
+                                                 const IdBitset &cMaps) {
+  MatchupMatrix::Cell *best = nullptr;
+  MapId bestMap = invalidHashId;
+  float bestSeconds = -1;
+  for (const MatchupMatrix::Matchup &matchup : matrix.activeMatchups()) {
+    // The client needs both bots to play the matchup
+    if (!cBots.test(matchup.first) || !cBots.test(matchup.second))
+      continue;
+
+    MatchupMatrix::Cell *cell = matrix.find(matchup.first, matchup.second);
+    assert(cell);
+
+    // Work out which of the client's maps this matchup could start. We subtract the set of
+    // currently active maps from the set of usable maps. This may seem like an odd thing to do
+    // because getting into this function means that we were unable to find an active map to
+    // participate in, but this could just mean that there's an active map with all instances
+    // currently sent out. Maps that have finished can't be started again either.
+    IdBitset usableMaps = cMaps;
+    usableMaps.andNot(cell->activeMaps);
+    usableMaps.andNot(cell->finishedMaps);
+
+    // If we don't have any usable maps, just move onto another matchup
+    MapId map = longestMap(usableMaps);
+    if (map == invalidHashId)
+      continue;
+
+    // Good new everyone! We found a usable map! Unless we're looking for the longest game that's
+    // all we need.
+    if (!durations) {
+      best = cell;
+      bestMap = map;
+      break;
+    }
 
-      // Find the match up in the active and finished sets
-      auto activePairIt = active.find(matchup);
-      auto finishedIt = finished.find(matchup);
+    float seconds = durations->estimate(cell->bot0, cell->bot1, map);
+    if (seconds > bestSeconds) {
+      best = cell;
+      bestMap = map;
+      bestSeconds = seconds;
+    }
+  }
 
-      // If the match up wasn't in either set then move on because it has never been scheduled
-      // before
-      if (activePairIt == active.end() && finishedIt == finished.end())
-        continue;
+  // Failure
+  if (!best)
+    return false;
 
-      // If we found an active matchup we subtract the set of currently active maps from the set
-      // of usable maps. This may seem like an odd thing to do because getting into this function
-      // means that we were unable to find an active map to participate in, but this could just
-      // mean that there's an active map with all instances currently sent out.
-      if (activePairIt != active.end()) {
-        // Build a set of active maps
-        HashSet activeMaps;
-        for (const auto &pair : activePairIt->second)
-          activeMaps.insert(pair.first);
-
-        // Subtract active maps from the set of all maps
-        HashSet nonActiveMaps;
-        std::set_difference(cMaps.begin(), cMaps.end(),
-                            activeMaps.begin(), activeMaps.end(),
-                            std::inserter(nonActiveMaps, nonActiveMaps.end()),
-                            CompareHashPtrFtor());
-
-        // Assign this resulting set over cMaps for use by the next section if there's games in the
-        // finished map or straight by the generator in the final section
-        cMaps = nonActiveMaps;
-      }
+  // Put it in the schedule and take a game away, then send the game off.
+  // TODO maybe get the game count from a game generator arg
+  matrix.startMap(*best, bestMap, numGames);
+  matrix.takeGame(*best, bestMap);
+
+  // Fill the game in
+  game.bot0 = best->bot0;
+  game.bot1 = best->bot1;
+  game.map = bestMap;
+
+  // Tell them of our successes
+  return true;
+}
 
-      // If we found the matchup in the finished set then we should subtract these maps from the
-      // usable map set
-      if (finishedIt != finished.end()) {
-        // The set of maps that are finished for this match up
-        const HashSet &finishedMaps = finishedIt->second;
-
-        // Subtract finished maps from set of all maps
-        HashSet nonFinishedMaps;
-        std::set_difference(cMaps.begin(), cMaps.end(),
-                            finishedMaps.begin(), finishedMaps.end(),
-                            std::inserter(nonFinishedMaps, nonFinishedMaps.end()),
-                            CompareHashPtrFtor());
-
-        // Assign this resulting set over cMaps for use by the next section
-        cMaps = nonFinishedMaps;
+bool sc2tm::GameGenerator::generateNewMatchup(Game &game, const IdBitset &cBots,
+                                              const IdBitset &cMaps) {
+  // Now try to find a matchup that hasn't been started. Each bot knows which opponents it hasn't
+  // started with, so we only need the first one the client also has. Lower opponents were already
+  // tried when they were bot0.
+  BotId bot0 = invalidHashId, bot1 = invalidHashId;
+  if (!durations) {
+    for (BotId bot = cBots.first(); bot != invalidHashId; bot = cBots.next(bot + 1)) {
+      bot1 = matrix.unstartedOpponents(bot).nextCommon(cBots, bot + 1);
+      if (bot1 != invalidHashId) {
+        bot0 = bot;
+        break;
       }
+    }
+  }
+  // When we want the longest games first, pair the slowest bot that has an opponent left with its
+  // slowest opponent.
+  else {
+    float bestFactor = -1;
+    for (BotId bot = cBots.first(); bot != invalidHashId; bot = cBots.next(bot + 1)) {
+      float factor = durations->botFactor(bot);
+      if (factor <= bestFactor)
+        continue;
 
-      // If we don't have any usable maps, just move onto another matchup
-      if (cMaps.empty())
+      BotId opponent = slowestBot(matrix.unstartedOpponents(bot), cBots);
+      if (opponent == invalidHashId)
         continue;
 
-      // Good new everyone! We found a usable map!
-      // Put it in the schedule and then send the game off.
-      // Get the map we're going to schedule.
-      assert(!cMaps.empty());
-      SHA256Hash::ptr map = *cMaps.begin();
-
-      // Ensure that we haven't screwed up and are trying to schedule a map that is already
-      // scheduled
-      assert(active[matchup].find(map) == active[matchup].end());
-
-      // TODO maybe get the game count from a game generator arg
-      // Put a new game counter in and take a game away.
-      // Note that we can't use the CounterMap's operator[] because it requires the value type
-      // to have a default constructor. Find still works fine.
-      GameCounter counter(numGames);
-      --counter.left;
-      active[matchup].emplace(map, counter);
-
-      // Fill the game in
-      game.bot0 = matchup.bot0;
-      game.bot1 = matchup.bot1;
-      game.map = map;
-
-      // Tell them of our successes
-      return true;
+      bot0 = bot;
+      bot1 = opponent;
+      bestFactor = factor;
     }
   }
 
   // Failure
-  return false;
-}
-
-bool sc2tm::GameGenerator::generateNewMatchup(Game &game, HashSet cBots, HashSet cMaps) {
-  // Build the set of matchups that are in the active map
-  MatchupSet activeMatchups;
-  for (const auto &matchup : active)
-    activeMatchups.insert(matchup.first);
-
-  // Add matchups that are in the finished map (union), all of these matchups are "active"
-  for (const auto &matchup : finished)
-    activeMatchups.insert(matchup.first);
-
-  // Now try to find a matchup that isn't active
-  for (auto botIt0 = cBots.begin(), end0 = std::prev(cBots.end()); botIt0 != end0; ++botIt0) {
-    for (auto botIt1 = std::next(botIt0), end1 = cBots.end(); botIt1 != end1; ++botIt1) {
-      // Make the matchup
-      Matchup matchup(*botIt0, *botIt1);
-
-      // If the matchup exists in the active set we just want to move on
-      auto activeIt = activeMatchups.find(matchup);
-      if (activeIt != activeMatchups.end())
-        continue;
+  if (bot0 == invalidHashId)
+    return false;
 
-      // Now we've found a matchup that hasn't started! Start it!
-      // Create counter and take a game from it
-      GameCounter counter(numGames);
-      --counter.left;
+  // Get our map
+  MapId map = longestMap(cMaps);
+  assert(map != invalidHashId); // Need at least one map
 
-      // Get our map
-      assert(!cMaps.empty()); // Need at least one map
-      SHA256Hash::ptr map = *cMaps.begin();
+  // Now we've found a matchup that hasn't started! Start it, and its first map, and take a
+  // game from it.
+  MatchupMatrix::Cell &cell = matrix.start(bot0, bot1);
+  matrix.startMap(cell, map, numGames);
+  matrix.takeGame(cell, map);
 
-      // Create a CounterMap with the map and counter
-      CounterMap counterMap;
-      counterMap.emplace(map, counter);
+  // Fill in the game
+  game.bot0 = cell.bot0;
+  game.bot1 = cell.bot1;
+  game.map = map;
 
-      // Place the counter map into the active map with our matchup
-      active.emplace(matchup, counterMap);
+  // We succeeded!
+  return true;
+}
 
-      // Fill in the game
-      game.bot0 = matchup.bot0;
-      game.bot1 = matchup.bot1;
-      game.map = map;
+sc2tm::MapId sc2tm::GameGenerator::longestMap(const IdBitset &cMaps) const {
+  if (!durations)
+    return cMaps.first();
+
+  MapId best = invalidHashId;
+  float bestSeconds = -1;
+  for (MapId map = cMaps.first(); map != invalidHashId; map = cMaps.next(map + 1)) {
+    float seconds = durations->mapEstimate(map);
+    if (seconds > bestSeconds) {
+      best = map;
+      bestSeconds = seconds;
+    }
+  }
+  return best;
+}
 
-      // We succeeded!
-      return true;
+sc2tm::BotId sc2tm::GameGenerator::slowestBot(const IdBitset &opponents,
+                                              const IdBitset &cBots) const {
+  BotId best = invalidHashId;
+  float bestFactor = -1;
+  for (BotId bot = opponents.nextCommon(cBots, 0); bot != invalidHashId;
+       bot = opponents.nextCommon(cBots, bot + 1)) {
+    float factor = durations->botFactor(bot);
+    if (factor > bestFactor) {
+      best = bot;
+      bestFactor = factor;
     }
   }
+  return best;
 }
 
-// TODO We need to lock this when multithreading happens
 // This is fairly easy to begin with, just decrement the done counter for the matchup and map.
 // However, if we find that done has hit zero we need to move the map to the finished list. Further,
 // if a bot has competed against every bot and finished every map then it should be moved to the
 // finishedBots set.
-void sc2tm::GameGenerator::notifySuccess(const Game &game) {
-  Matchup matchup(game.bot0, game.bot1);
+uint16_t sc2tm::GameGenerator::notifySuccess(const Game &game) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  // Only the first copy of a game to succeed counts
+  if (maxCopies > 1) {
+    auto it = outstanding.find(game.id);
+    if (it == outstanding.end())
+      return 0;
+    outstanding.erase(it);
+  }
 
-  // Find the matchup/CounterMap pair in the map
-  auto activeIt = active.find(matchup);
-  assert(activeIt != active.end()); // If it's failing, it must be active
+  // Find the map's counter. A result for a game that isn't out, one we never handed out or
+  // adopted, or one from a map that's already finished, is ignored.
+  MatchupMatrix::Cell *cell = findOut(game);
+  if (!cell)
+    return 0;
+  MatchupMatrix::GameCounter &counter = cell->counters[game.map];
 
-  // Find the map/GameCounter pair in the map
-  auto &counterMap = activeIt->second;
-  auto counterIt = counterMap.find(game.map);
-  assert(counterIt != counterMap.end());
+  // If the done counter is greater than one then all we need to do is decrement and move on
+  if (counter.done > 1) {
+    --counter.done;
+    return (uint16_t) (numGames - counter.done);
+  }
 
-  // If the left counter is greater than one then all we need to do is decrement and move on
-  if (counterIt->second.done > 1) {
-    --counterIt->second.done;
-    return;
+  // But if it is one then we need to move this map to finished, and maybe the whole matchup
+  if (matrix.finishMap(*cell, game.map))
+    finishedMatchups.emplace_back(std::min(game.bot0, game.bot1), std::max(game.bot0, game.bot1));
+
+  // That may have been the last (opponent, map) pair for one of the bots, in which case it's
+  // "done". The matrix counts these down as maps finish so this is just a check.
+  if (matrix.isFinished(game.bot0))
+    finishedBots.set(game.bot0);
+  if (matrix.isFinished(game.bot1))
+    finishedBots.set(game.bot1);
+  return (uint16_t) numGames;
+}
+
+// This is actually fairly easy, just find the matchup's counter so that we can increment the left
+// counter
+bool sc2tm::GameGenerator::notifyFail(const Game &game) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  // Ignore a copy of a game that's already succeeded, and don't give the game back while another
+  // copy could still succeed
+  if (maxCopies > 1) {
+    auto it = outstanding.find(game.id);
+    if (it == outstanding.end())
+      return false;
+    if (--it->second.copies > 0)
+      return false;
+    outstanding.erase(it);
   }
 
-  // But if it is one (or zero, but that should never happen because it should've been removed) then
-  // we need to move this map to the finished map
-  // It shouldn't have ended before
-  assert(finished[matchup].find(game.map) == finished[matchup].end());
-  finished[matchup].insert(game.map);
-
-  // Remove it from the active map. We can use the iterator here to save the map having to find it
-  // again.
-  counterMap.erase(counterIt);
-
-  // Now we begin the process of checking if one of the bots is done. This is kind of complicated.
-  // Either or both of the bots could be "done". Build sets of the bots that each bot is done
-  // (i.e. played every map) against. Because this is such a long process, we're going to try and
-  // leave at every opportunity.
-  HashSet bot0Done; // The set of bots that bot0 has finished against
-  HashSet bot1Done; // The set of bots that bot1 has finished against
-  bool bot0Fail = false; // Whether or not bot0 has already failed to be "done"
-  bool bot1Fail = false; // Whether or not bot1 has already failed to be "done"
-  for (const auto &finishedPair : finished) {
-    const Matchup &finishedMatchup = finishedPair.first;
-    const HashSet &finishedMaps = finishedPair.second;
-
-    // First check if this bot already failed, then check if bot0 was either of the bots in this
-    // matchup
-    if (!bot0Fail && finishedMatchup.contains(game.bot0)) {
-      // We check size here rather than comparing values. I'm fairly certain that we can't "finish"
-      // a map that the GameGenerator doesn't have. If we have the same number of maps then this
-      // matchup is "done"
-      // TODO Add some debug only code that does per element comparison rather than size comparison
-      if (finishedMaps.size() == maps.size())
-        bot0Done.insert(finishedMatchup.indexOf(game.bot0) == 0 ?
-                        finishedMatchup.bot1 : finishedMatchup.bot0);
-      // We found a matchup that isn't done and don't need to keep checking
-      else
-        bot0Fail = true;
-    }
+  // Find the matchup's cell, ignoring games that aren't out
+  MatchupMatrix::Cell *cell = findOut(game);
+  if (!cell)
+    return false;
+
+  // Give the game back to the map's counter
+  matrix.returnGame(*cell, game.map);
+  ++unissued;
+  return true;
+}
 
-    // Check if bot1 was either of the bots in this matchup
-    if (!bot1Fail && finishedMatchup.contains(game.bot1)) {
-      // We check size here rather than comparing values. I'm fairly certain that we can't "finish"
-      // a map that the GameGenerator doesn't have. If we have the same number of maps then this
-      // matchup is "done"
-      // TODO Add some debug only code that does per element comparison rather than size comparison
-      if (finishedMaps.size() == maps.size())
-        bot1Done.insert(finishedMatchup.indexOf(game.bot1) == 0 ?
-                        finishedMatchup.bot0 : finishedMatchup.bot1);
-      // We found a matchup that isn't done and don't need to keep checking
-      else
-        bot1Fail = true;
+void sc2tm::GameGenerator::snapshot(std::vector<Progress> &progress) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  // Finished matchups have collapsed to a bit, so we keep our own list of them rather than walk
+  // every shard's part of the triangle
+  for (const MatchupMatrix::Matchup &matchup : finishedMatchups)
+    progress.push_back(Progress{matchup.first, matchup.second, invalidHashId, (uint16_t) numGames});
+
+  // Active matchups have their per map counters
+  for (const MatchupMatrix::Matchup &matchup : matrix.activeMatchups()) {
+    const MatchupMatrix::Cell &cell = *matrix.find(matchup.first, matchup.second);
+    for (MapId map = 0; map < maps.size(); ++map) {
+      if (cell.finishedMaps.test(map))
+        progress.push_back(Progress{cell.bot0, cell.bot1, map, (uint16_t) numGames});
+      else if (cell.activeMaps.test(map) && cell.counters[map].done < numGames)
+        progress.push_back(Progress{cell.bot0, cell.bot1, map,
+                                    (uint16_t) (numGames - cell.counters[map].done)});
     }
+  }
+}
 
-    // Both bots failed to be done, just leave
-    if (bot0Fail && bot1Fail)
-      return;
+void sc2tm::GameGenerator::restore(const Progress &progress) {
+  std::lock_guard<std::mutex> lock(mutex);
+
+  if (progress.bot0 == progress.bot1 || progress.bot0 >= bots.size() ||
+      progress.bot1 >= bots.size() || progress.played == 0 ||
+      MatchupMatrix::shardOf(progress.bot0, progress.bot1, shardCount) != shard ||
+      matrix.isFinished(progress.bot0, progress.bot1))
+    return;
+
+  MatchupMatrix::Cell *cell = matrix.find(progress.bot0, progress.bot1);
+  if (!cell)
+    cell = &matrix.start(progress.bot0, progress.bot1);
+
+  // Either bring one map up or, for a finished matchup, all of them
+  if (progress.map != invalidHashId) {
+    if (progress.map < maps.size())
+      restoreMap(*cell, progress.map, progress.played);
+  }
+  else {
+    for (MapId map = 0; map < maps.size(); ++map)
+      if (restoreMap(*cell, map, (uint16_t) numGames))
+        break;
   }
 
-  // So we get here meaning that one of the bots had all of their matchups "done", but that doesn't
-  // mean they had *all* matchups. Better check that..
-  if (!bot0Fail)
-    bot0Fail = bot0Done.size() == (bots.size() - 1); // -1 for self
+  if (matrix.isFinished(progress.bot0))
+    finishedBots.set(progress.bot0);
+  if (matrix.isFinished(progress.bot1))
+    finishedBots.set(progress.bot1);
+}
 
-  if (!bot1Fail)
-    bot1Fail = bot1Done.size() == (bots.size() - 1); // -1 for self
+void sc2tm::GameGenerator::adopt(const Game &game) {
+  std::lock_guard<std::mutex> lock(mutex);
 
-  // Both bots fail, we can leave now
-  if (bot0Fail && bot1Fail)
+  if (game.bot0 == game.bot1 || game.bot0 >= bots.size() || game.bot1 >= bots.size() ||
+      game.map >= maps.size() ||
+      MatchupMatrix::shardOf(game.bot0, game.bot1, shardCount) != shard ||
+      matrix.isFinished(game.bot0, game.bot1))
     return;
 
-  // Getting here means that one of the bots is actually done. That means we need to clean it out of
-  // the other two maps and add it to the finishedBots.
-  // Check if either of them passed. If they did, add them to the finished set
-  if (!bot0Fail)
-    finishedBots.insert(game.bot0);
-  if (!bot1Fail)
-    finishedBots.insert(game.bot1);
-
-  // Now generate every matchup and remove it from the active/finished maps
-  for (const auto &bot : bots) {
-    // If we didn't fail and this isn't a self matchup, clear it out
-    if (!bot0Fail && SHA256Hash::compare(game.bot0, bot) != 0) {
-      // Delete this matchup
-      Matchup purgeable(game.bot0, bot);
-      active.erase(purgeable);
-      finished.erase(purgeable);
-    }
+  // New games must not reuse the ids of the ones being played, in any shard
+  GameId next = gameIds->load();
+  while (next <= game.id && !gameIds->compare_exchange_weak(next, game.id + 1));
 
-    if (!bot1Fail && SHA256Hash::compare(game.bot1, bot) != 0) {
-      // Delete this matchup
-      Matchup purgeable(game.bot1, bot);
-      active.erase(purgeable);
-      finished.erase(purgeable);
+  // Another copy of a game we've already adopted
+  if (maxCopies > 1) {
+    auto it = outstanding.find(game.id);
+    if (it != outstanding.end()) {
+      ++it->second.copies;
+      return;
     }
   }
-}
 
-// TODO We need to lock this when multithreading happens
-// This is actually fairly easy, just make up the matchup and use the map to get the counter so
-// that we can increment the left counter
-void sc2tm::GameGenerator::notifyFail(const Game &game) {
-  Matchup matchup(game.bot0, game.bot1);
+  MatchupMatrix::Cell *cell = matrix.find(game.bot0, game.bot1);
+  if (!cell)
+    cell = &matrix.start(game.bot0, game.bot1);
+  if (cell->finishedMaps.test(game.map))
+    return;
+  if (!cell->activeMaps.test(game.map))
+    matrix.startMap(*cell, game.map, numGames);
+  if (cell->counters[game.map].left == 0)
+    return;
 
-  // Find the matchup/CounterMap pair in the map
-  auto activeIt = active.find(matchup);
-  assert(activeIt != active.end()); // If it's failing, it must be active
+  matrix.takeGame(*cell, game.map);
+  --unissued;
+  if (maxCopies > 1)
+    outstanding.emplace(game.id, Outstanding{game, 1});
+}
+
+bool sc2tm::GameGenerator::restoreMap(MatchupMatrix::Cell &cell, MapId map, uint16_t played) {
+  if (cell.finishedMaps.test(map))
+    return false;
+  if (!cell.activeMaps.test(map))
+    matrix.startMap(cell, map, numGames);
+
+  // Nothing is out being played yet, so take and confirm games until we've caught up
+  MatchupMatrix::GameCounter &counter = cell.counters[map];
+  played = std::min<uint16_t>(played, (uint16_t) numGames);
+  if (numGames - counter.done < played)
+    unissued -= played - (numGames - counter.done);
+  while (numGames - counter.done < played && counter.done > 1) {
+    matrix.takeGame(cell, map);
+    --counter.done;
+  }
 
-  // Find the map/GameCounter pair in the map
-  auto &counterMap = activeIt->second;
-  auto counterIt = counterMap.find(game.map);
-  assert(counterIt != counterMap.end());
+  if (played < numGames)
+    return false;
 
-  // Increment the left count
-  ++counterIt->second.left;
+  MatchupMatrix::Matchup matchup(cell.bot0, cell.bot1);
+  if (!matrix.finishMap(cell, map))
+    return false;
+  finishedMatchups.push_back(matchup);
+  return true;
 }
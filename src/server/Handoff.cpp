@@ -0,0 +1,356 @@
+#include "server/Handoff.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+namespace {
+
+//! Identifies a handoff, the last byte is the format version.
+const uint8_t handoffMagic[8] = { 'S', 'C', '2', 'T', 'M', 'U', 'P', 4 };
+
+//! The most descriptors passed in one message, the kernel caps it.
+const size_t maxFdsPerMessage = 200;
+
+//! The start of a handoff.
+struct HandoffHeader {
+  uint8_t magic[8];
+  //! The catalog the old process was scheduling.
+  uint8_t catalog[SHA256::DIGEST_SIZE];
+  //! The number of descriptors following, the acceptor and then every connection.
+  uint32_t fdCount;
+  //! The number of progress records following.
+  uint32_t progressCount;
+  //! The number of connections following.
+  uint32_t connectionCount;
+  //! The number of sessions following the connections.
+  uint32_t sessionCount;
+};
+
+//! A progress record.
+struct ProgressRecord {
+  sc2tm::BotId bot0;
+  sc2tm::BotId bot1;
+  sc2tm::MapId map;
+  uint16_t played;
+  uint16_t pad;
+};
+
+//! The fixed part of a connection, followed by its games, bots, maps and pending bytes.
+struct ConnectionRecord {
+  uint32_t id;
+  uint8_t session[16];
+  uint32_t hasSession;
+  sc2tm::GameTicket nextTicket;
+  uint32_t queueDepth;
+  uint32_t gameCount;
+  uint32_t botCount;
+  uint32_t mapCount;
+  uint32_t pendingBytes;
+};
+
+//! The fixed part of a session, followed by its games, bots and maps.
+struct SessionRecord {
+  uint8_t token[16];
+  uint8_t catalog[SHA256::DIGEST_SIZE];
+  uint32_t attached;
+  uint32_t owner;
+  sc2tm::GameTicket nextTicket;
+  uint32_t queueDepth;
+  uint32_t gameCount;
+  uint32_t botCount;
+  uint32_t mapCount;
+};
+
+//! A game record.
+struct GameRecord {
+  sc2tm::GameTicket ticket;
+  sc2tm::BotId bot0;
+  sc2tm::BotId bot1;
+  sc2tm::MapId map;
+  sc2tm::GameId gameId;
+  uint32_t elapsedMs;
+};
+
+#ifndef _WIN32
+bool writeAll(int fd, const void *data, size_t size) {
+  const char *bytes = (const char *) data;
+  while (size > 0) {
+    ssize_t written = ::write(fd, bytes, size);
+    if (written <= 0)
+      return false;
+    bytes += written;
+    size -= (size_t) written;
+  }
+  return true;
+}
+
+bool readAll(int fd, void *data, size_t size) {
+  char *bytes = (char *) data;
+  while (size > 0) {
+    ssize_t got = ::read(fd, bytes, size);
+    if (got <= 0)
+      return false;
+    bytes += got;
+    size -= (size_t) got;
+  }
+  return true;
+}
+
+//! Read a list of games.
+bool readGames(int fd, std::vector<sc2tm::HandoffGame> &games, uint32_t count) {
+  games.resize(count);
+  for (sc2tm::HandoffGame &game : games) {
+    GameRecord record;
+    if (!readAll(fd, &record, sizeof(record)))
+      return false;
+    game.ticket = record.ticket;
+    game.game = sc2tm::Game{record.bot0, record.bot1, record.map, record.gameId};
+    game.elapsed = std::chrono::milliseconds(record.elapsedMs);
+  }
+  return true;
+}
+
+//! Read a list of ids.
+bool readIds(int fd, std::vector<sc2tm::HashId> &ids, uint32_t count) {
+  ids.resize(count);
+  return readAll(fd, ids.data(), ids.size() * sizeof(sc2tm::HashId));
+}
+
+//! Send a batch of descriptors along with a single byte.
+bool sendFds(int sock, const int *fds, size_t count) {
+  char byte = 0;
+  iovec iov{&byte, 1};
+
+  std::vector<char> control(CMSG_SPACE(count * sizeof(int)));
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+
+  cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(count * sizeof(int));
+  std::memcpy(CMSG_DATA(cmsg), fds, count * sizeof(int));
+
+  return ::sendmsg(sock, &msg, 0) == 1;
+}
+
+//! Receive a batch of descriptors sent with sendFds.
+bool receiveFds(int sock, std::vector<int> &fds, size_t most) {
+  char byte;
+  iovec iov{&byte, 1};
+
+  std::vector<char> control(CMSG_SPACE(most * sizeof(int)));
+  msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.data();
+  msg.msg_controllen = control.size();
+
+  if (::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC) != 1 || (msg.msg_flags & MSG_CTRUNC))
+    return false;
+
+  for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    size_t count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    size_t start = fds.size();
+    fds.resize(start + count);
+    std::memcpy(fds.data() + start, CMSG_DATA(cmsg), count * sizeof(int));
+  }
+  return true;
+}
+
+//! Read a whole handoff, collecting the descriptors as they arrive.
+bool readHandoff(int sock, sc2tm::HandoffState &state, std::vector<int> &fds) {
+  HandoffHeader header;
+  if (!readAll(sock, &header, sizeof(header)) ||
+      std::memcmp(header.magic, handoffMagic, sizeof(handoffMagic)) != 0 ||
+      header.fdCount != header.connectionCount + 1)
+    return false;
+  std::memcpy(state.catalog, header.catalog, sizeof(state.catalog));
+
+  while (fds.size() < header.fdCount)
+    if (!receiveFds(sock, fds, std::min<size_t>(maxFdsPerMessage, header.fdCount - fds.size())))
+      return false;
+  if (fds.size() != header.fdCount)
+    return false;
+  state.acceptorFd = fds[0];
+
+  state.progress.resize(header.progressCount);
+  for (sc2tm::GameGenerator::Progress &p : state.progress) {
+    ProgressRecord record;
+    if (!readAll(sock, &record, sizeof(record)))
+      return false;
+    p = sc2tm::GameGenerator::Progress{record.bot0, record.bot1, record.map, record.played};
+  }
+
+  state.connections.resize(header.connectionCount);
+  for (size_t i = 0; i < state.connections.size(); ++i) {
+    sc2tm::HandoffConnection &conn = state.connections[i];
+    ConnectionRecord record;
+    if (!readAll(sock, &record, sizeof(record)))
+      return false;
+
+    conn.id = record.id;
+    conn.fd = fds[i + 1];
+    conn.hasSession = record.hasSession != 0;
+    std::memcpy(conn.session.data(), record.session, conn.session.size());
+    conn.nextTicket = record.nextTicket;
+    conn.queueDepth = (uint8_t) record.queueDepth;
+    conn.pending.resize(record.pendingBytes);
+    if (!readGames(sock, conn.games, record.gameCount) ||
+        !readIds(sock, conn.bots, record.botCount) ||
+        !readIds(sock, conn.maps, record.mapCount) ||
+        !readAll(sock, &conn.pending[0], conn.pending.size()))
+      return false;
+  }
+
+  state.sessions.resize(header.sessionCount);
+  for (sc2tm::HandoffSession &session : state.sessions) {
+    SessionRecord record;
+    if (!readAll(sock, &record, sizeof(record)))
+      return false;
+
+    std::memcpy(session.token.data(), record.token, session.token.size());
+    std::memcpy(session.catalog, record.catalog, sizeof(session.catalog));
+    session.attached = record.attached != 0;
+    session.owner = record.owner;
+    session.nextTicket = record.nextTicket;
+    session.queueDepth = (uint8_t) record.queueDepth;
+    if (!readGames(sock, session.games, record.gameCount) ||
+        !readIds(sock, session.bots, record.botCount) ||
+        !readIds(sock, session.maps, record.mapCount))
+      return false;
+  }
+  return true;
+}
+
+//! Lay out a list of games.
+void appendGames(std::string &body, const std::vector<sc2tm::HandoffGame> &games) {
+  for (const sc2tm::HandoffGame &game : games) {
+    GameRecord record{game.ticket, game.game.bot0, game.game.bot1, game.game.map, game.game.id,
+                      (uint32_t) game.elapsed.count()};
+    body.append((const char *) &record, sizeof(record));
+  }
+}
+
+//! Lay out a list of ids.
+void appendIds(std::string &body, const std::vector<sc2tm::HashId> &ids) {
+  body.append((const char *) ids.data(), ids.size() * sizeof(sc2tm::HashId));
+}
+#endif
+
+} // End anonymous namespace
+
+bool sc2tm::sendHandoff(int sock, const HandoffState &state) {
+#ifdef _WIN32
+  return false;
+#else
+  std::vector<int> fds;
+  fds.push_back(state.acceptorFd);
+  for (const HandoffConnection &conn : state.connections)
+    fds.push_back(conn.fd);
+
+  HandoffHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, handoffMagic, sizeof(handoffMagic));
+  std::memcpy(header.catalog, state.catalog, sizeof(state.catalog));
+  header.fdCount = (uint32_t) fds.size();
+  header.progressCount = (uint32_t) state.progress.size();
+  header.connectionCount = (uint32_t) state.connections.size();
+  header.sessionCount = (uint32_t) state.sessions.size();
+  if (!writeAll(sock, &header, sizeof(header)))
+    return false;
+
+  for (size_t i = 0; i < fds.size(); i += maxFdsPerMessage)
+    if (!sendFds(sock, fds.data() + i, std::min(maxFdsPerMessage, fds.size() - i)))
+      return false;
+
+  // The rest is plain data, lay it out and send it in one go
+  std::string body;
+  for (const GameGenerator::Progress &p : state.progress) {
+    ProgressRecord record{p.bot0, p.bot1, p.map, p.played, 0};
+    body.append((const char *) &record, sizeof(record));
+  }
+  for (const HandoffConnection &conn : state.connections) {
+    ConnectionRecord record;
+    std::memset(&record, 0, sizeof(record));
+    record.id = conn.id;
+    record.hasSession = conn.hasSession;
+    std::memcpy(record.session, conn.session.data(), sizeof(record.session));
+    record.nextTicket = conn.nextTicket;
+    record.queueDepth = conn.queueDepth;
+    record.gameCount = (uint32_t) conn.games.size();
+    record.botCount = (uint32_t) conn.bots.size();
+    record.mapCount = (uint32_t) conn.maps.size();
+    record.pendingBytes = (uint32_t) conn.pending.size();
+    body.append((const char *) &record, sizeof(record));
+    appendGames(body, conn.games);
+    appendIds(body, conn.bots);
+    appendIds(body, conn.maps);
+    body.append(conn.pending);
+  }
+  for (const HandoffSession &session : state.sessions) {
+    SessionRecord record;
+    std::memset(&record, 0, sizeof(record));
+    std::memcpy(record.token, session.token.data(), sizeof(record.token));
+    std::memcpy(record.catalog, session.catalog, sizeof(record.catalog));
+    record.attached = session.attached;
+    record.owner = session.owner;
+    record.nextTicket = session.nextTicket;
+    record.queueDepth = session.queueDepth;
+    record.gameCount = (uint32_t) session.games.size();
+    record.botCount = (uint32_t) session.bots.size();
+    record.mapCount = (uint32_t) session.maps.size();
+    body.append((const char *) &record, sizeof(record));
+    appendGames(body, session.games);
+    appendIds(body, session.bots);
+    appendIds(body, session.maps);
+  }
+  return writeAll(sock, body.data(), body.size());
+#endif
+}
+
+bool sc2tm::receiveHandoff(const std::string &path, HandoffState &state) {
+#ifdef _WIN32
+  return false;
+#else
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (path.size() >= sizeof(addr.sun_path))
+    return false;
+  std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+  int sock = ::socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock < 0)
+    return false;
+  if (::connect(sock, (sockaddr *) &addr, sizeof(addr)) != 0) {
+    ::close(sock);
+    return false;
+  }
+
+  std::vector<int> fds;
+  bool ok = readHandoff(sock, state, fds);
+
+  ::close(sock);
+  if (!ok) {
+    for (int fd : fds)
+      ::close(fd);
+    state.acceptorFd = -1;
+    state.connections.clear();
+  }
+  return ok;
+#endif
+}
@@ -0,0 +1,56 @@
+#include "server/LeaseManager.h"
+
+#include <algorithm>
+#include <vector>
+
+const sc2tm::LeaseManager::LeaseId sc2tm::LeaseManager::invalidLease;
+
+sc2tm::LeaseManager::LeaseManager(boost::asio::io_service &service,
+                                  std::chrono::milliseconds duration,
+                                  std::chrono::milliseconds tick) :
+    tickLength(std::max(tick, std::chrono::milliseconds(1))),
+    start(std::chrono::steady_clock::now()), timer(service) {
+  // Round up so a lease never expires early
+  durationTicks = std::max<uint64_t>(1, (duration.count() + tickLength.count() - 1) /
+                                        tickLength.count());
+  schedule();
+}
+
+sc2tm::LeaseManager::LeaseId sc2tm::LeaseManager::grant(std::function<void()> onExpire) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return wheel.add(durationTicks, std::move(onExpire));
+}
+
+bool sc2tm::LeaseManager::renew(LeaseId lease) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return wheel.reset(lease, durationTicks);
+}
+
+bool sc2tm::LeaseManager::release(LeaseId lease) {
+  std::lock_guard<std::mutex> lock(mutex);
+  return wheel.cancel(lease);
+}
+
+void sc2tm::LeaseManager::schedule() {
+  timer.expires_after(tickLength);
+  timer.async_wait([this] (const boost::system::error_code &error) { tick(error); });
+}
+
+void sc2tm::LeaseManager::tick(const boost::system::error_code &error) {
+  // Only happens if we're being torn down
+  if (error == boost::asio::error::operation_aborted)
+    return;
+
+  // Work out the tick from the clock rather than counting, a busy io thread can make us late
+  std::vector<TimerWheel::Callback> expired;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto elapsed = std::chrono::steady_clock::now() - start;
+    wheel.advance((uint64_t) (elapsed / tickLength), expired);
+  }
+
+  for (TimerWheel::Callback &onExpire : expired)
+    onExpire();
+
+  schedule();
+}
@@ -0,0 +1,134 @@
+#include "server/MatchupMatrix.h"
+
+#include <algorithm>
+#include <cassert>
+
+sc2tm::MatchupMatrix::MatchupMatrix(size_t botCount, size_t mapCount, uint32_t shard,
+                                    uint32_t shardCount) :
+    mapCount(mapCount),
+    started(botCount * (botCount - (botCount > 0)) / 2),
+    finished(botCount * (botCount - (botCount > 0)) / 2),
+    unstarted(botCount, IdBitset(botCount, true)),
+    remaining(botCount, (uint64_t) (botCount - (botCount > 0)) * mapCount) {
+  // A bot can't play itself
+  for (BotId bot = 0; bot < botCount; ++bot)
+    unstarted[bot].reset(bot);
+
+  if (shardCount <= 1)
+    return;
+
+  // Matchups owned by other shards are finished as far as we're concerned. Nobody can start them
+  // here and they don't count towards their bots' remaining work.
+  for (BotId bot1 = 1; bot1 < botCount; ++bot1) {
+    for (BotId bot0 = 0; bot0 < bot1; ++bot0) {
+      if (shardOf(bot0, bot1, shardCount) == shard)
+        continue;
+
+      uint32_t index = cellIndex(bot0, bot1);
+      started.set(index);
+      finished.set(index);
+      unstarted[bot0].reset(bot1);
+      unstarted[bot1].reset(bot0);
+      remaining[bot0] -= mapCount;
+      remaining[bot1] -= mapCount;
+    }
+  }
+}
+
+sc2tm::MatchupMatrix::Cell *sc2tm::MatchupMatrix::find(BotId b0, BotId b1) {
+  // Check the bit first, it's much cheaper than a hash lookup
+  uint32_t index = cellIndex(b0, b1);
+  if (!started.test(index) || finished.test(index))
+    return nullptr;
+
+  auto it = activeIndex.find(index);
+  assert(it != activeIndex.end());
+  return &cells[it->second];
+}
+
+sc2tm::MatchupMatrix::Cell &sc2tm::MatchupMatrix::start(BotId b0, BotId b1) {
+  uint32_t index = cellIndex(b0, b1);
+  assert(!started.test(index));
+  started.set(index);
+  unstarted[b0].reset(b1);
+  unstarted[b1].reset(b0);
+
+  // Reuse a cell if we can, its storage is already the right size
+  uint32_t slot;
+  if (!freeCells.empty()) {
+    slot = freeCells.back();
+    freeCells.pop_back();
+  }
+  else {
+    slot = (uint32_t) cells.size();
+    cells.emplace_back();
+    cells.back().counters.resize(mapCount);
+    cells.back().activeMaps = IdBitset(mapCount);
+    cells.back().finishedMaps = IdBitset(mapCount);
+  }
+  activeIndex.emplace(index, slot);
+
+  Cell &cell = cells[slot];
+  cell.bot0 = std::min(b0, b1);
+  cell.bot1 = std::max(b0, b1);
+  active.emplace(cell.bot0, cell.bot1);
+  return cell;
+}
+
+void sc2tm::MatchupMatrix::startMap(Cell &cell, MapId map, uint16_t games) {
+  assert(!cell.activeMaps.test(map) && !cell.finishedMaps.test(map));
+  cell.activeMaps.set(map);
+  cell.counters[map].left = games;
+  cell.counters[map].done = games;
+  if (games > 0)
+    ready.insert(Slot{cell.bot0, cell.bot1, map});
+}
+
+void sc2tm::MatchupMatrix::takeGame(Cell &cell, MapId map) {
+  assert(cell.activeMaps.test(map));
+  GameCounter &counter = cell.counters[map];
+  assert(counter.left > 0);
+
+  // The last game out means the slot isn't ready anymore
+  if (--counter.left == 0)
+    ready.erase(Slot{cell.bot0, cell.bot1, map});
+}
+
+void sc2tm::MatchupMatrix::returnGame(Cell &cell, MapId map) {
+  assert(cell.activeMaps.test(map));
+  GameCounter &counter = cell.counters[map];
+
+  // The first game back means the slot is ready again
+  if (counter.left++ == 0)
+    ready.insert(Slot{cell.bot0, cell.bot1, map});
+}
+
+bool sc2tm::MatchupMatrix::finishMap(Cell &cell, MapId map) {
+  assert(cell.activeMaps.test(map));
+  cell.activeMaps.reset(map);
+  cell.finishedMaps.set(map);
+  ready.erase(Slot{cell.bot0, cell.bot1, map});
+
+  // Both bots are one (opponent, map) pair closer to done
+  assert(remaining[cell.bot0] > 0 && remaining[cell.bot1] > 0);
+  --remaining[cell.bot0];
+  --remaining[cell.bot1];
+
+  if (cell.finishedMaps.count() != mapCount)
+    return false;
+
+  // Every map is done, collapse the matchup down to its finished bit and recycle the cell
+  uint32_t index = cellIndex(cell.bot0, cell.bot1);
+  finished.set(index);
+
+  auto it = activeIndex.find(index);
+  assert(it != activeIndex.end());
+  uint32_t slot = it->second;
+  activeIndex.erase(it);
+  active.erase(Matchup(cell.bot0, cell.bot1));
+
+  cell.activeMaps = IdBitset(mapCount);
+  cell.finishedMaps = IdBitset(mapCount);
+  freeCells.push_back(slot);
+  return true;
+}
@@ -0,0 +1,253 @@
+#include "server/Replication.h"
+
+#include "common/config.h"
+#include "server/ShardedGameGenerator.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+
+namespace {
+
+//! Identifies the replication stream, the last byte is the format version.
+const uint8_t replicaMagic[8] = { 'S', 'C', '2', 'T', 'M', 'R', 'P', 1 };
+
+//! The most records queued for a standby before it's given up on.
+const size_t maxPending = 1 << 20;
+
+//! The most bytes a standby reads at once.
+const size_t readSize = 64 * 1024;
+
+//! How long a standby waits between attempts to reach the primary.
+const std::chrono::seconds retryDelay(1);
+
+} // End anonymous namespace
+
+sc2tm::ReplicationSource::ReplicationSource(boost::asio::io_service &service,
+                                            ShardedGameGenerator &gen, const SHA256Hash &catalog,
+                                            uint16_t port) :
+    service(service), gen(gen),
+    acceptor(service, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)) {
+  std::memcpy(this->catalog, catalog.get(), SHA256::DIGEST_SIZE);
+  startAccept();
+}
+
+void sc2tm::ReplicationSource::publish(const Game &game, uint16_t played) {
+  ReplicaRecord record{game.bot0, game.bot1, game.map, played, 0};
+
+  std::lock_guard<std::mutex> lock(mutex);
+  for (size_t i = standbys.size(); i-- > 0;) {
+    std::shared_ptr<Standby> standby = standbys[i];
+    if (standby->pending.size() >= maxPending) {
+      std::cout << "REPLICATION: dropping a standby that fell behind\n";
+      drop(standby);
+      continue;
+    }
+    standby->pending.push_back(record);
+    if (!standby->writing)
+      flush(standby);
+  }
+}
+
+void sc2tm::ReplicationSource::close() {
+  std::lock_guard<std::mutex> lock(mutex);
+  boost::system::error_code ignored;
+  acceptor.close(ignored);
+  while (!standbys.empty())
+    drop(standbys.back());
+}
+
+void sc2tm::ReplicationSource::startAccept() {
+  std::shared_ptr<Standby> standby = std::make_shared<Standby>(service);
+  acceptor.async_accept(standby->socket, [this, standby] (const boost::system::error_code &error) {
+    if (error) {
+      if (error != boost::asio::error::operation_aborted)
+        startAccept();
+      return;
+    }
+    std::cout << "REPLICATION: standby connected\n";
+
+    // Start queueing events before taking the snapshot, so every event is either in the snapshot
+    // or sent after it, and hold them back until the snapshot's gone out
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      standby->writing = true;
+      standbys.push_back(standby);
+    }
+
+    std::vector<GameGenerator::Progress> progress;
+    gen.snapshot(progress);
+
+    ReplicaHello hello;
+    std::memset(&hello, 0, sizeof(hello));
+    std::memcpy(hello.magic, replicaMagic, sizeof(replicaMagic));
+    std::memcpy(hello.catalog, catalog, sizeof(catalog));
+    hello.numGames = numGames;
+
+    standby->sending.resize(sizeof(hello) + progress.size() * sizeof(ReplicaRecord));
+    std::memcpy(standby->sending.data(), &hello, sizeof(hello));
+    uint8_t *out = standby->sending.data() + sizeof(hello);
+    for (const GameGenerator::Progress &p : progress) {
+      ReplicaRecord record{p.bot0, p.bot1, p.map, p.played, 0};
+      std::memcpy(out, &record, sizeof(record));
+      out += sizeof(record);
+    }
+
+    boost::asio::async_write(standby->socket, boost::asio::buffer(standby->sending),
+                             [this, standby] (const boost::system::error_code &error2, size_t) {
+                               std::lock_guard<std::mutex> lock(mutex);
+                               if (error2)
+                                 drop(standby);
+                               else
+                                 flush(standby);
+                             });
+
+    startAccept();
+  });
+}
+
+void sc2tm::ReplicationSource::flush(const std::shared_ptr<Standby> &standby) {
+  if (standby->pending.empty()) {
+    standby->writing = false;
+    return;
+  }
+
+  // Everything queued goes out in one write
+  standby->writing = true;
+  standby->sending.resize(standby->pending.size() * sizeof(ReplicaRecord));
+  std::memcpy(standby->sending.data(), standby->pending.data(), standby->sending.size());
+  standby->pending.clear();
+
+  boost::asio::async_write(standby->socket, boost::asio::buffer(standby->sending),
+                           [this, standby] (const boost::system::error_code &error, size_t) {
+                             std::lock_guard<std::mutex> lock(mutex);
+                             if (error)
+                               drop(standby);
+                             else
+                               flush(standby);
+                           });
+}
+
+void sc2tm::ReplicationSource::drop(const std::shared_ptr<Standby> &standby) {
+  auto it = std::find(standbys.begin(), standbys.end(), standby);
+  if (it == standbys.end())
+    return;
+
+  std::cout << "REPLICATION: standby disconnected\n";
+  boost::system::error_code ignored;
+  standby->socket.close(ignored);
+  standbys.erase(it);
+}
+
+sc2tm::ReplicationSink::ReplicationSink(boost::asio::io_service &service,
+                                        ShardedGameGenerator &gen, const SHA256Hash &catalog,
+                                        const std::string &host, uint16_t port,
+                                        std::function<void()> onTakeover) :
+    gen(gen), socket(service), retry(service), buffer(readSize),
+    onTakeover(std::move(onTakeover)) {
+  std::memcpy(this->catalog, catalog.get(), SHA256::DIGEST_SIZE);
+
+  boost::asio::ip::tcp::resolver resolver(service);
+  primary = *resolver.resolve(boost::asio::ip::tcp::resolver::query(host, std::to_string(port)));
+  connect();
+}
+
+void sc2tm::ReplicationSink::connect() {
+  socket.async_connect(primary, [this] (const boost::system::error_code &error) {
+    if (!error) {
+      readHello();
+      return;
+    }
+
+    boost::system::error_code ignored;
+    socket.close(ignored);
+    if (lastChance) {
+      takeOver();
+      return;
+    }
+
+    // The primary isn't up yet, try again shortly
+    connectLater();
+  });
+}
+
+void sc2tm::ReplicationSink::connectLater() {
+  retry.expires_after(retryDelay);
+  retry.async_wait([this] (const boost::system::error_code &error) {
+    if (!error)
+      connect();
+  });
+}
+
+void sc2tm::ReplicationSink::readHello() {
+  boost::asio::async_read(socket, boost::asio::buffer(buffer.data(), sizeof(ReplicaHello)),
+                          [this] (const boost::system::error_code &error, size_t) {
+    if (error) {
+      lost();
+      return;
+    }
+
+    ReplicaHello hello;
+    std::memcpy(&hello, buffer.data(), sizeof(hello));
+    if (std::memcmp(hello.magic, replicaMagic, sizeof(replicaMagic)) != 0 ||
+        std::memcmp(hello.catalog, catalog, sizeof(catalog)) != 0 ||
+        hello.numGames != numGames) {
+      // Nothing it sends applies to us, and it isn't gone, so we mustn't take over from it
+      // either. Keep trying in case it's restarted with the right bots and maps.
+      std::cout << "REPLICATION: the primary is scheduling different bots or maps, retrying\n";
+      boost::system::error_code ignored;
+      socket.close(ignored);
+      connectLater();
+      return;
+    }
+
+    std::cout << "REPLICATION: following the primary\n";
+    lastChance = false;
+    readRecords();
+  });
+}
+
+void sc2tm::ReplicationSink::readRecords() {
+  socket.async_read_some(boost::asio::buffer(buffer.data() + buffered, buffer.size() - buffered),
+                         [this] (const boost::system::error_code &error, size_t byteCount) {
+    if (error) {
+      lost();
+      return;
+    }
+
+    // Apply every whole record, a partial one at the end waits for the next read
+    buffered += byteCount;
+    size_t offset = 0;
+    for (; offset + sizeof(ReplicaRecord) <= buffered; offset += sizeof(ReplicaRecord)) {
+      ReplicaRecord record;
+      std::memcpy(&record, buffer.data() + offset, sizeof(record));
+      gen.restore(GameGenerator::Progress{record.bot0, record.bot1, record.map, record.played});
+      ++applied;
+    }
+    buffered -= offset;
+    std::memmove(buffer.data(), buffer.data() + offset, buffered);
+
+    readRecords();
+  });
+}
+
+void sc2tm::ReplicationSink::lost() {
+  boost::system::error_code ignored;
+  socket.close(ignored);
+
+  // Give the primary one more chance, it may have just handed over to a new process
+  if (!lastChance) {
+    std::cout << "REPLICATION: lost the primary after " << applied << " records, retrying\n";
+    lastChance = true;
+    connectLater();
+    return;
+  }
+
+  takeOver();
+}
+
+void sc2tm::ReplicationSink::takeOver() {
+  std::cout << "REPLICATION: the primary is gone, taking over\n";
+  if (onTakeover)
+    onTakeover();
+}
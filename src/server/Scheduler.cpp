@@ -0,0 +1,196 @@
+#include "server/Scheduler.h"
+
+#include <algorithm>
+#include <future>
+#include <utility>
+
+sc2tm::Scheduler::Scheduler(ShardedGameGenerator &gen, size_t maxBatch,
+                            std::chrono::milliseconds window) :
+    gen(gen), maxBatch(maxBatch ? maxBatch : 1), window(window), head(new Node()),
+    tail(head.load()), thread(&Scheduler::run, this) { }
+
+sc2tm::Scheduler::~Scheduler() {
+  {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    stopping = true;
+  }
+  wake.notify_one();
+  thread.join();
+
+  // Handle whatever was still queued here, so no result goes unlogged and every schedule request
+  // gets its answer
+  std::vector<Request> batch;
+  batch.reserve(maxBatch);
+  while (fill(batch)) {
+    handleBatch(batch);
+    batch.clear();
+  }
+  delete tail;
+}
+
+void sc2tm::Scheduler::schedule(const IdBitset &bots, const IdBitset &maps, uint32_t home,
+                                boost::asio::io_service::strand &strand,
+                                ScheduleHandler handler) {
+  Request request;
+  request.type = SCHEDULE;
+  request.bots = &bots;
+  request.maps = &maps;
+  request.home = home;
+  request.strand = &strand;
+  request.handler = std::move(handler);
+  push(std::move(request));
+}
+
+void sc2tm::Scheduler::notifySuccess(const Game &game, float seconds) {
+  Request request;
+  request.type = SUCCESS;
+  request.game = game;
+  request.seconds = seconds;
+  push(std::move(request));
+}
+
+void sc2tm::Scheduler::notifyFail(const Game &game) {
+  Request request;
+  request.type = FAIL;
+  request.game = game;
+  push(std::move(request));
+}
+
+void sc2tm::Scheduler::drain() {
+  // Everything pushed before us is handled in order, so once we're reached the queue's drained
+  std::promise<void> drained;
+  Request request;
+  request.type = DRAIN;
+  request.handler = [&drained] (bool, const Game &) { drained.set_value(); };
+  push(std::move(request));
+  drained.get_future().wait();
+}
+
+void sc2tm::Scheduler::push(Request request) {
+  Node *node = new Node();
+  node->request = std::move(request);
+
+  // Claim our place in line, then link the previous node to us. Until the link is made the
+  // consumer just sees the queue end early.
+  Node *prev = head.exchange(node);
+  prev->next.store(node);
+
+  // Only take the lock if the scheduler might be waiting on it. Both sides use sequentially
+  // consistent operations so either we see it sleeping or it sees our node before it sleeps.
+  if (sleeping.load()) {
+    std::lock_guard<std::mutex> lock(sleepMutex);
+    wake.notify_one();
+  }
+}
+
+bool sc2tm::Scheduler::pop(Request &request) {
+  Node *next = tail->next.load();
+  if (!next)
+    return false;
+
+  // Take the request, next becomes the new stub
+  request = std::move(next->request);
+  delete tail;
+  tail = next;
+  return true;
+}
+
+bool sc2tm::Scheduler::fill(std::vector<Request> &batch) {
+  size_t before = batch.size();
+  Request request;
+  while (batch.size() < maxBatch && pop(request))
+    batch.push_back(std::move(request));
+  return batch.size() != before;
+}
+
+void sc2tm::Scheduler::run() {
+  std::vector<Request> batch;
+  batch.reserve(maxBatch);
+
+  while (!stopping) {
+    // Take as much as we're allowed to in one go
+    fill(batch);
+
+    // If clients are waiting, give others a chance to join them so they can all be matched
+    // together
+    auto isSchedule = [] (const Request &request) { return request.type == SCHEDULE; };
+    if (window.count() > 0 && batch.size() < maxBatch &&
+        std::any_of(batch.begin(), batch.end(), isSchedule)) {
+      auto deadline = std::chrono::steady_clock::now() + window;
+      while (batch.size() < maxBatch && !stopping) {
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        sleeping = true;
+        bool woken = wake.wait_until(lock, deadline, [this] () {
+          return stopping || tail->next.load() != nullptr;
+        });
+        sleeping = false;
+        lock.unlock();
+
+        if (!woken)
+          break;
+        fill(batch);
+      }
+    }
+
+    if (!batch.empty()) {
+      handleBatch(batch);
+      batch.clear();
+      continue;
+    }
+
+    // Nothing to do, sleep until something gets pushed
+    std::unique_lock<std::mutex> lock(sleepMutex);
+    sleeping = true;
+    wake.wait(lock, [this] () { return stopping || tail->next.load() != nullptr; });
+    sleeping = false;
+  }
+}
+
+void sc2tm::Scheduler::handleBatch(std::vector<Request> &batch) {
+  // Apply every result first so the games they free up can go straight back out
+  for (const Request &request : batch) {
+    if (request.type == SUCCESS)
+      gen.notifySuccess(request.game, request.seconds);
+    else if (request.type == FAIL)
+      gen.notifyFail(request.game);
+  }
+
+  // Match the whole batch at once if we're gathering clients
+  if (window.count() > 0) {
+    waiting.clear();
+    for (const Request &request : batch)
+      if (request.type == SCHEDULE)
+        waiting.push_back(GameGenerator::GameRequest{request.bots, request.maps, Game{}, false});
+
+    gen.generateGames(waiting);
+
+    size_t next = 0;
+    for (Request &request : batch) {
+      if (request.type != SCHEDULE)
+        continue;
+
+      bool found = waiting[next].found;
+      Game game = waiting[next++].game;
+      ScheduleHandler handler = std::move(request.handler);
+      request.strand->post([handler, found, game] () { handler(found, game); });
+    }
+  }
+  else {
+    // Now hand out games and send the answers back to their connections
+    for (Request &request : batch) {
+      if (request.type != SCHEDULE)
+        continue;
+
+      bool found = gen.generateGame(request.game, *request.bots, *request.maps, request.home);
+      Game game = request.game;
+      ScheduleHandler handler = std::move(request.handler);
+      request.strand->post([handler, found, game] () { handler(found, game); });
+    }
+  }
+
+  // Only release drain waiters once everything popped with them has been answered, so nobody
+  // takes the generator's state while a game it handed out is still missing from it
+  for (Request &request : batch)
+    if (request.type == DRAIN)
+      request.handler(false, Game{});
+}
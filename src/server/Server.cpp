@@ -1,45 +1,161 @@
 #include "server/Server.h"
 
+#include <algorithm>
+#include <cstring>
 #include <iostream>
+#include <stdexcept>
+#include <thread>
 
 sc2tm::Server::Server(asio::io_service &service, const std::string &botDir,
-                      const std::string &mapDir) :
-    acceptor(service, tcp::endpoint(tcp::v4(), serverPort)) {
+                      const std::string &mapDir, const HashConfig &hashConfig,
+                      const ServerConfig &config) :
+    service(service), acceptor(service), config(config), upgradeAcceptor(service),
+    successor(service), handoffDeadline(service) {
   // Generate our directory hashes
   // TODO do these really need to map from file to hash on the server? Not really...
-  hashBotDirectory(botDir, botMap);
-  hashMapDirectory(mapDir, mapMap);
+  hashBotDirectory(botDir, botMap, hashConfig);
+  hashMapDirectory(mapDir, mapMap, hashConfig);
+
+  // Save what we hashed for the next run
+  saveHashCache(hashConfig);
+
+  // Intern the hashes, from here on everything works on ids
+  botRegistry = HashRegistry(botMap);
+  mapRegistry = HashRegistry(mapMap);
 
   // Initialize the generator
-  gen = GameGenerator(botMap, mapMap);
+  unsigned shards = config.schedShards;
+  if (shards == 0)
+    shards = std::max(1u, std::thread::hardware_concurrency());
+  uint16_t copies = (uint16_t) std::min(config.tailCopies, (unsigned) UINT16_MAX);
+  gen.reset(new ShardedGameGenerator(botRegistry, mapRegistry, shards, config.longestFirst,
+                                     copies));
+
+  // Everything we keep or replicate is in terms of the registries' ids
+  SHA256 ctx;
+  ctx.init();
+  ctx.update(botRegistry.digest().get(), SHA256::DIGEST_SIZE);
+  ctx.update(mapRegistry.digest().get(), SHA256::DIGEST_SIZE);
+  ctx.final(catalog.get());
+
+  if (config.schedBatch > 0)
+    scheduler.reset(new Scheduler(*gen, config.schedBatch,
+                                  std::chrono::milliseconds(config.schedWindow)));
+  if (config.leaseSeconds > 0)
+    leases.reset(new LeaseManager(service, std::chrono::seconds(config.leaseSeconds)));
+  if (config.sessionSeconds > 0) {
+    // A client that doesn't come back for its game leaves it to someone else
+    auto giveBackFn =
+        [this] (const Game &game) {
+          if (scheduler)
+            scheduler->notifyFail(game);
+          else
+            gen->notifyFail(game);
+        };
+    // A client that reconnects before we notice it's gone supersedes its old connection
+    auto hangUpFn =
+        [this] (Connection::ConnId id) {
+          std::lock_guard<std::mutex> lock(connMutex);
+          auto it = conns.find(id);
+          if (it != conns.end())
+            it->second->hangUp();
+        };
+    sessions.reset(new SessionTable(service, std::chrono::seconds(config.sessionSeconds),
+                                    giveBackFn, hangUpFn));
+  }
+
+  // Take over from an old process, or as a standby follow the primary and only start serving once
+  // it's gone
+  if (!config.upgradeFrom.empty()) {
+    resumeFrom(config.upgradeFrom);
+  }
+  else if (!config.standbyOf.empty()) {
+    std::cout << "Standing by for " << config.standbyOf << '\n';
+    standby.reset(new ReplicationSink(service, *gen, catalog, config.standbyOf,
+                                      (uint16_t) config.replicaPort, [this] () { takeOver(); }));
+    return;
+  }
+
+  takeOver();
+}
+
+void sc2tm::Server::openStateLog() {
+  // Pick up where the last run left off. A standby merges in whatever the primary managed to log,
+  // restoring never moves progress backwards.
+  stateLog.reset(new StateLog(config.stateDir, catalog,
+                              std::chrono::milliseconds(config.stateCommitMs),
+                              config.snapshotEvery));
+  stateLog->recover(*gen);
+}
+
+void sc2tm::Server::takeOver() {
+  // Log everything from here on, recovering first unless resuming already did
+  if (!config.stateDir.empty()) {
+    if (!stateLog)
+      openStateLog();
+    stateLog->start(*gen);
+    gen->setLog(stateLog.get());
+  }
+
+  // Let standbys follow us
+  if (config.replicaPort != 0) {
+    replicas.reset(new ReplicationSource(service, *gen, catalog, (uint16_t) config.replicaPort));
+    gen->setReplicas(replicas.get());
+  }
+
+  // An old process may have handed us its acceptor already
+  if (!acceptor.is_open()) {
+    tcp::endpoint endpoint(tcp::v4(), serverPort);
+    acceptor.open(endpoint.protocol());
+    acceptor.set_option(tcp::acceptor::reuse_address(true));
+    acceptor.bind(endpoint);
+    acceptor.listen();
+  }
+  std::cout << "Listening for clients\n";
+
+  // Let a new build take over from us
+  if (!config.upgradeSocket.empty()) {
+    std::error_code ignored;
+    fs::remove(config.upgradeSocket, ignored);
+    upgradeAcceptor = asio::local::stream_protocol::acceptor(
+        service, asio::local::stream_protocol::endpoint(config.upgradeSocket));
+    startUpgradeAccept();
+  }
 
   startAccept();
 }
 
 void sc2tm::Server::startAccept() {
-  // Create a new connection
-  Connection::ConnId id = nextId++; // Generate id, we need to use it twice
-  Connection::ptr newConn =
-      Connection::create(*this, acceptor.get_io_service(), id);
-
-  // Locking scope
+  // Create a new connection and add it to the list, the id is generated under the lock as well
+  Connection::ptr newConn;
+  Connection::ConnId id;
   {
     std::lock_guard<std::mutex> lock(connMutex);
+    id = nextId++; // Generate id, we need to use it twice
+    newConn = Connection::create(*this, service, id);
     conns[id] = newConn;
   }
 
   auto acceptFn =
-      [&, newConn] (const boost::system::error_code &error) {
-        handleAccept(*newConn, error);
+      [&, newConn, id] (const boost::system::error_code &error) {
+        handleAccept(*newConn, id, error);
       };
 
   acceptor.async_accept(newConn->socket(), acceptFn);
 }
 
-void sc2tm::Server::handleAccept(Connection &newCon, const boost::system::error_code &error) {
+void sc2tm::Server::handleAccept(Connection &newCon, Connection::ConnId id,
+                                 const boost::system::error_code &error) {
   if (!error)
     newCon.start();
 
+  // Once we're handing off the new process does the accepting
+  if (handingOff) {
+    if (error)
+      requestDestroyConnection(id);
+    return;
+  }
+
   startAccept();
 }
 
@@ -48,4 +164,203 @@ void sc2tm::Server::requestDestroyConnection(Connection::ConnId id) {
   std::lock_guard<std::mutex> lock(connMutex);
   size_t erased = conns.erase(id);
   assert(erased == 1);
+  if (handingOff)
+    checkParked();
+}
+
+void sc2tm::Server::resumeFrom(const std::string &path) {
+  HandoffState state;
+  if (!receiveHandoff(path, state))
+    throw std::runtime_error("Couldn't take over from the server at " + path);
+  if (std::memcmp(state.catalog, catalog.get(), SHA256::DIGEST_SIZE) != 0)
+    throw std::runtime_error("The server at " + path + " is scheduling different bots or maps");
+
+  // Rebuild the generator, then take the games being played back out of the pool. Anything the
+  // log adds has to be in before then too, restoring can take or finish the slots those games
+  // are being played from.
+  for (const GameGenerator::Progress &progress : state.progress)
+    gen->restore(progress);
+  if (!config.stateDir.empty())
+    openStateLog();
+  for (const HandoffConnection &handoff : state.connections)
+    for (const HandoffGame &game : handoff.games)
+      gen->adopt(game.game);
+  for (const HandoffSession &handoff : state.sessions)
+    for (const HandoffGame &game : handoff.games)
+      gen->adopt(game.game);
+  takeOverSessions(state);
+
+  acceptor.assign(tcp::v4(), state.acceptorFd);
+
+  std::lock_guard<std::mutex> lock(connMutex);
+  for (const HandoffConnection &handoff : state.connections) {
+    conns[handoff.id] = Connection::resume(*this, service, handoff);
+    nextId = std::max(nextId, handoff.id + 1);
+  }
+  std::cout << "Took over " << state.connections.size() << " connections from " << path << '\n';
+}
+
+void sc2tm::Server::startUpgradeAccept() {
+  upgradeAcceptor.async_accept(successor, [this] (const boost::system::error_code &error) {
+    if (!error)
+      beginHandoff();
+  });
+}
+
+void sc2tm::Server::beginHandoff() {
+  std::cout << "HANDING OFF TO A NEW PROCESS\n";
+  handingOff = true;
+
+  // Stop taking clients, the acceptor itself goes to the new process
+  boost::system::error_code ignored;
+  acceptor.cancel(ignored);
+
+  // Clients mid handshake normally get to a game quickly, but don't wait on them forever
+  handoffDeadline.expires_after(std::chrono::seconds(5));
+  handoffDeadline.async_wait([this] (const boost::system::error_code &error) {
+    if (!error)
+      finishHandoff();
+  });
+
+  std::lock_guard<std::mutex> lock(connMutex);
+  for (auto &pair : conns)
+    pair.second->park();
+  checkParked();
+}
+
+void sc2tm::Server::connectionParked() {
+  std::lock_guard<std::mutex> lock(connMutex);
+  ++parkedCount;
+  checkParked();
+}
+
+void sc2tm::Server::checkParked() {
+  if (parkedCount == conns.size())
+    service.post([this] () { finishHandoff(); });
+}
+
+void sc2tm::Server::finishHandoff() {
+  if (handedOff.exchange(true))
+    return;
+  handoffDeadline.cancel();
+
+  // Make sure every result is in, then stop logging and replicating, the new process takes over
+  // both
+  if (scheduler)
+    scheduler->drain();
+  gen->setLog(nullptr);
+  if (stateLog)
+    stateLog->stop();
+  gen->setReplicas(nullptr);
+  if (replicas)
+    replicas->close();
+
+  HandoffState state;
+  std::memcpy(state.catalog, catalog.get(), SHA256::DIGEST_SIZE);
+  state.acceptorFd = acceptor.native_handle();
+  gen->snapshot(state.progress);
+
+  // Only parked connections go, anyone who didn't make it in time will have to reconnect
+  {
+    std::lock_guard<std::mutex> lock(connMutex);
+    for (auto &pair : conns)
+      if (pair.second->isParked())
+        state.connections.push_back(pair.second->handoffState());
+  }
+  handOffSessions(state);
+
+  boost::system::error_code ignored;
+  upgradeAcceptor.close(ignored);
+  if (!sendHandoff(successor.native_handle(), state))
+    std::cout << "HANDOFF FAILED\n";
+  else
+    std::cout << "HANDED OFF " << state.connections.size() << " CONNECTIONS\n";
+
+  // Our copies of the sockets close with us, the new process has its own
+  service.stop();
+}
+
+void sc2tm::Server::handOffSessions(HandoffState &state) {
+  if (!sessions) {
+    for (HandoffConnection &handoff : state.connections)
+      handoff.hasSession = false;
+    return;
+  }
+
+  std::map<SessionToken, SessionTable::Session> saved;
+  sessions->snapshot(saved);
+
+  // A session goes if its client has dropped or its connection goes. The rest are attached to
+  // connections that are closing with us, whose clients will have to handshake again.
+  for (HandoffConnection &handoff : state.connections) {
+    if (!handoff.hasSession)
+      continue;
+    auto it = saved.find(handoff.session);
+    if (it == saved.end() || !it->second.attached || it->second.owner != handoff.id ||
+        it->second.waiter)
+      handoff.hasSession = false;
+  }
+
+  auto now = std::chrono::steady_clock::now();
+  for (const auto &entry : saved) {
+    const SessionTable::Session &session = entry.second;
+    if (session.attached &&
+        std::none_of(state.connections.begin(), state.connections.end(),
+                     [&entry] (const HandoffConnection &handoff) {
+                       return handoff.hasSession && handoff.session == entry.first;
+                     }))
+      continue;
+
+    HandoffSession handoff;
+    handoff.token = entry.first;
+    std::memcpy(handoff.catalog, session.catalog.get(), SHA256::DIGEST_SIZE);
+    handoff.attached = session.attached;
+    handoff.owner = session.owner;
+    for (const auto &game : session.games) {
+      std::chrono::milliseconds elapsed(0);
+      if (game.second.start != std::chrono::steady_clock::time_point())
+        elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(now - game.second.start);
+      handoff.games.push_back(HandoffGame{game.first, game.second.game, elapsed});
+    }
+    handoff.nextTicket = session.nextTicket;
+    handoff.queueDepth = session.queueDepth;
+    for (HashId bot = session.bots.first(); bot != invalidHashId; bot = session.bots.next(bot + 1))
+      handoff.bots.push_back(bot);
+    for (HashId map = session.maps.first(); map != invalidHashId; map = session.maps.next(map + 1))
+      handoff.maps.push_back(map);
+    state.sessions.push_back(std::move(handoff));
+  }
+}
+
+void sc2tm::Server::takeOverSessions(const HandoffState &state) {
+  // Without sessions of our own the clients will just have to handshake again
+  if (!sessions)
+    return;
+
+  auto now = std::chrono::steady_clock::now();
+  for (const HandoffSession &handoff : state.sessions) {
+    SessionTable::Session session;
+    session.owner = handoff.owner;
+    session.catalog = SHA256Hash(handoff.catalog);
+    session.bots = IdBitset(botRegistry.size());
+    session.maps = IdBitset(mapRegistry.size());
+    for (HashId bot : handoff.bots)
+      if (bot < session.bots.size())
+        session.bots.set(bot);
+    for (HashId map : handoff.maps)
+      if (map < session.maps.size())
+        session.maps.set(map);
+    session.queueDepth = handoff.queueDepth;
+    session.nextTicket = handoff.nextTicket;
+    session.attached = handoff.attached;
+
+    // Only the game at the front of the queue is being played
+    for (const HandoffGame &game : handoff.games) {
+      Assignment &assignment = session.games[game.ticket];
+      assignment.game = game.game;
+      if (game.ticket == handoff.games.front().ticket)
+        assignment.start = now - game.elapsed;
+    }
+    sessions->restore(handoff.token, session);
+  }
 }
@@ -1 +1,20 @@
 #include "server/ServerOpts.h"
+
+sc2tm::ServerConfig sc2tm::ServerOpts::getServerConfig() {
+  ServerConfig config;
+  config.schedShards = getUnsignedOpt("sched-shards", config.schedShards);
+  config.schedBatch = getUnsignedOpt("sched-batch", config.schedBatch);
+  config.schedWindow = getUnsignedOpt("sched-window", config.schedWindow);
+  config.longestFirst = getFlag("sched-lpt");
+  config.tailCopies = getUnsignedOpt("tail-copies", config.tailCopies);
+  config.leaseSeconds = getUnsignedOpt("lease-seconds", config.leaseSeconds);
+  config.sessionSeconds = getUnsignedOpt("session-seconds", config.sessionSeconds);
+  config.stateDir = getOpt("state-dir");
+  config.stateCommitMs = getUnsignedOpt("state-commit-ms", config.stateCommitMs);
+  config.snapshotEvery = getUnsignedOpt("state-snapshot-every", config.snapshotEvery);
+  config.replicaPort = getUnsignedOpt("replica-port", config.replicaPort);
+  config.standbyOf = getOpt("standby-of");
+  config.upgradeSocket = getOpt("upgrade-socket");
+  config.upgradeFrom = getOpt("upgrade-from");
+  return config;
+}
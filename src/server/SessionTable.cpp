@@ -0,0 +1,165 @@
+#include "server/SessionTable.h"
+
+#include <cstring>
+#include <random>
+
+sc2tm::SessionTable::SessionTable(boost::asio::io_service &service, std::chrono::seconds grace,
+                                  std::function<void(const Game &)> onExpire,
+                                  std::function<void(ConnId)> onSupersede) :
+    expiry(service, grace, std::chrono::milliseconds(500)), onExpire(std::move(onExpire)),
+    onSupersede(std::move(onSupersede)) { }
+
+sc2tm::SessionToken sc2tm::SessionTable::open(ConnId owner, const SHA256Hash &catalog,
+                                              const IdBitset &bots, const IdBitset &maps,
+                                              uint8_t queueDepth) {
+  // A token is all a client needs to take over a session, so every byte comes from the system's
+  // secure generator. A seeded engine would give its state away to anyone who saw enough tokens.
+  std::random_device device;
+
+  std::lock_guard<std::mutex> lock(mutex);
+
+  // Collisions are vanishingly unlikely, but cheap to rule out
+  SessionToken token;
+  do {
+    for (size_t i = 0; i < token.size(); i += sizeof(uint32_t)) {
+      uint32_t word = device();
+      std::memcpy(token.data() + i, &word, sizeof(word));
+    }
+  } while (sessions.count(token));
+
+  Session &session = sessions[token];
+  session.owner = owner;
+  session.catalog = catalog;
+  session.bots = bots;
+  session.maps = maps;
+  session.queueDepth = queueDepth;
+  return token;
+}
+
+void sc2tm::SessionTable::resume(const SessionToken &token, const uint8_t *catalog, ConnId owner,
+                                 ResumeHandler onResumed) {
+  Session resumed;
+  ConnId previous;
+  bool found = false, waiting = false;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = sessions.find(token);
+    found = it != sessions.end() && !it->second.waiter &&
+            std::memcmp(it->second.catalog.get(), catalog, SHA256::DIGEST_SIZE) == 0;
+    if (!found) {
+      resumed.owner = owner;
+    }
+    else if (it->second.attached) {
+      // The old connection hasn't noticed its client's gone, wait for it to let go
+      Session &session = it->second;
+      session.waiter = onResumed;
+      previous = session.owner;
+      session.owner = owner;
+      waiting = true;
+    }
+    else {
+      // Any pending expiry is now stale, and the games belong to the connection now
+      Session &session = it->second;
+      session.owner = owner;
+      session.attached = true;
+      ++session.serial;
+      resumed = session;
+      session.games.clear();
+    }
+  }
+
+  if (waiting)
+    onSupersede(previous);
+  else
+    onResumed(found, resumed);
+}
+
+void sc2tm::SessionTable::detach(const SessionToken &token, const Assignments &games,
+                                 GameTicket nextTicket) {
+  uint32_t serial;
+  ResumeHandler waiter;
+  Session resumed;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = sessions.find(token);
+    if (it == sessions.end())
+      return;
+
+    Session &session = it->second;
+    session.games = games;
+    session.nextTicket = nextTicket;
+
+    // A resume's waiting, hand everything straight over
+    if (session.waiter) {
+      waiter = session.waiter;
+      session.waiter = nullptr;
+      resumed = session;
+      session.games.clear();
+    }
+    else {
+      session.attached = false;
+      serial = ++session.serial;
+    }
+  }
+
+  if (waiter) {
+    waiter(true, resumed);
+    return;
+  }
+
+  // A resume or another drop bumps the serial, so the expiry only acts on this one
+  expiry.grant([this, token, serial] () { expire(token, serial); });
+}
+
+void sc2tm::SessionTable::close(const SessionToken &token) {
+  ResumeHandler waiter;
+  Session failed;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = sessions.find(token);
+    if (it == sessions.end())
+      return;
+    waiter = it->second.waiter;
+    failed.owner = it->second.owner;
+    sessions.erase(it);
+  }
+
+  if (waiter)
+    waiter(false, failed);
+}
+
+void sc2tm::SessionTable::snapshot(std::map<SessionToken, Session> &out) {
+  std::lock_guard<std::mutex> lock(mutex);
+  out = sessions;
+}
+
+void sc2tm::SessionTable::restore(const SessionToken &token, const Session &session) {
+  uint32_t serial;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Session &restored = sessions[token];
+    restored = session;
+    restored.waiter = nullptr;
+    serial = ++restored.serial;
+  }
+
+  if (!session.attached)
+    expiry.grant([this, token, serial] () { expire(token, serial); });
+}
+
+void sc2tm::SessionTable::expire(const SessionToken &token, uint32_t serial) {
+  Assignments games;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = sessions.find(token);
+    if (it == sessions.end() || it->second.attached || it->second.serial != serial)
+      return;
+
+    games.swap(it->second.games);
+    sessions.erase(it);
+  }
+
+  // The client never came back, someone else will have to play its games
+  for (const auto &entry : games)
+    onExpire(entry.second.game);
+}
@@ -0,0 +1,80 @@
+#include "server/ShardedGameGenerator.h"
+
+#include <algorithm>
+
+sc2tm::ShardedGameGenerator::ShardedGameGenerator(const HashRegistry &botRegistry,
+                                                  const HashRegistry &mapRegistry,
+                                                  uint32_t shardCount, bool longestFirst,
+                                                  uint16_t maxCopies) :
+    durations(botRegistry.size(), mapRegistry.size()) {
+  GeneratorConfig config;
+  config.shardCount = std::max(1u, shardCount);
+  config.durations = longestFirst ? &durations : nullptr;
+  config.maxCopies = maxCopies;
+  config.gameIds = &nextGameId;
+  for (config.shard = 0; config.shard < config.shardCount; ++config.shard)
+    shards.emplace_back(new GameGenerator(botRegistry, mapRegistry, config));
+}
+
+bool sc2tm::ShardedGameGenerator::generateGame(Game &game, const IdBitset &cBots,
+                                               const IdBitset &cMaps, uint32_t home) {
+  // Start at home and walk around the ring, only one lock is ever held at a time
+  uint32_t count = shardCount();
+  home %= count;
+  for (uint32_t i = 0; i < count; ++i) {
+    if (shards[(home + i) % count]->generateGame(game, cBots, cMaps)) {
+      if (log)
+        log->append(StateLog::SCHEDULE, game);
+      return true;
+    }
+  }
+
+  // Nothing new fits, only help with what's out there once there's no new work for anyone
+  if (unissuedCount() > 0)
+    return false;
+  for (uint32_t i = 0; i < count; ++i)
+    if (shards[(home + i) % count]->generateBackup(game, cBots, cMaps))
+      return true;
+
+  return false;
+}
+
+void sc2tm::ShardedGameGenerator::generateGames(std::vector<GameGenerator::GameRequest> &requests) {
+  for (std::unique_ptr<GameGenerator> &shard : shards) {
+    shard->generateGames(requests);
+
+    // Stop early once everyone's busy
+    if (std::all_of(requests.begin(), requests.end(),
+                    [] (const GameGenerator::GameRequest &request) { return request.found; }))
+      break;
+  }
+
+  if (log)
+    for (const GameGenerator::GameRequest &request : requests)
+      if (request.found)
+        log->append(StateLog::SCHEDULE, request.game);
+
+  // Every shard has had its chance to start new work. Backups only go out once there's less new
+  // work left than clients still waiting, otherwise they'd take games from clients that could
+  // be starting something new.
+  uint64_t waiting = (uint64_t) std::count_if(
+      requests.begin(), requests.end(),
+      [] (const GameGenerator::GameRequest &request) { return !request.found; });
+  if (waiting == 0 || unissuedCount() >= waiting)
+    return;
+
+  for (GameGenerator::GameRequest &request : requests) {
+    for (std::unique_ptr<GameGenerator> &shard : shards) {
+      if (request.found)
+        break;
+      request.found = shard->generateBackup(request.game, *request.bots, *request.maps);
+    }
+  }
+}
+
+uint64_t sc2tm::ShardedGameGenerator::unissuedCount() {
+  uint64_t unissued = 0;
+  for (std::unique_ptr<GameGenerator> &shard : shards)
+    unissued += shard->unissuedCount();
+  return unissued;
+}
@@ -0,0 +1,365 @@
+#include "server/StateLog.h"
+
+#include "common/config.h"
+#include "server/ShardedGameGenerator.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <experimental/filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <stdexcept>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+namespace fs = std::experimental::filesystem;
+
+namespace {
+
+//! Identifies a log segment, the last byte is the format version.
+const uint8_t segmentMagic[8] = { 'S', 'C', '2', 'T', 'M', 'W', 'L', 1 };
+
+//! Identifies a snapshot, the last byte is the format version.
+const uint8_t snapshotMagic[8] = { 'S', 'C', '2', 'T', 'M', 'S', 'N', 1 };
+
+//! The header at the start of segments and snapshots.
+struct FileHeader {
+  uint8_t magic[8];
+  //! The catalog the file was written against.
+  uint8_t catalog[SHA256::DIGEST_SIZE];
+  //! The games per (matchup, map) the file was written with.
+  uint32_t numGames;
+  //! The number of records following, snapshots only.
+  uint32_t recordCount;
+  //! The first event in a segment, the first event after a snapshot.
+  uint64_t lsn;
+  //! Checksum of the records following, snapshots only.
+  uint64_t check;
+};
+
+//! A fixed size snapshot record.
+struct SnapshotRecord {
+  sc2tm::BotId bot0;
+  sc2tm::BotId bot1;
+  sc2tm::MapId map;
+  uint16_t played;
+  uint16_t pad;
+};
+
+//! FNV-1a, plenty to spot a torn write.
+uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ull) {
+  const uint8_t *bytes = (const uint8_t *) data;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ull;
+  }
+  return hash;
+}
+
+//! Read a whole file, false if it couldn't be opened.
+bool readFile(const std::string &path, std::vector<char> &data) {
+  std::ifstream file(path, std::fstream::in | std::fstream::binary);
+  if (!file)
+    return false;
+  data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return true;
+}
+
+//! Sync a file or directory by path.
+void syncPath(const std::string &path) {
+#ifndef _WIN32
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  ::fsync(fd);
+  ::close(fd);
+#endif
+}
+
+} // End anonymous namespace
+
+sc2tm::StateLog::StateLog(const std::string &dir, const SHA256Hash &catalog,
+                          std::chrono::milliseconds commitInterval, uint64_t snapshotEvery) :
+    dir(dir), commitInterval(commitInterval), snapshotEvery(std::max<uint64_t>(1, snapshotEvery)) {
+  std::memcpy(this->catalog, catalog.get(), SHA256::DIGEST_SIZE);
+
+  std::error_code error;
+  fs::create_directories(dir, error);
+}
+
+sc2tm::StateLog::~StateLog() {
+  stop();
+}
+
+void sc2tm::StateLog::stop() {
+  if (thread.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    thread.join();
+  }
+
+#ifndef _WIN32
+  if (fd >= 0)
+    ::close(fd);
+  fd = -1;
+#endif
+}
+
+uint64_t sc2tm::StateLog::recover(ShardedGameGenerator &gen) {
+  // Load the snapshot, if there is one
+  std::vector<char> data;
+  if (readFile(dir + "/snapshot", data) && data.size() >= sizeof(FileHeader)) {
+    FileHeader header;
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (std::memcmp(header.magic, snapshotMagic, sizeof(snapshotMagic)) != 0)
+      throw std::runtime_error("Invalid snapshot in " + dir);
+    if (std::memcmp(header.catalog, catalog, sizeof(catalog)) != 0 ||
+        header.numGames != numGames)
+      throw std::runtime_error("State in " + dir + " is for different bots or maps");
+
+    // The snapshot was renamed into place whole, so it's either right or damaged on disk
+    const char *records = data.data() + sizeof(FileHeader);
+    size_t size = (size_t) header.recordCount * sizeof(SnapshotRecord);
+    if (sizeof(FileHeader) + size != data.size() || fnv1a(records, size) != header.check)
+      throw std::runtime_error("Corrupt snapshot in " + dir);
+
+    for (uint32_t i = 0; i < header.recordCount; ++i) {
+      SnapshotRecord record;
+      std::memcpy(&record, records + (size_t) i * sizeof(record), sizeof(record));
+      gen.restore(GameGenerator::Progress{record.bot0, record.bot1, record.map, record.played});
+    }
+
+    snapshotLsn = header.lsn;
+    nextLsn = header.lsn;
+    std::cout << "STATE: restored " << header.recordCount << " snapshot records\n";
+  }
+
+  // Replay the segments the snapshot doesn't cover, in order
+  uint64_t replayed = 0;
+  for (uint64_t start : listSegments()) {
+    if (start < snapshotLsn)
+      continue;
+    if (!readFile(segmentPath(start), data) || data.size() < sizeof(FileHeader))
+      continue;
+
+    FileHeader header;
+    std::memcpy(&header, data.data(), sizeof(header));
+    if (std::memcmp(header.magic, segmentMagic, sizeof(segmentMagic)) != 0 ||
+        header.lsn != start)
+      continue;
+    if (std::memcmp(header.catalog, catalog, sizeof(catalog)) != 0 ||
+        header.numGames != numGames)
+      throw std::runtime_error("State in " + dir + " is for different bots or maps");
+
+    // A crash can tear the last records, stop at the first one that doesn't check out
+    uint64_t lsn = start;
+    for (size_t offset = sizeof(FileHeader); offset + sizeof(Record) <= data.size();
+         offset += sizeof(Record)) {
+      Record record;
+      std::memcpy(&record, data.data() + offset, sizeof(record));
+      if ((uint32_t) fnv1a(&record, offsetof(Record, check)) != record.check)
+        break;
+
+      if (record.type == SUCCESS)
+        gen.restore(GameGenerator::Progress{record.bot0, record.bot1, record.map,
+                                            record.played});
+      ++lsn;
+      ++replayed;
+    }
+    nextLsn = std::max(nextLsn, lsn);
+  }
+
+  if (replayed > 0)
+    std::cout << "STATE: replayed " << replayed << " log events\n";
+  return replayed;
+}
+
+void sc2tm::StateLog::start(ShardedGameGenerator &gen) {
+  this->gen = &gen;
+
+  // Compact whatever we recovered so the old segments can go
+  snapshot();
+  thread = std::thread(&StateLog::run, this);
+}
+
+void sc2tm::StateLog::append(EventType type, const Game &game, uint16_t played) {
+  Record record;
+  std::memset(&record, 0, sizeof(record));
+  record.type = type;
+  record.played = played;
+  record.bot0 = game.bot0;
+  record.bot1 = game.bot1;
+  record.map = game.map;
+  record.check = (uint32_t) fnv1a(&record, offsetof(Record, check));
+
+  std::lock_guard<std::mutex> lock(mutex);
+  pending.push_back(record);
+  ++nextLsn;
+}
+
+void sc2tm::StateLog::run() {
+  std::vector<Record> batch;
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    // Gather events for a commit interval, or until we're told to stop
+    wake.wait_for(lock, commitInterval, [this] { return stopping; });
+    bool stop = stopping;
+    bool snapshotDue = nextLsn - snapshotLsn >= snapshotEvery;
+    batch.swap(pending);
+    lock.unlock();
+
+    // One write and one sync for everything in the interval
+    if (!batch.empty() && !writeOut(batch))
+      std::cout << "STATE: failed to write the log\n";
+    batch.clear();
+
+    if (snapshotDue && !stop)
+      snapshot();
+
+    if (stop)
+      return;
+    lock.lock();
+  }
+}
+
+bool sc2tm::StateLog::writeOut(const std::vector<Record> &records) {
+#ifdef _WIN32
+  return false;
+#else
+  if (fd < 0)
+    return false;
+
+  const char *data = (const char *) records.data();
+  size_t size = records.size() * sizeof(Record);
+  while (size > 0) {
+    ssize_t written = ::write(fd, data, size);
+    if (written < 0)
+      return false;
+    data += written;
+    size -= (size_t) written;
+  }
+  return ::fdatasync(fd) == 0;
+#endif
+}
+
+bool sc2tm::StateLog::openSegment(uint64_t lsn) {
+#ifdef _WIN32
+  return false;
+#else
+  if (fd >= 0)
+    ::close(fd);
+
+  fd = ::open(segmentPath(lsn).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return false;
+
+  FileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, segmentMagic, sizeof(segmentMagic));
+  std::memcpy(header.catalog, catalog, sizeof(catalog));
+  header.numGames = numGames;
+  header.lsn = lsn;
+  if (::write(fd, &header, sizeof(header)) != (ssize_t) sizeof(header) || ::fsync(fd) != 0)
+    return false;
+
+  // Make sure the new segment's name survives a crash too
+  syncPath(dir);
+  return true;
+#endif
+}
+
+void sc2tm::StateLog::snapshot() {
+  // Everything before the snapshot point goes into the old segment, everything after into the new
+  std::vector<Record> batch;
+  uint64_t lsn;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    batch.swap(pending);
+    lsn = nextLsn;
+  }
+  if (!batch.empty())
+    writeOut(batch);
+  if (!openSegment(lsn)) {
+    std::cout << "STATE: failed to open a log segment in " << dir << '\n';
+    return;
+  }
+
+  // Every event before lsn has already been applied to the generator, so its progress covers them.
+  // Events after it may be in here too, that's fine, replaying them changes nothing.
+  std::vector<GameGenerator::Progress> progress;
+  gen->snapshot(progress);
+
+  std::vector<SnapshotRecord> records;
+  records.reserve(progress.size());
+  for (const GameGenerator::Progress &p : progress)
+    records.push_back(SnapshotRecord{p.bot0, p.bot1, p.map, p.played, 0});
+
+  FileHeader header;
+  std::memset(&header, 0, sizeof(header));
+  std::memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+  std::memcpy(header.catalog, catalog, sizeof(catalog));
+  header.numGames = numGames;
+  header.recordCount = (uint32_t) records.size();
+  header.lsn = lsn;
+  header.check = fnv1a(records.data(), records.size() * sizeof(SnapshotRecord));
+
+  // Write beside the real file, sync it and then swap it in
+  std::string path = dir + "/snapshot";
+  std::string tmpPath = path + ".tmp";
+  {
+    std::ofstream file(tmpPath, std::fstream::out | std::fstream::binary | std::fstream::trunc);
+    file.write((const char *) &header, sizeof(header));
+    file.write((const char *) records.data(), records.size() * sizeof(SnapshotRecord));
+    if (!file) {
+      std::cout << "STATE: failed to write a snapshot in " << dir << '\n';
+      return;
+    }
+  }
+  syncPath(tmpPath);
+
+  std::error_code error;
+  fs::rename(tmpPath, path, error);
+  if (error) {
+    std::cout << "STATE: failed to write a snapshot in " << dir << '\n';
+    return;
+  }
+  syncPath(dir);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    snapshotLsn = lsn;
+  }
+
+  // The snapshot covers every segment before this one
+  for (uint64_t start : listSegments())
+    if (start < lsn)
+      fs::remove(segmentPath(start), error);
+}
+
+std::string sc2tm::StateLog::segmentPath(uint64_t lsn) const {
+  char name[32];
+  std::snprintf(name, sizeof(name), "/wal.%016llx", (unsigned long long) lsn);
+  return dir + name;
+}
+
+std::vector<uint64_t> sc2tm::StateLog::listSegments() const {
+  std::vector<uint64_t> starts;
+  std::error_code error;
+  for (fs::directory_iterator it(dir, error), end; !error && it != end; it.increment(error)) {
+    std::string name = it->path().filename().string();
+    if (name.size() != 20 || name.compare(0, 4, "wal.") != 0)
+      continue;
+    starts.push_back(std::strtoull(name.c_str() + 4, nullptr, 16));
+  }
+  std::sort(starts.begin(), starts.end());
+  return starts;
+}
@@ -0,0 +1,146 @@
+#include "server/TimerWheel.h"
+
+#include <algorithm>
+#include <cassert>
+
+// Some of these get bound to references so they need storage
+const sc2tm::TimerWheel::TimerId sc2tm::TimerWheel::invalidTimer;
+const uint32_t sc2tm::TimerWheel::none;
+
+sc2tm::TimerWheel::TimerWheel() : heads(slotCount * wheelCount, none) { }
+
+sc2tm::TimerWheel::TimerId sc2tm::TimerWheel::add(uint64_t ticks, Callback callback) {
+  // Grab an entry from the free list or grow the pool
+  uint32_t index;
+  if (freeList != none) {
+    index = freeList;
+    freeList = entries[index].next;
+  }
+  else {
+    index = (uint32_t) entries.size();
+    entries.emplace_back();
+    entries.back().generation = 0;
+  }
+
+  Entry &entry = entries[index];
+  entry.expiry = current + std::max<uint64_t>(ticks, 1);
+  entry.callback = std::move(callback);
+  place(index);
+  ++live;
+
+  return (TimerId) entry.generation << 32 | index;
+}
+
+bool sc2tm::TimerWheel::cancel(TimerId id) {
+  uint32_t index = find(id);
+  if (index == none)
+    return false;
+
+  unlink(index);
+  release(index);
+  return true;
+}
+
+bool sc2tm::TimerWheel::reset(TimerId id, uint64_t ticks) {
+  uint32_t index = find(id);
+  if (index == none)
+    return false;
+
+  unlink(index);
+  entries[index].expiry = current + std::max<uint64_t>(ticks, 1);
+  place(index);
+  return true;
+}
+
+uint32_t sc2tm::TimerWheel::find(TimerId id) const {
+  uint32_t index = (uint32_t) id;
+  if (id == invalidTimer || index >= entries.size())
+    return none;
+
+  // A stale id either points at a free entry or one that's been reused since
+  const Entry &entry = entries[index];
+  if (entry.slot == none || entry.generation != (uint32_t) (id >> 32))
+    return none;
+  return index;
+}
+
+void sc2tm::TimerWheel::advance(uint64_t tick, std::vector<Callback> &expired) {
+  while (current < tick) {
+    ++current;
+
+    // Every time a wheel wraps, spread the next slot of the wheel above it down. Entries land on a
+    // lower wheel now that they're closer.
+    for (uint32_t wheel = 1; wheel < wheelCount; ++wheel) {
+      if ((current >> (slotBits * (wheel - 1))) % slotCount != 0)
+        break;
+
+      uint32_t &head = heads[wheel * slotCount + (current >> (slotBits * wheel)) % slotCount];
+      uint32_t index = head;
+      head = none;
+      while (index != none) {
+        uint32_t next = entries[index].next;
+        place(index);
+        index = next;
+      }
+    }
+
+    // Everything in this tick's slot has expired
+    uint32_t &head = heads[current % slotCount];
+    uint32_t index = head;
+    head = none;
+    while (index != none) {
+      uint32_t next = entries[index].next;
+      assert(entries[index].expiry <= current);
+      expired.push_back(std::move(entries[index].callback));
+      release(index);
+      index = next;
+    }
+  }
+}
+
+void sc2tm::TimerWheel::place(uint32_t index) {
+  Entry &entry = entries[index];
+
+  // Clamp anything past the last wheel, it'll be looked at again when it comes down. An entry
+  // coming down from a higher wheel may expire this very tick, its slot is the one about to fire.
+  uint64_t expiry = std::max(entry.expiry, current);
+  uint64_t reach = uint64_t(1) << (slotBits * wheelCount);
+  if (expiry - current >= reach)
+    expiry = current + reach - 1;
+
+  // Find the lowest wheel that reaches the expiry
+  uint64_t delta = expiry - current;
+  uint32_t wheel = 0;
+  while (wheel + 1 < wheelCount && delta >= (uint64_t(1) << (slotBits * (wheel + 1))))
+    ++wheel;
+
+  uint32_t slot = wheel * slotCount + (uint32_t) ((expiry >> (slotBits * wheel)) % slotCount);
+
+  // Push on the front of the slot's list
+  entry.slot = slot;
+  entry.prev = none;
+  entry.next = heads[slot];
+  if (entry.next != none)
+    entries[entry.next].prev = index;
+  heads[slot] = index;
+}
+
+void sc2tm::TimerWheel::unlink(uint32_t index) {
+  Entry &entry = entries[index];
+  if (entry.prev != none)
+    entries[entry.prev].next = entry.next;
+  else
+    heads[entry.slot] = entry.next;
+  if (entry.next != none)
+    entries[entry.next].prev = entry.prev;
+}
+
+void sc2tm::TimerWheel::release(uint32_t index) {
+  Entry &entry = entries[index];
+  entry.callback = nullptr;
+  entry.slot = none;
+  ++entry.generation;
+  entry.next = freeList;
+  freeList = index;
+  --live;
+}
@@ -1,15 +1,51 @@
 #include "server/Server.h"
 #include "server/ServerOpts.h"
 
+#include <algorithm>
+#include <iostream>
+#include <thread>
+#include <vector>
+
 int main(int argc, char **argv) {
   // Parse out command line options
   sc2tm::ServerOpts opts;
   if (!opts.parseOpts(argc, argv))
     return 0;
 
-  boost::asio::io_service service;
-  sc2tm::Server s(service, opts.getOpt("bots"), opts.getOpt("maps"));
-  service.run();
+  // Work out how many threads to run the service on
+  unsigned ioThreads = opts.getUnsignedOpt("io-threads", 1);
+  if (ioThreads == 0)
+    ioThreads = std::max(1u, std::thread::hardware_concurrency());
+
+  try {
+    boost::asio::io_service service;
+    sc2tm::Server s(service, opts.getOpt("bots"), opts.getOpt("maps"), opts.getHashConfig(),
+                    opts.getServerConfig());
+
+    // Run the service on the pool, this thread is one of the workers. A handler that throws
+    // brings the whole service down rather than terminating from whichever thread it was on, and
+    // every worker is joined before the service goes away.
+    auto runFn =
+        [&service] () {
+          try {
+            service.run();
+          }
+          catch (std::exception &e) {
+            std::cerr << e.what() << std::endl;
+            service.stop();
+          }
+        };
+    std::vector<std::thread> pool;
+    for (unsigned i = 1; i < ioThreads; ++i)
+      pool.emplace_back(runFn);
+    runFn();
+
+    for (std::thread &thread : pool)
+      thread.join();
+  }
+  catch (std::exception& e) {
+    std::cerr << e.what() << std::endl;
+  }
 
   return 0;
 }
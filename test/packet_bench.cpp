@@ -0,0 +1,225 @@
+// Times encoding and decoding packets through the packet codec, against the same frames written
+// and read through std::ostream and std::istream the way the packet code used to, a field and a
+// hash at a time. Both sides decode into the same packet members, so only the codec differs.
+// Not run by ctest, run it by hand: packet_bench [rounds] [hashes]
+
+#include "common/file_operations.h"
+#include "common/HashRegistry.h"
+#include "common/packets.h"
+
+#include <arpa/inet.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <istream>
+#include <ostream>
+#include <random>
+#include <string>
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+//! Write a 32 bit integer the old way.
+void writeUint32(uint32_t value, std::ostream &os) {
+  value = htonl(value);
+  os.write((const char *) &value, sizeof(value));
+}
+
+//! Read a 32 bit integer the old way.
+uint32_t readUint32(std::istream &is) {
+  uint32_t value = 0;
+  is.read((char *) &value, sizeof(value));
+  return ntohl(value);
+}
+
+//! Write a hash the old way.
+void writeHashBuffer(const uint8_t *hash, std::ostream &os) {
+  os.write((const char *) hash, SHA256::DIGEST_SIZE);
+}
+
+//! Read a hash the old way.
+void readHashBuffer(uint8_t *hash, std::istream &is) {
+  is.read((char *) hash, SHA256::DIGEST_SIZE);
+}
+
+//! Write a frame header the old way.
+void writeHeader(sc2tm::MessageType type, size_t body, std::ostream &os) {
+  os << (uint8_t) type;
+  writeUint32((uint32_t) body, os);
+}
+
+//! Read a frame header the old way, returning the body's length.
+uint32_t readHeader(std::istream &is) {
+  uint8_t type;
+  is.read((char *) &type, 1);
+  return readUint32(is);
+}
+
+//! Write a handshake the old way, a hash at a time.
+void streamEncode(const sc2tm::ClientHandshakePacket &packet, boost::asio::streambuf &buffer) {
+  std::ostream os(&buffer);
+  writeHeader(sc2tm::HANDSHAKE, 4 + 2 * sizeof(uint32_t) + packet.botHashes.byteSize() +
+                                    packet.mapHashes.byteSize(), os);
+  os << packet.clientMajorVersion << packet.clientMinorVersion << packet.clientPatchVersion
+     << packet.queueDepth;
+  writeUint32((uint32_t) packet.botHashes.size(), os);
+  for (size_t i = 0; i < packet.botHashes.size(); ++i)
+    writeHashBuffer(packet.botHashes[i], os);
+  writeUint32((uint32_t) packet.mapHashes.size(), os);
+  for (size_t i = 0; i < packet.mapHashes.size(); ++i)
+    writeHashBuffer(packet.mapHashes[i], os);
+}
+
+//! Read a hash list the old way, a hash at a time, into a HashList.
+void readHashes(std::istream &is, sc2tm::HashList &hashes) {
+  uint32_t count = readUint32(is);
+  hashes.resize(count);
+  for (uint32_t i = 0; i < count; ++i)
+    readHashBuffer(hashes.data() + i * SHA256::DIGEST_SIZE, is);
+}
+
+//! Read a handshake written by streamEncode back into a packet.
+void streamDecode(boost::asio::streambuf &buffer, sc2tm::ClientHandshakePacket &packet) {
+  std::istream is(&buffer);
+  readHeader(is);
+  is.read((char *) &packet.clientMajorVersion, 1);
+  is.read((char *) &packet.clientMinorVersion, 1);
+  is.read((char *) &packet.clientPatchVersion, 1);
+  is.read((char *) &packet.queueDepth, 1);
+  readHashes(is, packet.botHashes);
+  readHashes(is, packet.mapHashes);
+}
+
+//! Write a game the old way.
+void streamEncode(const sc2tm::StartGamePacket &packet, boost::asio::streambuf &buffer) {
+  std::ostream os(&buffer);
+  writeHeader(sc2tm::START_GAME, sc2tm::StartGamePacket::size(), os);
+  writeUint32(packet.ticket, os);
+  writeHashBuffer(packet.data[0], os);
+  writeHashBuffer(packet.data[1], os);
+  writeHashBuffer(packet.data[2], os);
+}
+
+//! Read a game written by streamEncode back into a packet.
+void streamDecode(boost::asio::streambuf &buffer, sc2tm::StartGamePacket &packet) {
+  std::istream is(&buffer);
+  readHeader(is);
+  packet.ticket = readUint32(is);
+  readHashBuffer(packet.data[0], is);
+  readHashBuffer(packet.data[1], is);
+  readHashBuffer(packet.data[2], is);
+}
+
+//! Do both ways put the same bytes on the wire? If not the comparison means nothing.
+template <class P>
+bool sameFrames(const P &packet) {
+  boost::asio::streambuf streamed, coded;
+  streamEncode(packet, streamed);
+  packet.toBuffer(coded);
+  return streamed.size() == coded.size() &&
+         std::memcmp(boost::asio::buffer_cast<const uint8_t *>(streamed.data()),
+                     boost::asio::buffer_cast<const uint8_t *>(coded.data()), coded.size()) == 0;
+}
+
+//! Nanoseconds between two points.
+double nanos(Clock::time_point from, Clock::time_point to) {
+  return std::chrono::duration<double, std::nano>(to - from).count();
+}
+
+//! Time a packet both ways over some rounds and print the nanoseconds per packet.
+/**
+ * Time a packet both ways over some rounds and print the nanoseconds per packet. Each round
+ * encodes into a buffer and decodes straight back out of it into a copy of the packet.
+ *
+ * @return False if anything didn't decode to the packet it started as.
+ */
+template <class P, class Same>
+bool bench(const std::string &name, const P &packet, P &received, int rounds, Same same) {
+  if (!sameFrames(packet)) {
+    std::cerr << name << ": the iostream and codec frames differ\n";
+    return false;
+  }
+
+  double streamEncodeNs = 0, streamDecodeNs = 0, codecEncodeNs = 0, codecDecodeNs = 0;
+  bool ok = true;
+  boost::asio::streambuf buffer;
+  for (int round = 0; round < rounds; ++round) {
+    Clock::time_point start = Clock::now();
+    streamEncode(packet, buffer);
+    Clock::time_point encoded = Clock::now();
+    streamDecode(buffer, received);
+    Clock::time_point decoded = Clock::now();
+    streamEncodeNs += nanos(start, encoded);
+    streamDecodeNs += nanos(encoded, decoded);
+    ok = ok && same(packet, received);
+
+    start = Clock::now();
+    packet.toBuffer(buffer);
+    encoded = Clock::now();
+    sc2tm::FrameHeader header;
+    if (sc2tm::nextFrame(buffer, header) != sc2tm::FrameState::READY) {
+      std::cerr << name << ": the codec wrote a bad frame\n";
+      return false;
+    }
+    received = P(buffer, header.length);
+    decoded = Clock::now();
+    codecEncodeNs += nanos(start, encoded);
+    codecDecodeNs += nanos(encoded, decoded);
+    ok = ok && same(packet, received);
+  }
+
+  std::cout << name << ", ns per packet over " << rounds << " rounds\n";
+  std::cout << "  iostream: encode " << streamEncodeNs / rounds << ", decode "
+            << streamDecodeNs / rounds << '\n';
+  std::cout << "  codec:    encode " << codecEncodeNs / rounds << ", decode "
+            << codecDecodeNs / rounds << '\n';
+  if (!ok)
+    std::cerr << name << ": a packet didn't decode to what was sent\n";
+  return ok;
+}
+
+} // End anonymous namespace
+
+int main(int argc, char **argv) {
+  const int rounds = argc > 1 ? std::atoi(argv[1]) : 300;
+  const int hashes = argc > 2 ? std::atoi(argv[2]) : 10000;
+  if (rounds <= 0 || hashes < 3) {
+    std::cerr << "Usage: " << argv[0] << " [rounds] [hashes]\n";
+    return 1;
+  }
+
+  // Nine bots to every map, random hashes
+  sc2tm::SHAFileMap botMap, mapMap;
+  std::mt19937 rng(1);
+  for (int i = 0; i < hashes; ++i) {
+    uint8_t digest[SHA256::DIGEST_SIZE];
+    for (uint8_t &byte : digest)
+      byte = (uint8_t) rng();
+    (i % 10 ? botMap : mapMap)[std::to_string(i)] = std::make_shared<SHA256Hash>(digest);
+  }
+
+  // A big handshake, sent once per client
+  sc2tm::ClientHandshakePacket handshake(botMap, mapMap), handshakeCopy(botMap, mapMap);
+  auto sameHandshake =
+      [] (const sc2tm::ClientHandshakePacket &a, const sc2tm::ClientHandshakePacket &b) {
+        return a.botHashes.byteSize() == b.botHashes.byteSize() &&
+               a.mapHashes.byteSize() == b.mapHashes.byteSize() &&
+               std::memcmp(a.botHashes.data(), b.botHashes.data(), a.botHashes.byteSize()) == 0 &&
+               std::memcmp(a.mapHashes.data(), b.mapHashes.data(), a.mapHashes.byteSize()) == 0;
+      };
+  bool ok = bench("ClientHandshakePacket, " + std::to_string(hashes) + " hashes",
+                  handshake, handshakeCopy, rounds, sameHandshake);
+
+  // A game, sent for every game played, so many more rounds of it
+  sc2tm::HashRegistry botRegistry(botMap), mapRegistry(mapMap);
+  sc2tm::StartGamePacket game(7, sc2tm::Game{0, 1, 0, 0}, botRegistry, mapRegistry);
+  sc2tm::StartGamePacket gameCopy(0, sc2tm::Game{1, 0, 0, 0}, botRegistry, mapRegistry);
+  auto sameGame = [] (const sc2tm::StartGamePacket &a, const sc2tm::StartGamePacket &b) {
+    return a.ticket == b.ticket && std::memcmp(a.data, b.data, sizeof(a.data)) == 0;
+  };
+  ok = bench("StartGamePacket", game, gameCopy, rounds * 1000, sameGame) && ok;
+  return ok ? 0 : 1;
+}
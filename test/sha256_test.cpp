@@ -0,0 +1,192 @@
+// Cross checks every SHA256 backend the host supports against the NIST vectors and against the
+// portable transform. Exits non-zero if any digest disagrees.
+
+#include "common/sha256.h"
+
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+
+//! A message and its expected digest as hex.
+struct Vector {
+  std::string message;
+  const char *digest;
+};
+
+//! Digests from FIPS 180-2 and the NIST examples.
+const Vector nistVectors[] = {
+  { "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+  { "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+  { "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+    "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+  { "abcdefghbcdefghicdefghijdefghijkefghijklfghijklmghijklmnhijklmnoijklmnopjklmnopqklmnopqrlmnopqrsmnopqrstnopqrstu",
+    "cf5b16a778af8380036ce59e7b0492370b249b11e8f07a51afac45037afee9d1" },
+  { std::string(1000000, 'a'),
+    "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" },
+};
+
+//! Names for the backends, for failure messages.
+const char *backendNames[] = { "scalar", "x86 SHA-NI", "ARMv8 SHA2" };
+
+int failures = 0;
+
+std::string toHex(const uint8_t *digest) {
+  static const char digits[] = "0123456789abcdef";
+  std::string hex;
+  for (unsigned int i = 0; i < SHA256::DIGEST_SIZE; ++i) {
+    hex += digits[digest[i] >> 4];
+    hex += digits[digest[i] & 0xf];
+  }
+  return hex;
+}
+
+//! Hash a message with the selected backend, fed in pieces of at most step bytes.
+std::string hashInSteps(const std::vector<uint8_t> &message, size_t step) {
+  SHA256 ctx;
+  ctx.init();
+  for (size_t at = 0; at < message.size(); at += step)
+    ctx.update(message.data() + at, (unsigned int) std::min(step, message.size() - at));
+  uint8_t digest[SHA256::DIGEST_SIZE];
+  ctx.final(digest);
+  return toHex(digest);
+}
+
+void check(bool ok, const std::string &what) {
+  if (ok)
+    return;
+  ++failures;
+  std::cout << "FAIL: " << what << '\n';
+}
+
+//! The backends this host can run.
+std::vector<SHA256::Backend> supportedBackends() {
+  std::vector<SHA256::Backend> backends;
+  for (SHA256::Backend backend : { SHA256::SCALAR, SHA256::X86_SHA_NI, SHA256::ARMV8_SHA2 })
+    if (SHA256::isSupported(backend))
+      backends.push_back(backend);
+  return backends;
+}
+
+void testNistVectors(SHA256::Backend backend) {
+  for (const Vector &vector : nistVectors) {
+    std::vector<uint8_t> message(vector.message.begin(), vector.message.end());
+    // Whole, and split across block boundaries in awkward places
+    for (size_t step : { message.size() + 1, (size_t) 1, (size_t) 63, (size_t) 65 }) {
+      check(hashInSteps(message, step) == vector.digest,
+            std::string(backendNames[backend]) + " NIST vector of " +
+            std::to_string(message.size()) + " bytes in steps of " + std::to_string(step));
+    }
+  }
+}
+
+void testRandomLengths(SHA256::Backend backend, std::mt19937 &random) {
+  // Every length around the padding boundaries, then random ones
+  std::vector<size_t> lengths;
+  for (size_t len = 0; len <= 200; ++len)
+    lengths.push_back(len);
+  for (int i = 0; i < 200; ++i)
+    lengths.push_back(random() % 20000);
+
+  for (size_t len : lengths) {
+    std::vector<uint8_t> message(len);
+    for (uint8_t &byte : message)
+      byte = (uint8_t) random();
+    size_t step = 1 + random() % 300;
+
+    SHA256::selectBackend(SHA256::SCALAR);
+    std::string expected = hashInSteps(message, message.size() + 1);
+    SHA256::selectBackend(backend);
+    check(hashInSteps(message, step) == expected,
+          std::string(backendNames[backend]) + " random message of " + std::to_string(len) +
+          " bytes in steps of " + std::to_string(step));
+  }
+}
+
+void testMultiBuffer(std::mt19937 &random) {
+  SHA256::selectBackend(SHA256::SCALAR);
+
+  // Every lane count, so partly filled batches are covered, with lengths mixed in each batch
+  for (int round = 0; round < 100; ++round) {
+    for (unsigned int count = 1; count <= SHA256::MULTI_LANES; ++count) {
+      std::vector<std::vector<uint8_t>> messages(count);
+      std::vector<const unsigned char *> pointers(count);
+      std::vector<size_t> lens(count);
+      for (unsigned int i = 0; i < count; ++i) {
+        // Mostly short lengths straddling block boundaries, sometimes a long one
+        size_t len = random() % 4 == 0 ? random() % 10000 : random() % 192;
+        messages[i].resize(len);
+        for (uint8_t &byte : messages[i])
+          byte = (uint8_t) random();
+        pointers[i] = messages[i].data();
+        lens[i] = len;
+      }
+
+      std::vector<std::vector<uint8_t>> digests(count,
+                                                std::vector<uint8_t>(SHA256::DIGEST_SIZE));
+      std::vector<unsigned char *> outputs(count);
+      for (unsigned int i = 0; i < count; ++i)
+        outputs[i] = digests[i].data();
+
+      SHA256::selectMultiBuffer(true);
+      SHA256::digestLanes(pointers.data(), lens.data(), count, outputs.data());
+      SHA256::selectMultiBuffer(false);
+
+      for (unsigned int i = 0; i < count; ++i)
+        check(toHex(digests[i].data()) == hashInSteps(messages[i], messages[i].size() + 1),
+              "multi-buffer lane " + std::to_string(i) + " of " + std::to_string(count) +
+              " with " + std::to_string(lens[i]) + " bytes");
+    }
+  }
+
+  // The NIST vectors through the lanes as one batch
+  std::vector<const unsigned char *> pointers;
+  std::vector<size_t> lens;
+  for (const Vector &vector : nistVectors) {
+    pointers.push_back((const unsigned char *) vector.message.data());
+    lens.push_back(vector.message.size());
+  }
+  unsigned int count = (unsigned int) pointers.size();
+  std::vector<std::vector<uint8_t>> digests(count, std::vector<uint8_t>(SHA256::DIGEST_SIZE));
+  std::vector<unsigned char *> outputs;
+  for (std::vector<uint8_t> &digest : digests)
+    outputs.push_back(digest.data());
+
+  SHA256::selectMultiBuffer(true);
+  SHA256::digestLanes(pointers.data(), lens.data(), count, outputs.data());
+  SHA256::selectMultiBuffer(false);
+  for (unsigned int i = 0; i < count; ++i)
+    check(toHex(digests[i].data()) == nistVectors[i].digest,
+          "multi-buffer NIST vector of " + std::to_string(lens[i]) + " bytes");
+}
+
+} // End anonymous namespace
+
+int main() {
+  std::mt19937 random(12345);
+  SHA256::Backend original = SHA256::selectedBackend();
+
+  for (SHA256::Backend backend : supportedBackends()) {
+    std::cout << "Testing " << backendNames[backend] << '\n';
+    SHA256::selectBackend(backend);
+    testNistVectors(backend);
+    testRandomLengths(backend, random);
+  }
+
+  if (SHA256::isMultiBufferSupported()) {
+    std::cout << "Testing AVX2 multi-buffer\n";
+    testMultiBuffer(random);
+  }
+  else {
+    std::cout << "AVX2 multi-buffer not supported, skipped\n";
+  }
+
+  SHA256::selectBackend(original);
+  std::cout << (failures ? "FAILED: " : "PASSED") << (failures ? std::to_string(failures) : "")
+            << '\n';
+  return failures ? 1 : 0;
+}